@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <elf.h>
+
+namespace arancini::elf {
+/*
+  Writes a relocatable ELF64 object. Sections either own their contents, refer
+  to memory that outlives the writer (e.g. the mapped input binary) or, for
+  SHT_NOBITS, only have a size. Symbols are looked up by name and their
+  attributes can be refined incrementally, much like the directives of an
+  assembler.
+*/
+class elf_writer {
+  public:
+    struct symbol {
+        std::string name;
+        unsigned int section = SHN_UNDEF;
+        uint64_t value = 0;
+        uint64_t size = 0;
+        unsigned char binding = STB_LOCAL;
+        unsigned char type = STT_NOTYPE;
+        unsigned char visibility = STV_DEFAULT;
+    };
+
+    elf_writer(uint16_t machine, uint32_t flags)
+        : machine_(machine), flags_(flags) {}
+
+    // Returns the section with the given name, creating it if needed
+    unsigned int get_section(const std::string &name, uint32_t type,
+                             uint64_t flags, uint64_t align = 1);
+
+    // Refers to external data; it must stay valid until write() returns
+    void set_contents(unsigned int section, const void *data, size_t size);
+    void append(unsigned int section, const void *data, size_t size);
+    void append_u32(unsigned int section, uint32_t v) {
+        append(section, &v, sizeof(v));
+    }
+    void append_u64(unsigned int section, uint64_t v) {
+        append(section, &v, sizeof(v));
+    }
+    void reserve(unsigned int section, size_t size);
+    uint64_t size(unsigned int section) const {
+        return sections_.at(section).size;
+    }
+
+    symbol &get_symbol(const std::string &name);
+    bool has_symbol(const std::string &name) const {
+        return symbol_index_.count(name);
+    }
+
+    // An empty symbol name produces a relocation against no symbol (index 0)
+    void add_relocation(unsigned int section, uint64_t offset, uint32_t type,
+                        const std::string &sym, int64_t addend);
+    void add_section_relocation(unsigned int section, uint64_t offset,
+                                uint32_t type, unsigned int target,
+                                int64_t addend);
+
+    void write(const std::string &filename) const;
+
+  private:
+    struct section {
+        std::string name;
+        uint32_t type;
+        uint64_t flags;
+        uint64_t align;
+        std::vector<char> contents;
+        const void *external = nullptr;
+        uint64_t size = 0;
+    };
+
+    struct relocation {
+        uint64_t offset;
+        uint32_t type;
+        // Index into symbols_, -1 for none or -(section + 1) for the symbol
+        // of a section
+        long sym;
+        int64_t addend;
+    };
+
+    uint16_t machine_;
+    uint32_t flags_;
+    // Index 0 is the null section
+    std::vector<section> sections_{1};
+    // References returned by get_symbol() stay valid
+    std::deque<symbol> symbols_;
+    std::map<std::string, size_t> symbol_index_;
+    std::map<unsigned int, std::vector<relocation>> relocations_;
+};
+} // namespace arancini::elf
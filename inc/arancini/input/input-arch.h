@@ -1,7 +1,10 @@
 #pragma once
 
 #include <cstdlib>
+#include <map>
 #include <memory>
+#include <set>
+#include <string>
 #include <vector>
 namespace arancini::native_lib {
 class nlib_function;
@@ -12,6 +15,12 @@ class internal_function_resolver;
 } // namespace arancini::ir
 
 namespace arancini::input {
+struct code_region {
+    off_t address;
+    const void *code;
+    size_t size;
+};
+
 class input_arch {
   public:
     input_arch(bool debug = false) : debug_(debug) {}
@@ -21,6 +30,29 @@ class input_arch {
                                  const void *code, size_t code_size,
                                  bool basic_block, const std::string &name) = 0;
 
+    /*
+     * Recovers function boundaries by recursive-descent disassembly of the
+     * given code regions, starting from the given entry points.  Direct call
+     * targets are treated as further function entry points, addresses in
+     * external (e.g. PLT stubs) are never descended into.  Returns the start
+     * address and size of every function found; the size extends to the end
+     * of the last reachable instruction, but never into the next function.
+     */
+    virtual std::map<off_t, size_t>
+    recover_functions(const std::vector<code_region> &regions,
+                      const std::set<off_t> &entries,
+                      const std::set<off_t> &external) = 0;
+
+    /*
+     * Recognises jump tables used by indirect jumps in the given function and
+     * returns the possible targets of each such jump, reading the tables from
+     * the given data regions.  Targets outside of the function are dropped.
+     * The result is only a hint and may be incomplete.
+     */
+    virtual std::map<off_t, std::set<off_t>>
+    recover_jump_tables(const code_region &function,
+                        const std::vector<code_region> &data) = 0;
+
     virtual void gen_wrapper(ir::ir_builder &builder,
                              const native_lib::nlib_function &func) = 0;
 
@@ -17,6 +17,15 @@ class x86_input_arch : public input_arch {
                                  bool basic_block,
                                  const std::string &name) override;
 
+    std::map<off_t, size_t>
+    recover_functions(const std::vector<code_region> &regions,
+                      const std::set<off_t> &entries,
+                      const std::set<off_t> &external) override;
+
+    std::map<off_t, std::set<off_t>>
+    recover_jump_tables(const code_region &function,
+                        const std::vector<code_region> &data) override;
+
     void gen_wrapper(ir::ir_builder &builder,
                      const native_lib::nlib_function &func) override;
 
@@ -9,18 +9,6 @@
 #include <unordered_map>
 
 namespace arancini::native_lib {
-enum nlib_type_class {
-    NLTC_VOID,
-    NLTC_SINT,
-    NLTC_UINT,
-    NLTC_FLOAT,
-    NLTC_STRING,
-    NLTC_MEMPTR,
-    NLTC_FNPTR,
-    NLTC_FD,
-    NLTC_CPLX
-};
-
 class NativeLibs {
 #ifdef NLIB
   public:
@@ -29,7 +17,8 @@ class NativeLibs {
         scanner_.switch_streams(&in, NULL);
     }
     void add_function(const std::string &fname, std::string libname,
-                      ir::value_type type, std::vector<ir::value_type> vector);
+                      ir::value_type type, std::vector<ir::value_type> vector,
+                      std::vector<nlib_type_class> classes);
     [[maybe_unused]] void idl_commit(idl_ast_node &root);
 
     /// Return true iff parsing successful
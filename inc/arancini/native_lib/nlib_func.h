@@ -3,12 +3,30 @@
 #include <arancini/native_lib/idl-ast-node.h>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 namespace arancini::native_lib {
+enum nlib_type_class {
+    NLTC_VOID,
+    NLTC_SINT,
+    NLTC_UINT,
+    NLTC_FLOAT,
+    NLTC_STRING,
+    NLTC_MEMPTR,
+    NLTC_FNPTR,
+    NLTC_FD,
+    NLTC_CPLX,
+    NLTC_STRUCT
+};
+
 struct nlib_function {
     std::string fname;
     std::string libname;
 
     arancini::ir::function_type sig;
+
+    /// IDL class of each parameter in sig, used by the wrapper to marshal
+    /// arguments that need more than a register copy (e.g. callbacks).
+    std::vector<nlib_type_class> param_classes;
 };
 } // namespace arancini::native_lib
\ No newline at end of file
@@ -14,4 +14,12 @@ class backend_exception : public std::runtime_error {
 
 inline auto &logger = util::global_logger;
 
+// How the x86 (TSO) ordering of guest memory accesses is enforced
+enum class memory_ordering {
+    // Plain loads and stores; only safe for single-threaded guests
+    relaxed,
+    // Acquire loads and release stores (LDAR/STLR)
+    acquire_release,
+};
+
 } // namespace arancini::output::dynamic::arm64
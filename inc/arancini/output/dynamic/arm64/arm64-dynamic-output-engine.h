@@ -1,5 +1,6 @@
 #pragma once
 
+#include <arancini/output/dynamic/arm64/arm64-common.h>
 #include <arancini/output/dynamic/dynamic-output-engine.h>
 
 namespace arancini::output::dynamic::arm64 {
@@ -7,5 +8,10 @@ class arm64_dynamic_output_engine : public dynamic_output_engine {
   public:
     virtual std::shared_ptr<translation_context>
     create_translation_context(machine_code_writer &writer) override;
+
+    void set_memory_ordering(memory_ordering ordering) { ordering_ = ordering; }
+
+  private:
+    memory_ordering ordering_ = memory_ordering::relaxed;
 };
 } // namespace arancini::output::dynamic::arm64
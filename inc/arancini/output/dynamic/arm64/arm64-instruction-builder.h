@@ -109,6 +109,11 @@ class instruction_builder {
         append(instruction("mov", def(dst), use(src)).add_comment(comment));
     }
 
+    void adr(const register_operand &dst, const label_operand &label,
+             const std::string &comment = "") {
+        append(instruction("adr", def(dst), use(label)).add_comment(comment));
+    }
+
     void b(const label_operand &dest, const std::string &comment = "") {
         append(instruction("b", use(dest)).add_comment(comment).as_branch());
     }
@@ -226,6 +231,27 @@ class instruction_builder {
     STR_VARIANTS(strh);
     STR_VARIANTS(strb);
 
+    // Unscaled signed offsets (see s9())
+    LDR_VARIANTS(ldur);
+    LDR_VARIANTS(ldurh);
+    LDR_VARIANTS(ldurb);
+
+    STR_VARIANTS(stur);
+    STR_VARIANTS(sturh);
+    STR_VARIANTS(sturb);
+
+    LDR_VARIANTS(ldar);
+    LDR_VARIANTS(ldarh);
+    LDR_VARIANTS(ldarb);
+
+    STR_VARIANTS(stlr);
+    STR_VARIANTS(stlrh);
+    STR_VARIANTS(stlrb);
+
+    void dmb(const std::string &option, const std::string &comment = "") {
+        append(instruction("dmb " + option).add_comment(comment));
+    }
+
     void mul(const register_operand &dest, const register_operand &src1,
              const register_operand &src2, const std::string &comment = "") {
         append(instruction("mul", def(dest), use(src1), use(src2))
@@ -318,6 +344,10 @@ class instruction_builder {
         append(instruction("brk", use(imm)).add_comment(comment));
     }
 
+    void nop(const std::string &comment = "") {
+        append(instruction("nop").add_comment(comment));
+    }
+
     void label(const std::string &label, const std::string &comment = "") {
         append(instruction(label_operand(fmt::format("{}:", label)))
                    .add_comment(comment));
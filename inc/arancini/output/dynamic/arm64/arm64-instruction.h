@@ -43,6 +43,12 @@ static ir::value_type u12() {
     return type;
 }
 
+// Offsets of LDUR/STUR, which may be negative
+static ir::value_type s9() {
+    static ir::value_type type(ir::value_type_class::signed_integer, 9, 1);
+    return type;
+}
+
 class register_operand {
   public:
     enum regname64 : std::uint8_t {
@@ -298,8 +304,16 @@ class immediate_operand {
 
     [[nodiscard]]
     static bool fits(std::uintmax_t v, value_type type) {
-        return type.element_width() == 64 ||
-               (v & ((1llu << type.element_width()) - 1)) == v;
+        if (type.element_width() == 64)
+            return true;
+
+        if (type.type_class() == ir::value_type_class::signed_integer) {
+            auto bound = std::intmax_t(1) << (type.element_width() - 1);
+            auto sv = static_cast<std::intmax_t>(v);
+            return sv >= -bound && sv < bound;
+        }
+
+        return (v & ((1llu << type.element_width()) - 1)) == v;
     }
 
     [[nodiscard]]
@@ -307,6 +321,11 @@ class immediate_operand {
         return value_;
     }
 
+    [[nodiscard]]
+    bool is_signed() const {
+        return type_.type_class() == ir::value_type_class::signed_integer;
+    }
+
     [[nodiscard]]
     value_type &type() {
         return type_;
@@ -396,9 +415,22 @@ class memory_operand {
                    address_mode mode = address_mode::direct)
         : reg_base_(base), offset_(offset), mode_(mode) {}
 
+    // Register offset addressing: [base, index, LSL #shift]
+    //
+    // The shift must be either 0 or log2 of the access size.
+    memory_operand(const register_operand &base, const register_operand &index,
+                   unsigned int shift)
+        : reg_base_(base), reg_index_(index), has_index_(true),
+          index_shift_(shift), mode_(address_mode::direct) {}
+
     template <typename T> void set_base_reg(const T &op) { reg_base_ = op; }
 
-    bool is_virtual() const { return reg_base_.is_virtual(); }
+    template <typename T> void set_index_reg(const T &op) { reg_index_ = op; }
+
+    bool is_virtual() const {
+        return reg_base_.is_virtual() ||
+               (has_index_ && reg_index_.is_virtual());
+    }
     bool is_physical() const { return !is_virtual(); }
 
     [[nodiscard]]
@@ -416,6 +448,26 @@ class memory_operand {
         return reg_base_.type();
     }
 
+    [[nodiscard]]
+    bool has_index() const {
+        return has_index_;
+    }
+
+    [[nodiscard]]
+    register_operand &index_register() {
+        return reg_index_;
+    }
+
+    [[nodiscard]]
+    const register_operand &index_register() const {
+        return reg_index_;
+    }
+
+    [[nodiscard]]
+    unsigned int index_shift() const {
+        return index_shift_;
+    }
+
     [[nodiscard]]
     immediate_operand offset() const {
         return offset_;
@@ -428,6 +480,10 @@ class memory_operand {
 
   private:
     register_operand reg_base_;
+    register_operand reg_index_;
+
+    bool has_index_ = false;
+    unsigned int index_shift_ = 0;
 
     immediate_operand offset_ = immediate_operand(0, u12());
 
@@ -494,6 +550,17 @@ template <typename... Types> struct operand_variant final {
         mem->set_base_reg(register_operand(index, value_type));
     }
 
+    void allocate_index(int index, ir::value_type value_type) {
+        auto *mem = std::get_if<memory_operand>(&op_);
+        if (!mem || !mem->has_index())
+            throw backend_exception("trying to allocate non-indexed mem");
+
+        if (!mem->index_register().is_virtual())
+            throw backend_exception("trying to allocate non-virtual index");
+
+        mem->set_index_reg(register_operand(index, value_type));
+    }
+
   protected:
     base_type op_;
     bool use_ = false;
@@ -720,26 +787,39 @@ struct fmt::formatter<arancini::output::dynamic::arm64::memory_operand> {
         using namespace arancini::output::dynamic::arm64;
         using address_mode = memory_operand::address_mode;
 
-        if (mem.is_virtual())
+        if (mem.base_register().is_virtual())
             fmt::format_to(ctx.out(), "[%V{}_{}",
                            mem.base_register().type().element_width(),
                            mem.base_register().index());
         else
             fmt::format_to(ctx.out(), "[{}", mem.base_register());
 
+        if (mem.has_index()) {
+            fmt::format_to(ctx.out(), ", {}", mem.index_register());
+            if (mem.index_shift())
+                fmt::format_to(ctx.out(), ", LSL #{}", mem.index_shift());
+            return fmt::format_to(ctx.out(), "]");
+        }
+
         if (!mem.offset().value()) {
             return fmt::format_to(ctx.out(), "]");
         }
 
+        // Signed offsets (LDUR/STUR) may be negative
+        auto offset =
+            mem.offset().is_signed()
+                ? fmt::format("{:#x}",
+                              static_cast<std::intmax_t>(mem.offset().value()))
+                : fmt::format("{:#x}", mem.offset().value());
+
         if (mem.mode() != address_mode::post_index)
-            fmt::format_to(ctx.out(), ", #{:#x}]", mem.offset().value());
+            fmt::format_to(ctx.out(), ", #{}]", offset);
         else if (mem.mode() == address_mode::pre_index)
             fmt::format_to(ctx.out(), "!");
 
         if (mem.mode() == address_mode::post_index)
-            fmt::format_to(ctx.out(), "], #{:#x}", mem.offset().value());
+            fmt::format_to(ctx.out(), "], #{}", offset);
 
-        // TODO: register indirect with index
         return ctx.out();
     }
 };
@@ -119,8 +119,10 @@ class virtual_register_allocator {
 
 class arm64_translation_context : public translation_context {
   public:
-    arm64_translation_context(machine_code_writer &writer)
-        : translation_context(writer) {}
+    arm64_translation_context(
+        machine_code_writer &writer,
+        memory_ordering ordering = memory_ordering::relaxed)
+        : translation_context(writer), ordering_(ordering) {}
 
     virtual void begin_block() override;
     virtual void begin_instruction(off_t address,
@@ -129,6 +131,10 @@ class arm64_translation_context : public translation_context {
     virtual void end_block() override;
     virtual void lower(const std::shared_ptr<ir::action_node> &n) override;
 
+    virtual void chain(uint64_t chain_address, void *chain_target) override;
+
+    virtual bool enter_multithreaded() override;
+
     void reset_context();
 
     virtual ~arm64_translation_context() {}
@@ -143,10 +149,22 @@ class arm64_translation_context : public translation_context {
 
     virtual_register_allocator vreg_alloc_;
 
+    memory_ordering ordering_;
+    // Memory accesses need no ordering until the guest creates a thread
+    bool single_threaded_ = true;
+
+    // How the block leaves; only exits to static targets can be chained
+    enum class block_exit { none, direct, conditional };
+
     int ret_;
+    block_exit exit_;
+    const ir::port *exit_condition_;
     off_t this_pc_;
     std::size_t instr_cnt_ = 0;
 
+    // Exit stubs patched into direct branches to their successor
+    std::vector<std::uint32_t *> chained_sites_;
+
     // TODO: this should be included only when debugging is enabled
     std::string current_instruction_disasm_;
 
@@ -157,10 +175,21 @@ class arm64_translation_context : public translation_context {
     }
 
     memory_operand
-    guestreg_memory_operand(int regoff,
+    guestreg_memory_operand(int regoff, std::size_t size,
                             memory_operand::address_mode mode =
                                 memory_operand::address_mode::direct);
 
+    // Folds the displacement and scaled index of an address into the
+    // addressing mode of a memory access of count registers of size bytes
+    memory_operand fold_address(const ir::port &address, std::size_t size,
+                                std::size_t count, bool membase);
+
+    // Acquire/release accesses only take a base register
+    register_operand address_register(const memory_operand &mem);
+
+    // Returns to the trampoline with the address of a patchable site in x1
+    void chain_exit(const std::string &site);
+
     void materialise(const ir::node *n);
     void materialise_read_reg(const ir::read_reg_node &n);
     void materialise_write_reg(const ir::write_reg_node &n);
@@ -1,42 +1,76 @@
 #pragma once
 
-#include <arancini/output/dynamic/machine-code-allocator.h>
 #include <arancini/output/dynamic/machine-code-writer.h>
 
+#include <cstdint>
+
+#if defined(ARCH_AARCH64)
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 namespace arancini::output::dynamic {
 /**
- * Dummy allocator to allow overwriting code in chaining.
- * Only performs size checking.
+ * Chaining protocol
+ *
+ * Other threads may execute a chain site while it is patched, so a site is a
+ * single, naturally aligned 32-bit instruction that is replaced by a direct
+ * branch with one atomic store. A thread that still executes the old
+ * instruction returns to the runtime, which then finds the site chained
+ * already. On AArch64, only a few instructions (among them NOP and B) may be
+ * modified while another thread executes them, so sites are NOPs followed by
+ * the return to the runtime. Anything else the branch relies on (e.g. a stub
+ * for far targets) is written and made visible to all threads before the
+ * branch is published.
+ * Sites are identified by their executable address; all stores go through
+ * machine_code_writer::writable().
+ *
+ * Translations must be made visible to all threads before they can be reached
+ * (see synchronise_code()), so that a thread following a new branch never
+ * fetches stale instructions.
  */
-class chain_machine_code_allocator : public machine_code_allocator {
-  public:
-    explicit chain_machine_code_allocator(size_t size) : size_{size} {}
-    void *allocate(void *original, size_t size) override {
-        if (size <= size_) {
-            return original;
-        }
-        return nullptr;
-    }
 
-  private:
-    size_t size_;
-};
+/**
+ * Replaces the instruction at site and makes the new instruction visible to
+ * instruction fetch. The store goes through the writable alias of the site
+ * if the code cache is dual-mapped.
+ */
+inline void patch_instruction(const machine_code_writer &writer,
+                              std::uint32_t *site, std::uint32_t encoding) {
+    __atomic_store_n(static_cast<std::uint32_t *>(writer.writable(site)),
+                     encoding, __ATOMIC_RELEASE);
+    __builtin___clear_cache(reinterpret_cast<char *>(site),
+                            reinterpret_cast<char *>(site + 1));
+}
 
 /**
- * Writes code to a given address to allow overwriting code at that address in
- * chaining.
+ * Makes code written to [begin, end) safe to execute on all threads.
+ *
+ * On RISC-V, the instruction cache flush performs a fence.i on all harts of
+ * the process. On AArch64, it only invalidates the instruction caches, so the
+ * other threads are additionally forced through a context synchronisation
+ * event with membarrier(), which discards any instructions they prefetched.
  */
-class chain_machine_code_writer : public machine_code_writer {
-  public:
-    chain_machine_code_writer(void *target, size_t sizeE)
-        : machine_code_writer(alloc_, (void *)((uintptr_t)target & ~0xfull),
-                              ((uintptr_t)target & 0xfull),
-                              sizeE + ((uintptr_t)target & 0xfull)),
-          alloc_(sizeE + ((uintptr_t)target & 0xfull)) {}
-
-    ~chain_machine_code_writer() { finalise(); }
-
-  private:
-    chain_machine_code_allocator alloc_;
-};
+inline void synchronise_code(void *begin, void *end, bool multithreaded) {
+    __builtin___clear_cache(static_cast<char *>(begin),
+                            static_cast<char *>(end));
+
+#if defined(ARCH_AARCH64)
+    if (!multithreaded)
+        return;
+
+    static int registered = 0;
+    if (!__atomic_load_n(&registered, __ATOMIC_ACQUIRE)) {
+        syscall(__NR_membarrier,
+                MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0, 0);
+        __atomic_store_n(&registered, 1, __ATOMIC_RELEASE);
+    }
+
+    // Older kernels without SYNC_CORE fall back to the cache maintenance alone
+    syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0, 0);
+#else
+    (void)multithreaded;
+#endif
+}
 } // namespace arancini::output::dynamic
@@ -1,22 +1,40 @@
 #pragma once
 
+#include <cerrno>
 #include <cstdint>
 #include <cstdlib>
 #include <map>
 #include <stdexcept>
 #include <sys/mman.h>
+#include <unistd.h>
 
 namespace arancini::output::dynamic {
 class machine_code_allocator {
   public:
     virtual void *allocate(void *original, size_t size) = 0;
+
+    // Allocations are written through the pointers returned by allocate(),
+    // which may be an alias of the memory the code is executed from
+    virtual void *executable(void *code) const { return code; }
+    virtual void *writable(void *code) const { return code; }
+};
+
+/// How the code cache is mapped
+enum class code_mapping {
+    /// A single read-write-execute mapping
+    rwx,
+    /// A read-write and a read-execute view of the same memory
+    dual,
+    /// RWX, or dual-mapped if the host refuses writable executable memory
+    automatic
 };
 
 class arena {
   public:
-    arena(size_t size) : base_(nullptr), size_(size) {
+    arena(size_t size, code_mapping mapping = code_mapping::rwx)
+        : base_(nullptr), exec_base_(nullptr), size_(size) {
         // Attempt to allocate the arena memory area.
-        allocate();
+        allocate(mapping);
     }
 
     ~arena() {
@@ -24,70 +42,180 @@ class arena {
         free();
     }
 
+    // Base of the writable view
     void *base() const { return base_; }
     size_t size() const { return size_; }
+    bool is_dual_mapped() const { return exec_base_ != base_; }
+
+    void *executable(void *p) const {
+        return (char *)p - (char *)base_ + (char *)exec_base_;
+    }
+    void *writable(void *p) const {
+        return (char *)p - (char *)exec_base_ + (char *)base_;
+    }
 
   private:
-    void *base_;
+    void *base_, *exec_base_;
     size_t size_;
 
-    void allocate() {
-        // Use MMAP with the appropriate permissions to allow execution.  TODO:
-        // think about locking/unlocking the region to support W^X
-        base_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE | PROT_EXEC,
-                     MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    void allocate(code_mapping mapping) {
+        if (mapping != code_mapping::dual) {
+            // Use MMAP with the appropriate permissions to allow execution.
+            base_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE | PROT_EXEC,
+                         MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+            exec_base_ = base_;
+
+            if (base_ != MAP_FAILED) {
+                return;
+            }
+
+            // e.g. SELinux denying execmem
+            if (mapping == code_mapping::rwx ||
+                (errno != EACCES && errno != EPERM)) {
+                throw std::runtime_error("failed to allocate memory for arena");
+            }
+        }
 
-        if (base_ == MAP_FAILED) {
-            throw std::runtime_error("failed to allocate memory for arena");
+        allocate_dual();
+    }
+
+    // Maps a shared memory object twice, so that code is never writable and
+    // executable through the same mapping. Neither emission nor chaining has
+    // to change page permissions.
+    void allocate_dual() {
+        int fd = memfd_create("arancini-code-cache", MFD_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error("failed to create code cache memfd");
+        }
+
+        if (ftruncate(fd, size_) < 0) {
+            close(fd);
+            throw std::runtime_error("failed to size code cache memfd");
+        }
+
+        base_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        exec_base_ =
+            mmap(nullptr, size_, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+
+        // The mappings keep the memory object alive
+        close(fd);
+
+        if (base_ == MAP_FAILED || exec_base_ == MAP_FAILED) {
+            if (base_ != MAP_FAILED) {
+                munmap(base_, size_);
+            }
+            if (exec_base_ != MAP_FAILED) {
+                munmap(exec_base_, size_);
+            }
+            throw std::runtime_error("failed to map dual-mapped arena");
         }
     }
 
-    void free() { munmap(base_, size_); }
+    void free() {
+        if (is_dual_mapped()) {
+            munmap(exec_base_, size_);
+        }
+        munmap(base_, size_);
+    }
+};
+
+/// Part of the arena that code is allocated from
+enum class code_region {
+    /// Code in the order it is first executed
+    cold,
+    /// Code that has proven hot, kept together to use fewer cache lines and
+    /// pages
+    hot
 };
 
 class arena_machine_code_allocator : public machine_code_allocator {
   public:
-    arena_machine_code_allocator(arena &a)
-        : arena_(a), next_allocation_(a.base()), current_allocation_(nullptr),
-          current_allocation_size_(0) {}
+    // The first hot_size bytes of the arena form the hot region, the rest the
+    // cold region. Allocations go to the cold region until another one is
+    // selected.
+    arena_machine_code_allocator(arena &a, size_t hot_size = 0)
+        : regions_{{(char *)a.base() + hot_size, (char *)a.base() + a.size()},
+                   {(char *)a.base(), (char *)a.base() + hot_size}},
+          arena_(a), current_region_(&regions_[0]) {
+        if (hot_size > a.size()) {
+            throw std::runtime_error("hot region larger than arena");
+        }
+    }
+
+    void select_region(code_region r) {
+        current_region_ = &regions_[static_cast<int>(r)];
+    }
+
+    // Region of the given writable code address
+    code_region region_of(const void *code) const {
+        const auto &hot = regions_[static_cast<int>(code_region::hot)];
+        return code >= hot.begin && code < hot.end ? code_region::hot
+                                                   : code_region::cold;
+    }
+
+    // Bytes left in a region, not counting its current allocation
+    size_t available(code_region r) const {
+        const auto &region = regions_[static_cast<int>(r)];
+        auto *next = region.next + ((region.current_size + 15) & ~0xfull);
+        return next < region.end ? region.end - next : 0;
+    }
 
     virtual void *allocate(void *original, size_t size) override {
+        auto &region = *current_region_;
         if (original == nullptr) {
             // Increment the next allocation by the size of the current
             // allocation, aligned by 16 bytes.
-            next_allocation_ =
-                (void *)((uintptr_t)next_allocation_ +
-                         ((current_allocation_size_ + 15) & ~0xfull));
+            region.next += (region.current_size + 15) & ~0xfull;
 
-            if ((uintptr_t)next_allocation_ >
-                ((uintptr_t)arena_.base() + arena_.size())) {
+            if (region.next + size > region.end) {
                 throw std::runtime_error("out of memory");
             }
 
             // Record the size and pointer of the current allocation.
-            current_allocation_size_ = size;
-            current_allocation_ = next_allocation_;
+            region.current_size = size;
+            region.current = region.next;
 
             // Return the current allocation
-            return current_allocation_;
+            return region.current;
         } else {
             // Adjustments can only be made to the current allocation.
-            if (original != current_allocation_) {
+            if (original != region.current) {
                 throw std::runtime_error("multiple allocations not supported");
             }
 
+            if (region.current + size > region.end) {
+                throw std::runtime_error("out of memory");
+            }
+
             // Modify the current allocation size, and return the original
             // allocation.
-            current_allocation_size_ = size;
+            region.current_size = size;
             return original;
         }
     }
 
+    virtual void *executable(void *code) const override {
+        return arena_.executable(code);
+    }
+
+    virtual void *writable(void *code) const override {
+        return arena_.writable(code);
+    }
+
   private:
+    struct region {
+        region(char *begin, char *end)
+            : begin(begin), end(end), next(begin), current(nullptr),
+              current_size(0) {}
+
+        char *begin, *end;
+        char *next, *current;
+        size_t current_size;
+    };
+
+    // Indexed by code_region
+    region regions_[2];
     arena &arena_;
-    void *next_allocation_, *current_allocation_;
-
-    [[maybe_unused]] size_t arena_size_;
-    size_t current_allocation_size_;
+    region *current_region_;
 };
 } // namespace arancini::output::dynamic
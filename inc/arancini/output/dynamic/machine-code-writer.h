@@ -55,10 +55,16 @@ class machine_code_writer {
     void *ptr() const { return code_ptr_; }
     size_t size() const { return code_size_; }
 
+    // Address the code will be executed from
+    void *exec_ptr() const { return allocator_.executable(code_ptr_); }
+
+    // Translates an address of emitted code into one it can be modified at
+    void *writable(void *code) const { return allocator_.writable(code); }
+
     void finalise() {
         code_ptr_ = allocator_.allocate(code_ptr_, code_size_);
-        __builtin___clear_cache(static_cast<char *>(code_ptr_),
-                                ((char *)code_ptr_ + code_size_));
+        auto *code = static_cast<char *>(exec_ptr());
+        __builtin___clear_cache(code, code + code_size_);
         alloc_size_ = code_size_;
 
         util::global_logger.info(
@@ -43,6 +43,8 @@ inline void bit_extract(InstructionBuilder &builder, TypedRegister &out,
             builder.srli(out, src, 63);
         } else if (from == 31) {
             builder.srliw(out, src, 31);
+        } else if (builder.supports(RV_Zbs)) {
+            builder.bexti(out, src, from);
         } else {
             builder.srli(out, src, from);
             builder.andi(out, out, 1);
@@ -73,6 +75,14 @@ inline void bit_extract(InstructionBuilder &builder, TypedRegister &out,
         return;
     }
 
+    if (from == 0 && (length == 8 || length == 16) &&
+        builder.supports(RV_Zbb)) {
+        sign_extend(builder, out, src1, length);
+        out.set_actual_width();
+        out.set_type(value_type::u64());
+        return;
+    }
+
     RegisterOperand temp = length + from < 64 ? out : src1;
     if (length + from < 64) {
         builder.slli(out, src1, 64 - (from + length));
@@ -110,6 +120,14 @@ inline void bit_insert(InstructionBuilder &builder, TypedRegister &out,
             // `~mask` also fits IType since `mask` has all but lower bits set
             builder.andi(temp_reg, bits, ~mask);
             builder.andi(out1, src1, mask);
+        } else if (length == 1 && builder.supports(RV_Zbs)) {
+            // Clearing a single bit needs no mask constant
+            builder.bclri(out1, src1, to);
+
+            builder.slli(temp_reg, bits, 63);
+            if (to != 63) {
+                builder.srli(temp_reg, temp_reg, 63 - to);
+            }
         } else {
             RegisterOperand temp_reg1 = builder.next_register();
             gen_constant(builder, mask, temp_reg1);
@@ -130,3 +148,17 @@ inline void bit_insert(InstructionBuilder &builder, TypedRegister &out,
         throw std::runtime_error("not implemented");
     }
 }
+
+/**
+ * Reverse the bytes of a 32 or 64 bit value (Zbb)
+ */
+inline void byte_reverse(InstructionBuilder &builder, TypedRegister &out,
+                         const TypedRegister &src) {
+    builder.rev8(out, src);
+    if (out.type().element_width() == 32) {
+        // The lower word ends up in the upper half
+        builder.srai(out, out, 32);
+        out.set_actual_width(32);
+        out.set_type(value_type::u64());
+    }
+}
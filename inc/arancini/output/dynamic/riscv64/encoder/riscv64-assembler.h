@@ -543,6 +543,10 @@ class Assembler {
     void bset(Register rd, Register rs1, Register rs2);
     void bseti(Register rd, Register rs1, intx_t shamt);
 
+    // ==== Zicond: Integer conditional operations ====
+    void czeroeqz(Register rd, Register rs1, Register rs2);
+    void czeronez(Register rd, Register rs1, Register rs2);
+
   private:
     // ==== RV32/64C ====
     void c_lwsp(Register rd, Address addr);
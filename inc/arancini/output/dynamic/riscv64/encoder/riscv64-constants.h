@@ -366,6 +366,9 @@ enum Funct3 {
     BEXT = 0b101,
     F3_BINV = 0b001,
     F3_BSET = 0b001,
+
+    CZEROEQZ = 0b101,
+    CZERONEZ = 0b111,
 };
 
 enum Funct7 {
@@ -413,6 +416,7 @@ enum Funct7 {
     BCLRBEXT = 0b0100100,
     BINV = 0b0110100,
     BSET = 0b0010100,
+    CZERO = 0b0000111,
 };
 
 enum Funct5 {
@@ -1033,6 +1037,7 @@ static constexpr Extension RV_Zbc(8); // Carry-less multiplicatio
 static constexpr Extension RV_Zbs(9); // Single-bit instructions
 static constexpr ExtensionSet RV_B = RV_Zba | RV_Zbb | RV_Zbc | RV_Zbs;
 static constexpr ExtensionSet RV_GCB = RV_GC | RV_B;
+static constexpr Extension RV_Zicond(10); // Integer conditional operations
 
 } // namespace arancini::output::dynamic::riscv64
 
@@ -12,6 +12,9 @@ namespace arancini::output::dynamic::riscv64::builder {
 
 class InstructionBuilder {
   public:
+    explicit InstructionBuilder(ExtensionSet extensions = RV_GC)
+        : extensions_(extensions) {}
+
     void Align(intptr_t alignByte) {
         instructions_.emplace_back(InstructionType::Imm,
                                    (ImmFunc)&Assembler::Align, alignByte);
@@ -767,58 +770,79 @@ class InstructionBuilder {
             // double <--bit_cast-- xlen
             void fmvdx(FRegisterOperand rd, RegisterOperand rs1);
     #endif // XLEN >= 64
+    */
 
-            // ==== Zba: AddressOperand generation ====
-            void adduw(RegisterOperand rd, RegisterOperand rs1, RegisterOperand
-    rs2); void sh1add(RegisterOperand rd, RegisterOperand rs1, RegisterOperand
-    rs2); void sh1adduw(RegisterOperand rd, RegisterOperand rs1, RegisterOperand
-    rs2); void sh2add(RegisterOperand rd, RegisterOperand rs1, RegisterOperand
-    rs2); void sh2adduw(RegisterOperand rd, RegisterOperand rs1, RegisterOperand
-    rs2); void sh3add(RegisterOperand rd, RegisterOperand rs1, RegisterOperand
-    rs2); void sh3adduw(RegisterOperand rd, RegisterOperand rs1, RegisterOperand
-    rs2); void slliuw(RegisterOperand rd, RegisterOperand rs1, intx_t imm);
-
-            // ==== Zbb: Basic bit-manipulation ====
-            void andn(RegisterOperand rd, RegisterOperand rs1, RegisterOperand
-    rs2); void orn(RegisterOperand rd, RegisterOperand rs1, RegisterOperand
-    rs2); void xnor(RegisterOperand rd, RegisterOperand rs1, RegisterOperand
-    rs2); void clz(RegisterOperand rd, RegisterOperand rs); void
-    clzw(RegisterOperand rd, RegisterOperand rs); void ctz(RegisterOperand rd,
-    RegisterOperand rs); void ctzw(RegisterOperand rd, RegisterOperand rs); void
-    cpop(RegisterOperand rd, RegisterOperand rs); void cpopw(RegisterOperand rd,
-    RegisterOperand rs); void max(RegisterOperand rd, RegisterOperand rs1,
-    RegisterOperand rs2); void maxu(RegisterOperand rd, RegisterOperand rs1,
-    RegisterOperand rs2); void min(RegisterOperand rd, RegisterOperand rs1,
-    RegisterOperand rs2); void minu(RegisterOperand rd, RegisterOperand rs1,
-    RegisterOperand rs2); void sextb(RegisterOperand rd, RegisterOperand rs);
-            void sexth(RegisterOperand rd, RegisterOperand rs);
-            void zexth(RegisterOperand rd, RegisterOperand rs);
-            void rol(RegisterOperand rd, RegisterOperand rs1, RegisterOperand
-    rs2); void rolw(RegisterOperand rd, RegisterOperand rs1, RegisterOperand
-    rs2); void ror(RegisterOperand rd, RegisterOperand rs1, RegisterOperand
-    rs2); void rori(RegisterOperand rd, RegisterOperand rs1, intx_t imm); void
-    roriw(RegisterOperand rd, RegisterOperand rs1, intx_t imm); void
-    rorw(RegisterOperand rd, RegisterOperand rs1, RegisterOperand rs2); void
-    orcb(RegisterOperand rd, RegisterOperand rs); void rev8(RegisterOperand rd,
-    RegisterOperand rs);
-
-            // ==== Zbc: Carry-less multiplication ====
-            void clmul(RegisterOperand rd, RegisterOperand rs1, RegisterOperand
-    rs2); void clmulh(RegisterOperand rd, RegisterOperand rs1, RegisterOperand
-    rs2); void clmulr(RegisterOperand rd, RegisterOperand rs1, RegisterOperand
-    rs2);
-
-            // ==== Zbs: Single-bit instructions ====
-            void bclr(RegisterOperand rd, RegisterOperand rs1, RegisterOperand
-    rs2); void bclri(RegisterOperand rd, RegisterOperand rs1, intx_t shamt);
-            void bext(RegisterOperand rd, RegisterOperand rs1, RegisterOperand
-    rs2); void bexti(RegisterOperand rd, RegisterOperand rs1, intx_t shamt);
-            void binv(RegisterOperand rd, RegisterOperand rs1, RegisterOperand
-    rs2); void binvi(RegisterOperand rd, RegisterOperand rs1, intx_t shamt);
-            void bset(RegisterOperand rd, RegisterOperand rs1, RegisterOperand
-    rs2); void bseti(RegisterOperand rd, RegisterOperand rs1, intx_t shamt);
+    // ==== Zba: Address generation ====
+    void adduw(RegisterOperand rd, RegisterOperand rs1, RegisterOperand rs2) {
+        instructions_.emplace_back(InstructionType::RdRs1Rs2,
+                                   &Assembler::adduw, rd, rs1, rs2);
+    }
+    void sh1add(RegisterOperand rd, RegisterOperand rs1, RegisterOperand rs2) {
+        instructions_.emplace_back(InstructionType::RdRs1Rs2,
+                                   &Assembler::sh1add, rd, rs1, rs2);
+    }
+    void sh2add(RegisterOperand rd, RegisterOperand rs1, RegisterOperand rs2) {
+        instructions_.emplace_back(InstructionType::RdRs1Rs2,
+                                   &Assembler::sh2add, rd, rs1, rs2);
+    }
+    void sh3add(RegisterOperand rd, RegisterOperand rs1, RegisterOperand rs2) {
+        instructions_.emplace_back(InstructionType::RdRs1Rs2,
+                                   &Assembler::sh3add, rd, rs1, rs2);
+    }
+    void zextw(RegisterOperand rd, RegisterOperand rs) { adduw(rd, rs, ZERO); }
 
-    */
+    // ==== Zbb: Basic bit-manipulation ====
+    void cpop(RegisterOperand rd, RegisterOperand rs) {
+        instructions_.emplace_back(InstructionType::RdRs1, &Assembler::cpop, rd,
+                                   rs);
+    }
+    void sextb(RegisterOperand rd, RegisterOperand rs) {
+        instructions_.emplace_back(InstructionType::RdRs1, &Assembler::sextb,
+                                   rd, rs);
+    }
+    void sexth(RegisterOperand rd, RegisterOperand rs) {
+        instructions_.emplace_back(InstructionType::RdRs1, &Assembler::sexth,
+                                   rd, rs);
+    }
+    void zexth(RegisterOperand rd, RegisterOperand rs) {
+        instructions_.emplace_back(InstructionType::RdRs1, &Assembler::zexth,
+                                   rd, rs);
+    }
+    void rev8(RegisterOperand rd, RegisterOperand rs) {
+        instructions_.emplace_back(InstructionType::RdRs1, &Assembler::rev8, rd,
+                                   rs);
+    }
+
+    // ==== Zbs: Single-bit instructions ====
+    void bclri(RegisterOperand rd, RegisterOperand rs1, intptr_t shamt) {
+        instructions_.emplace_back(InstructionType::RdRs1Imm,
+                                   &Assembler::bclri, rd, rs1, shamt);
+    }
+    void bexti(RegisterOperand rd, RegisterOperand rs1, intptr_t shamt) {
+        instructions_.emplace_back(InstructionType::RdRs1Imm,
+                                   &Assembler::bexti, rd, rs1, shamt);
+    }
+    void bseti(RegisterOperand rd, RegisterOperand rs1, intptr_t shamt) {
+        instructions_.emplace_back(InstructionType::RdRs1Imm,
+                                   &Assembler::bseti, rd, rs1, shamt);
+    }
+
+    // ==== Zicond: Integer conditional operations ====
+    void czeroeqz(RegisterOperand rd, RegisterOperand rs1,
+                  RegisterOperand rs2) {
+        instructions_.emplace_back(InstructionType::RdRs1Rs2,
+                                   &Assembler::czeroeqz, rd, rs1, rs2);
+    }
+    void czeronez(RegisterOperand rd, RegisterOperand rs1,
+                  RegisterOperand rs2) {
+        instructions_.emplace_back(InstructionType::RdRs1Rs2,
+                                   &Assembler::czeronez, rd, rs1, rs2);
+    }
+
+    // Whether lowering may use instructions of the given extension
+    [[nodiscard]] bool supports(Extension extension) const {
+        return extensions_.Includes(extension);
+    }
 
     RegisterOperand next_register() {
         return RegisterOperand{reg_allocator_index_++};
@@ -1119,6 +1143,7 @@ class InstructionBuilder {
     }
 
   private:
+    const ExtensionSet extensions_;
     uint32_t reg_allocator_index_{RegisterOperand::VIRTUAL_BASE};
     std::vector<Instruction> instructions_;
     std::vector<std::unique_ptr<Label>> labels_;
@@ -16,6 +16,7 @@ enum class InstructionType {
     RdLabelNear,
     RdLabelFar,
     RdRs1Imm,
+    RdRs1,
     Rs1Rs2LabelNear,
     Rs1Rs2LabelFar,
     Rs1Rs2Label,
@@ -35,6 +36,7 @@ using LabelFunc = decltype(&Assembler::Bind);
 using RdImmFunc = decltype(&Assembler::lui);
 using RdLabelFunc = void (Assembler::*)(Register, Label *, bool);
 using RdRs1ImmFunc = decltype(&Assembler::xori);
+using RdRs1Func = decltype(&Assembler::sextb);
 using Rs1Rs2LabelBoolFunc = void (Assembler::*)(Register, Register, Label *,
                                                 bool);
 using Rs1Rs2LabelFunc = void (Assembler::*)(Register, Register, Label *);
@@ -91,6 +93,12 @@ struct Instruction {
           rdRs1ImmFunc_(rdRs1ImmFunc) {
         ASSERT(!(!rd && has_rd()));
     }
+    Instruction(const InstructionType type, const RdRs1Func rdRs1Func,
+                const RegisterOperand rd, const RegisterOperand rs1)
+        : rd(rd), rs1(rs1), rs2(none_reg), imm(0), type_(type),
+          rdRs1Func_(rdRs1Func) {
+        ASSERT(!(!rd && has_rd()));
+    }
     Instruction(const InstructionType type,
                 const Rs1Rs2LabelBoolFunc rs1Rs2LabelBoolFunc,
                 const RegisterOperand rs1, const RegisterOperand rs2,
@@ -167,6 +175,9 @@ struct Instruction {
         case InstructionType::RdRs1ImmKeepRs2:
             (assembler.*rdRs1ImmFunc_)(rd, rs1, imm);
             break;
+        case InstructionType::RdRs1:
+            (assembler.*rdRs1Func_)(rd, rs1);
+            break;
         case InstructionType::Rs1Rs2LabelNear:
             (assembler.*rs1Rs2LabelBoolFunc_)(rs1, rs2, label, kNearJump);
             break;
@@ -219,6 +230,7 @@ struct Instruction {
         case InstructionType::RdLabelNear:
         case InstructionType::RdLabelFar:
         case InstructionType::RdRs1Imm:
+        case InstructionType::RdRs1:
         case InstructionType::RdAddr:
         case InstructionType::RdRs1Rs2:
         case InstructionType::RdAddrOrder:
@@ -247,6 +259,7 @@ struct Instruction {
         case InstructionType::Dead:
             return false;
         case InstructionType::RdRs1Imm:
+        case InstructionType::RdRs1:
         case InstructionType::RdAddr:
         case InstructionType::RdAddrOrder:
         case InstructionType::RdImmKeepRs1:
@@ -352,6 +365,12 @@ struct Instruction {
                 out << "srliw";
             } else if (rdRs1ImmFunc_ == &Assembler::xori) {
                 out << "xori";
+            } else if (rdRs1ImmFunc_ == &Assembler::bclri) {
+                out << "bclri";
+            } else if (rdRs1ImmFunc_ == &Assembler::bexti) {
+                out << "bexti";
+            } else if (rdRs1ImmFunc_ == &Assembler::bseti) {
+                out << "bseti";
             } else {
                 throw std::runtime_error("Unknown RdRs1Imm function");
             }
@@ -359,6 +378,20 @@ struct Instruction {
                 << rs1.encoding() << ", " << std::hex << "0x" << imm;
 
             break;
+        case InstructionType::RdRs1:
+            // clang-format off
+			handle_instr(rdRs1Func_, cpop)
+			ehandle_instr(rdRs1Func_, rev8)
+			ehandle_instr(rdRs1Func_, sextb)
+			ehandle_instr(rdRs1Func_, sexth)
+			ehandle_instr(rdRs1Func_, zexth)
+			else {
+                // clang-format on
+                throw std::runtime_error("Unknown RdRs1 function");
+            }
+            out << " " << std::dec << "xV" << rd.encoding() << ", xV"
+                << rs1.encoding();
+            break;
         case InstructionType::Rs1Rs2LabelNear:
         case InstructionType::Rs1Rs2LabelFar:
             if (rs1Rs2LabelBoolFunc_ == (Rs1Rs2LabelBoolFunc)&Assembler::bne) {
@@ -454,6 +487,12 @@ struct Instruction {
 			ehandle_instr(rdRs1Rs2Func_, sub)
 			ehandle_instr(rdRs1Rs2Func_, subw)
 			ehandle_instr(rdRs1Rs2Func_, xor_)
+			ehandle_instr(rdRs1Rs2Func_, adduw)
+			ehandle_instr(rdRs1Rs2Func_, sh1add)
+			ehandle_instr(rdRs1Rs2Func_, sh2add)
+			ehandle_instr(rdRs1Rs2Func_, sh3add)
+			ehandle_instr(rdRs1Rs2Func_, czeroeqz)
+			ehandle_instr(rdRs1Rs2Func_, czeronez)
 			else {
                 // clang-format on
                 throw std::runtime_error("Unknown RdRs1Rs2 function");
@@ -584,6 +623,7 @@ struct Instruction {
         case InstructionType::Dead:
         case InstructionType::RdImm:
         case InstructionType::RdRs1Imm:
+        case InstructionType::RdRs1:
         case InstructionType::RdAddr:
         case InstructionType::Rs2Addr:
         case InstructionType::RdRs1Rs2:
@@ -615,6 +655,7 @@ struct Instruction {
         const RdImmFunc rdImmFunc_;
         const RdLabelFunc rdLabelFunc_;
         const RdRs1ImmFunc rdRs1ImmFunc_;
+        const RdRs1Func rdRs1Func_;
         const Rs1Rs2LabelBoolFunc rs1Rs2LabelBoolFunc_;
         const Rs1Rs2LabelFunc rs1Rs2LabelFunc_;
         const RdAddrFunc rdAddrFunc_;
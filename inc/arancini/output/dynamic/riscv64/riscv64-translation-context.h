@@ -27,8 +27,10 @@ using builder::InstructionBuilder;
 
 class riscv64_translation_context : public translation_context {
   public:
-    riscv64_translation_context(machine_code_writer &writer)
-        : translation_context(writer), assembler_(&writer, true, RV_GC) {}
+    riscv64_translation_context(machine_code_writer &writer,
+                                ExtensionSet extensions = RV_GC)
+        : translation_context(writer), builder_(extensions),
+          assembler_(&writer, true, extensions) {}
 
     virtual void begin_block() override;
     virtual void begin_instruction(off_t address,
@@ -74,6 +76,7 @@ class riscv64_translation_context : public translation_context {
     RegisterOperand get_or_assign_mapped_register(uint32_t idx);
     RegisterOperand get_or_load_mapped_register(uint32_t idx);
     void write_back_registers();
+    void emit_chain_site(bool keep_a1);
 
     std::optional<std::reference_wrapper<TypedRegister>>
     materialise(const ir::node *n);
@@ -91,6 +94,8 @@ class riscv64_translation_context : public translation_context {
     TypedRegister &materialise_constant(int64_t imm);
     TypedRegister &materialise_unary_arith(const ir::unary_arith_node &n);
     TypedRegister &materialise_binary_arith(const ir::binary_arith_node &n);
+    bool materialise_shift_add(TypedRegister &out,
+                               const ir::binary_arith_node &n);
     TypedRegister &materialise_ternary_arith(const ir::ternary_arith_node &n);
     TypedRegister &materialise_bit_shift(const ir::bit_shift_node &n);
     TypedRegister &materialise_bit_extract(const ir::bit_extract_node &n);
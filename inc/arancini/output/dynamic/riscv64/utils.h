@@ -7,6 +7,18 @@
 
 using builder::InstructionBuilder;
 
+/**
+ * Sign extend the lower 8 or 16 bits of src with a single Zbb instruction
+ */
+inline void sign_extend(InstructionBuilder &builder, RegisterOperand out,
+                        RegisterOperand src, int width) {
+    if (width == 8) {
+        builder.sextb(out, src);
+    } else {
+        builder.sexth(out, src);
+    }
+}
+
 /**
  * Sign extend src into full register width to allow using full reg instructions
  * @param builder
@@ -19,6 +31,12 @@ inline void extend_to_64(InstructionBuilder &builder, TypedRegister &out,
         switch (src.type().element_width()) {
         case 8:
         case 16:
+            if (builder.supports(RV_Zbb)) {
+                sign_extend(builder, out, src, src.type().element_width());
+                out.set_actual_width();
+                out.set_type(value_type::u64());
+                break;
+            }
             builder.slli(out, src, 64 - src.type().element_width());
             builder.srai(out, out, 64 - src.type().element_width());
             out.set_actual_width();
@@ -75,6 +93,13 @@ inline bool fixup(InstructionBuilder &builder, TypedRegister &out,
             switch (src.type().element_width()) {
             case 8:
             case 16:
+                // The shift pair is as short when a shift is folded in
+                if (builder.supports(RV_Zbb) && !shift_by) {
+                    sign_extend(builder, out, src, src.type().element_width());
+                    out.set_actual_width();
+                    out.set_type(value_type::u64());
+                    return false;
+                }
                 builder.slli(out, src, 64 - src.type().element_width());
                 builder.srai(out, out,
                              64 - src.type().element_width() - shift_by);
@@ -107,6 +132,20 @@ inline bool fixup(InstructionBuilder &builder, TypedRegister &out,
                 return false;
             case 16:
             case 32:
+                if (builder.supports(RV_Zbb) && !shift_by &&
+                    src.actual_width() == 16) {
+                    builder.zexth(out, src);
+                    out.set_type(value_type::u64());
+                    out.set_actual_width(0);
+                    return false;
+                }
+                if (builder.supports(RV_Zba) && !shift_by &&
+                    src.actual_width() == 32) {
+                    builder.zextw(out, src);
+                    out.set_type(value_type::u64());
+                    out.set_actual_width(0);
+                    return false;
+                }
                 builder.slli(out, src, 64 - src.actual_width());
                 builder.srli(out, out, 64 - src.actual_width() - shift_by);
                 out.set_type(value_type::u64());
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <arancini/ir/node.h>
+#include <cstdint>
 #include <cstdlib>
 #include <memory>
 #include <string>
@@ -28,11 +29,29 @@ class translation_context {
         // Default to No-op
     };
 
+    /*
+     * Called when the guest creates its first thread.  Returns true if the
+     * code translated so far relied on the guest being single-threaded, and
+     * must therefore be discarded.
+     */
+    virtual bool enter_multithreaded() { return false; }
+
     virtual void lower(const std::shared_ptr<ir::action_node> &n) = 0;
 
     machine_code_writer &writer() const { return writer_; }
 
+    /*
+     * Counter to increment on every entry to the next translated block, or
+     * nullptr for none.  The increment is a plain load/add/store, so
+     * concurrent executions of a block may lose counts.
+     */
+    void set_block_counter(std::uint64_t *counter) { block_counter_ = counter; }
+
+  protected:
+    std::uint64_t *block_counter() const { return block_counter_; }
+
   private:
     machine_code_writer &writer_;
+    std::uint64_t *block_counter_ = nullptr;
 };
 } // namespace arancini::output::dynamic
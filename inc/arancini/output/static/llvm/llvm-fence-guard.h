@@ -0,0 +1,19 @@
+#pragma once
+
+#include "llvm/IR/PassManager.h"
+
+using namespace ::llvm;
+
+// Name of the runtime flag that is set once the guest creates a thread
+inline constexpr const char *guest_multithreaded_flag =
+    "__arancini_guest_multithreaded";
+
+/*
+ * Executes fences only once the guest is multi-threaded, by guarding each of
+ * them with a check of guest_multithreaded_flag.  Runs after
+ * FenceCombinePass, as the guards split basic blocks.
+ */
+class FenceGuardPass : public PassInfoMixin<FenceGuardPass> {
+  public:
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM);
+};
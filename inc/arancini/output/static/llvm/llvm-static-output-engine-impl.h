@@ -6,6 +6,7 @@
 #include <llvm/IR/BasicBlock.h>
 #include <map>
 #include <memory>
+#include <set>
 #include <unordered_map>
 
 #include <llvm/IR/Constants.h>
@@ -57,6 +58,10 @@ class llvm_static_output_engine_impl {
 
     void generate();
 
+    const std::vector<std::string> &additional_objects() const {
+        return additional_objects_;
+    }
+
     unsigned long fixed_branches;
 
   private:
@@ -69,7 +74,10 @@ class llvm_static_output_engine_impl {
         std::make_shared<std::map<unsigned long, ::llvm::Function *>>();
     std::shared_ptr<std::map<std::string, ::llvm::Function *>> wrapper_fns_ =
         std::make_shared<std::map<std::string, ::llvm::Function *>>();
+    // Address-suffixed aliases of the static functions, for host profilers
+    std::map<const ::llvm::Function *, ::llvm::GlobalAlias *> address_aliases_;
     std::vector<::llvm::Constant *> func_map_;
+    std::vector<std::string> additional_objects_;
     bool in_br;
 
     struct {
@@ -87,6 +95,8 @@ class llvm_static_output_engine_impl {
         ::llvm::Type *f64;
         ::llvm::Type *f80;
         ::llvm::Type *f128;
+        // XMM arguments and results of static functions
+        ::llvm::FixedVectorType *xmm;
         ::llvm::StructType *cpu_state;
         ::llvm::PointerType *cpu_state_ptr;
         ::llvm::FunctionType *main_fn;
@@ -97,7 +107,6 @@ class llvm_static_output_engine_impl {
         ::llvm::FunctionType *internal_call_handler;
         ::llvm::FunctionType *finalize;
         ::llvm::FunctionType *clk_fn;
-        ::llvm::FunctionType *register_static_fn;
         ::llvm::FunctionType *lookup_static_fn;
         ::llvm::FunctionType *poison_fn;
 
@@ -130,18 +139,38 @@ class llvm_static_output_engine_impl {
     std::unordered_map<const ir::local_var *, ::llvm::Value *>
         local_var_to_llvm_addr_;
     std::unordered_map<reg_offsets, ::llvm::AllocaInst *> reg_to_alloca_;
+    // Block in which register allocas of the current function are created
+    ::llvm::BasicBlock *reg_alloca_block_;
+    // Registers accessed/modified by the current function, boundaries only
+    // need to transfer these between the allocas and the CPU state
+    std::set<reg_offsets> touched_regs_;
+    std::set<reg_offsets> written_regs_;
+    // Width of the vector registers used by the current function, only the
+    // used part of them is kept in allocas and moved at boundaries
+    std::unordered_map<reg_offsets, unsigned> vector_widths_;
+    // XMM registers that static functions of this module take as arguments
+    // and return natively rather than through the CPU state. Functions that
+    // are not in here (e.g. from other libraries) take all of them.
+    std::unordered_map<::llvm::Function *, std::set<reg_offsets>>
+        vector_args_;
+    std::unordered_map<::llvm::Function *, std::set<reg_offsets>>
+        vector_rets_;
 
     void build();
     void initialise_types();
     void create_main_function(::llvm::Function *loop_fn);
-    void optimise();
-    void compile();
+    void optimise(::llvm::Module &module, const std::string &dump_suffix);
+    void compile(::llvm::Module &module, const std::string &output_filename);
+    void generate_partitioned();
+    void cache_functions();
     void lower_chunks(::llvm::Function *main_loop_fn);
+    void apply_profile();
     void lower_chunk(::llvm::IRBuilder<> *builder,
                      ::llvm::Function *main_loop_fn,
                      std::shared_ptr<ir::chunk> chunk);
     void lower_static_fn_lookup(::llvm::IRBuilder<> &builder,
                                 ::llvm::BasicBlock *contblock,
+                                ::llvm::BasicBlock *retblock,
                                 ::llvm::Value *guestAddr);
     ::llvm::Value *
     lower_node(::llvm::IRBuilder<::llvm::ConstantFolder,
@@ -159,12 +188,14 @@ class llvm_static_output_engine_impl {
         ::llvm::Argument *start_arg, std::shared_ptr<ir::packet> pkt,
         ir::port &p);
     void init_regs(::llvm::IRBuilder<> &builder);
+    ::llvm::AllocaInst *get_reg_alloca(reg_offsets reg);
     void save_all_regs(::llvm::IRBuilder<> &builder,
                        ::llvm::Argument *state_arg);
     void restore_all_regs(::llvm::IRBuilder<> &builder,
                           ::llvm::Argument *state_arg);
     void save_callee_regs(::llvm::IRBuilder<> &builder,
-                          ::llvm::Argument *state_arg, bool with_args = true);
+                          ::llvm::Argument *state_arg, bool with_args = true,
+                          const std::set<reg_offsets> &passed = {});
     void restore_callee_regs(::llvm::IRBuilder<> &builder,
                              ::llvm::Argument *state_arg,
                              bool with_rets = true);
@@ -182,9 +213,10 @@ class llvm_static_output_engine_impl {
                          ::llvm::BasicBlock *mid);
     ::llvm::FunctionType *get_fn_type();
     std::vector<::llvm::Value *> load_args(::llvm::IRBuilder<> *builder,
-                                           ::llvm::Argument *state_arg);
+                                           ::llvm::Argument *state_arg,
+                                           ::llvm::Function *callee);
     void unwrap_ret(::llvm::IRBuilder<> *builder, ::llvm::Value *value,
-                    ::llvm::Argument *state_arg);
+                    ::llvm::Argument *state_arg, ::llvm::Function *callee);
     std::vector<::llvm::Value *> wrap_ret(::llvm::IRBuilder<> *builder,
                                           ::llvm::Argument *state_arg);
     void create_function_decls();
@@ -3,10 +3,24 @@
 #include <arancini/output/static/static-output-engine.h>
 #include <memory>
 #include <optional>
+#include <string>
+#include <vector>
 
 namespace arancini::output::o_static::llvm {
 class llvm_static_output_engine_impl;
 
+/*
+ * How the x86 (TSO) ordering of guest memory accesses is enforced.
+ */
+enum class memory_model {
+    // Acquire fences after loads and release fences before stores
+    fences,
+    // Acquire loads and release stores (LDAPR/STLR on AArch64)
+    acquire_release,
+    // No ordering; only safe for single-threaded guests
+    none,
+};
+
 class llvm_static_output_engine : public static_output_engine {
     friend class llvm_static_output_engine_impl;
 
@@ -22,7 +36,40 @@ class llvm_static_output_engine : public static_output_engine {
     void set_debug_dump_filename(std::string filename) {
         debug_dump_filename = filename;
     }
-    void set_codegen_fence(bool b) { fences_ = b; }
+    void set_codegen_fence(bool b) {
+        memory_model_ = b ? memory_model::fences : memory_model::none;
+    }
+
+    void set_memory_model(memory_model model) { memory_model_ = model; }
+
+    /*
+     * Skip the fences of the fences memory model until the guest creates its
+     * first thread, at the cost of a check of a runtime flag per fence.
+     */
+    void set_lazy_fences(bool b) { lazy_fences_ = b; }
+
+    /*
+     * Split the generated module into one partition per additional output
+     * file (plus the primary output file), and optimise/compile the
+     * partitions in parallel.  Every file in this list, as well as
+     * output_filename(), must be linked into the final binary.
+     */
+    void set_partition_outputs(std::vector<std::string> filenames) {
+        partition_outputs_ = std::move(filenames);
+    }
+
+    /*
+     * Cache optimised per-function objects in this directory, keyed by a hash
+     * of the function's unoptimised IR and the translator configuration.
+     */
+    void set_cache_dir(std::string dir) { cache_dir_ = dir; }
+
+    /*
+     * Objects produced by generate() in addition to output_filename() and the
+     * partition outputs, e.g. cached functions.  These must be linked into
+     * the final binary as well.
+     */
+    const std::vector<std::string> &additional_objects() const;
 
     bool is_exec() const { return is_exec_; };
 
@@ -31,6 +78,9 @@ class llvm_static_output_engine : public static_output_engine {
     bool dbg_;
     const bool is_exec_;
     std::optional<std::string> debug_dump_filename;
-    bool fences_{true};
+    memory_model memory_model_{memory_model::fences};
+    bool lazy_fences_{false};
+    std::vector<std::string> partition_outputs_;
+    std::optional<std::string> cache_dir_;
 };
 } // namespace arancini::output::o_static::llvm
@@ -77,7 +77,48 @@ class llvm_arg_visitor : public default_visitor {
         reg_offsets::RDI,  reg_offsets::RSI,  reg_offsets::RDX,
         reg_offsets::RCX,  reg_offsets::R8,   reg_offsets::R9,
         reg_offsets::ZMM0, reg_offsets::ZMM1, reg_offsets::ZMM2,
-        reg_offsets::ZMM3, reg_offsets::ZMM4, reg_offsets::ZMM7,
+        reg_offsets::ZMM3, reg_offsets::ZMM4, reg_offsets::ZMM5,
         reg_offsets::ZMM6, reg_offsets::ZMM7};
 };
+
+// Collects the registers each chunk reads and writes, so that only these have
+// to be kept in allocas and transferred at call and dispatch boundaries.
+class llvm_reg_usage_visitor : public default_visitor {
+  public:
+    virtual void visit_chunk(chunk &c) override;
+
+    virtual void visit_read_reg_node(read_reg_node &n) override;
+    virtual void visit_write_reg_node(write_reg_node &n) override;
+    virtual void visit_write_pc_node(write_pc_node &n) override;
+    virtual void visit_binary_atomic_node(binary_atomic_node &n) override;
+    virtual void visit_ternary_atomic_node(ternary_atomic_node &n) override;
+
+    // Registers read or written by the chunk at fn
+    std::set<reg_offsets> touched(unsigned long fn) const;
+    // Registers (possibly) modified by the chunk at fn
+    const std::set<reg_offsets> &written(unsigned long fn) const {
+        return written_.at(fn);
+    }
+    // Widest access (128, 256 or 512 bits) to each vector register used by
+    // the chunk at fn. Bits above it are neither read nor modified.
+    const std::unordered_map<reg_offsets, unsigned> &
+    vector_widths(unsigned long fn) const {
+        return vector_widths_.at(fn);
+    }
+
+  private:
+    unsigned long current_chunk_;
+    std::unordered_map<unsigned long, std::set<reg_offsets>> read_;
+    std::unordered_map<unsigned long, std::set<reg_offsets>> written_;
+    std::unordered_map<unsigned long,
+                       std::unordered_map<reg_offsets, unsigned>>
+        vector_widths_;
+
+    void record_vector_width(reg_offsets reg, unsigned width);
+    // Registers used by the static calling convention and the dispatcher
+    const std::set<reg_offsets> boundary_regs = {
+        reg_offsets::PC,  reg_offsets::RAX, reg_offsets::RDX,
+        reg_offsets::RDI, reg_offsets::RSI, reg_offsets::RCX,
+        reg_offsets::R8,  reg_offsets::R9};
+};
 } // namespace arancini::ir
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <cstdint>
+#include <map>
 #include <memory>
+#include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace arancini::ir {
@@ -22,6 +26,12 @@ class static_output_engine {
     }
     void add_chunk(std::shared_ptr<ir::chunk> c) { chunks_.push_back(c); }
 
+    // Known targets of the indirect branch at the given guest address
+    void add_branch_targets(const unsigned long addr,
+                            const std::set<off_t> &targets) {
+        branch_targets_[addr].insert(targets.begin(), targets.end());
+    }
+
     const std::vector<std::pair<unsigned long, std::string>> &
     extern_fns() const {
         return extern_fns_;
@@ -29,6 +39,17 @@ class static_output_engine {
     const std::vector<std::shared_ptr<ir::chunk>> &chunks() const {
         return chunks_;
     }
+    const std::map<unsigned long, std::set<off_t>> &branch_targets() const {
+        return branch_targets_;
+    }
+
+    // Execution counts of blocks, by guest address, from a runtime profile
+    void set_block_counts(std::map<unsigned long, std::uint64_t> counts) {
+        block_counts_ = std::move(counts);
+    }
+    const std::map<unsigned long, std::uint64_t> &block_counts() const {
+        return block_counts_;
+    }
 
     void set_entrypoint(off_t ep) { ep_ = ep; }
     off_t get_entrypoint() const { return ep_; }
@@ -41,6 +62,8 @@ class static_output_engine {
     std::string output_filename_;
     std::vector<std::pair<unsigned long, std::string>> extern_fns_;
     std::vector<std::shared_ptr<ir::chunk>> chunks_;
+    std::map<unsigned long, std::set<off_t>> branch_targets_;
+    std::map<unsigned long, std::uint64_t> block_counts_;
     off_t ep_;
 };
 } // namespace arancini::output::o_static
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <fstream>
+#include <string>
+
+namespace arancini::runtime::dbt {
+/*
+  Describes translated code to host profilers, so that samples in the code
+  cache can be attributed to guest code. Entries are written to
+  /tmp/perf-<pid>.map, which perf reads on its own, and optionally to a
+  jitdump file (/tmp/jit-<pid>.dump) for perf inject --jit. The jitdump also
+  holds a copy of the code, so that it can be annotated after it was
+  overwritten or unmapped.
+*/
+class perf_map {
+  public:
+    perf_map(bool jitdump);
+    ~perf_map();
+
+    perf_map(const perf_map &) = delete;
+    perf_map &operator=(const perf_map &) = delete;
+
+    // code must be the executable address of the code
+    void add(const void *code, std::size_t size, const std::string &name);
+
+  private:
+    std::ofstream map_;
+    int jitdump_fd_ = -1;
+    void *jitdump_marker_ = nullptr;
+    unsigned long code_index_ = 0;
+
+    void open_jitdump();
+    void write_jitdump(const void *data, std::size_t size);
+};
+} // namespace arancini::runtime::dbt
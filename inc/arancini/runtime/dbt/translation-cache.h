@@ -21,6 +21,9 @@ class translation_cache {
         translations_[addr] = obj;
     }
 
+    // The code of the translations is not freed, as it may still be executing
+    void clear() { translations_.clear(); }
+
   private:
     std::unordered_map<unsigned long, translation *> translations_;
 };
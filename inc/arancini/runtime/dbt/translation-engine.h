@@ -4,9 +4,17 @@
 #include <arancini/output/dynamic/dynamic-output-engine.h>
 #include <arancini/output/dynamic/machine-code-allocator.h>
 #include <arancini/output/dynamic/machine-code-writer.h>
+#include <arancini/runtime/dbt/perf-map.h>
 #include <arancini/runtime/dbt/translation-cache.h>
 
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <iosfwd>
+#include <map>
 #include <memory>
+#include <set>
+#include <unordered_map>
 
 namespace arancini::input {
 class input_arch;
@@ -29,8 +37,11 @@ class translation_engine {
   public:
     translation_engine(execution_context &ec, input::input_arch &ia,
                        output::dynamic::dynamic_output_engine &oe,
-                       bool optimise = true)
-        : ec_(ec), code_arena_(0x100000000), alloc_{code_arena_},
+                       bool optimise = true,
+                       output::dynamic::code_mapping mapping =
+                           output::dynamic::code_mapping::rwx)
+        : ec_(ec), code_arena_(0x100000000, mapping),
+          alloc_{code_arena_, hot_region_size},
           writer_{alloc_}, ia_(ia), oe_(oe),
           ctx_{oe_.create_translation_context(writer_)} {
         // TODO properly add flag to disable
@@ -39,11 +50,51 @@ class translation_engine {
         }
     }
 
-    translation *get_translation(unsigned long pc);
+    // chain_address is the chain site the guest left translated code
+    // through, if any
+    translation *get_translation(unsigned long pc,
+                                 std::uint64_t chain_address = 0);
     translation *translate(unsigned long pc);
     void chain(uint64_t chain_address, void *chain_target);
+    void enter_multithreaded();
+
+    struct block_profile {
+        unsigned long pc;
+        std::uint64_t count;
+        std::size_t size;
+    };
+
+    // Count the executions of blocks translated from now on
+    void enable_block_profile() { block_profile_ = true; }
+    // Execution counts by guest PC, including earlier translations of a PC
+    std::map<unsigned long, block_profile> block_profiles() const;
+    // Prints the most frequently executed blocks
+    void report_block_profile(std::ostream &os, std::size_t limit) const;
+
+    // Move blocks entered threshold times into the hot region
+    void enable_hot_placement(std::uint64_t threshold);
+
+    // Describe translations to host profilers from now on
+    void enable_perf_map(bool jitdump) {
+        perf_map_ = std::make_unique<perf_map>(jitdump);
+    }
 
   private:
+    // Reserved at the start of the arena, so that chains between hot and
+    // recent cold code stay within direct branch range
+    static constexpr std::size_t hot_region_size = 0x4000000;
+
+    struct block_heat {
+        // Entries through the runtime while the block was cold
+        std::uint64_t entries = 0;
+        bool hot = false;
+        // Guest PCs the cold translation was seen to exit to
+        std::set<unsigned long> successors;
+    };
+
+    translation *promote(unsigned long pc);
+    void record_exit(std::uint64_t chain_address, unsigned long target);
+
     execution_context &ec_;
     translation_cache cache_;
     output::dynamic::arena code_arena_;
@@ -55,5 +106,19 @@ class translation_engine {
     std::shared_ptr<output::dynamic::translation_context> ctx_;
 
     std::unique_ptr<ir::deadflags_opt_visitor> deadflags_;
+
+    bool block_profile_ = false;
+    // Translated code refers to the counters, so their addresses must be
+    // stable
+    std::deque<block_profile> block_profiles_;
+
+    // Cold blocks are never chained to, so the runtime sees every entry
+    std::atomic<bool> hot_placement_{false};
+    std::uint64_t hot_threshold_ = 0;
+    std::unordered_map<unsigned long, block_heat> heat_;
+    // Guest PCs of the cold translations, by address of their code
+    std::map<std::uintptr_t, unsigned long> cold_blocks_;
+
+    std::unique_ptr<perf_map> perf_map_;
 };
 } // namespace arancini::runtime::dbt
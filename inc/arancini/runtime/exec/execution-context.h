@@ -1,9 +1,11 @@
 #pragma once
 
 #include <arancini/runtime/dbt/translation-engine.h>
+#include <cstdint>
 #include <cstdlib>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <utility>
 
 namespace arancini::input {
@@ -17,11 +19,30 @@ class dynamic_output_engine;
 namespace arancini::runtime::exec {
 class execution_thread;
 
+/// How guest memory is backed by huge pages.
+enum class huge_page_mode {
+    /// Regular pages only
+    none,
+    /// Transparent huge pages are requested with madvise(MADV_HUGEPAGE)
+    thp,
+    /// Large anonymous mmaps use MAP_HUGETLB, everything else uses THP
+    hugetlb
+};
+
+struct guest_memory_config {
+    /// Size of the address space reserved for the guest
+    size_t memory_size = 0x10000000ull;
+    huge_page_mode huge_pages = huge_page_mode::none;
+    /// How the translated code is mapped
+    output::dynamic::code_mapping code_mapping =
+        output::dynamic::code_mapping::rwx;
+};
+
 class execution_context {
   public:
     execution_context(input::input_arch &ia,
                       output::dynamic::dynamic_output_engine &oe,
-                      bool optimise);
+                      bool optimise, const guest_memory_config &config = {});
     ~execution_context();
 
     void *add_memory_region(off_t base_address, size_t size,
@@ -37,12 +58,31 @@ class execution_context {
         return (void *)(base_address);
     }
 
+    size_t get_memory_size() const { return memory_size_; }
+
     int invoke(void *cpu_state);
+    bool is_multithreaded() const;
     int internal_call(void *cpu_state, int call);
 
+    void report_memory_stats() const;
+    void enable_block_profile() { te_.enable_block_profile(); }
+    void report_block_profile(std::size_t limit) const;
+    std::map<unsigned long, dbt::translation_engine::block_profile>
+    block_profiles() const {
+        return te_.block_profiles();
+    }
+    void enable_hot_placement(std::uint64_t threshold) {
+        te_.enable_hot_placement(threshold);
+    }
+    void enable_perf_map(bool jitdump) { te_.enable_perf_map(jitdump); }
+
   private:
     void *memory_;
     size_t memory_size_;
+    huge_page_mode huge_pages_;
+    // Guest mappings created with MAP_HUGETLB and their rounded up lengths
+    std::map<uintptr_t, size_t> hugetlb_maps_;
+    std::mutex hugetlb_lock_;
     uintptr_t brk_;
     uintptr_t brk_limit_;
 
@@ -51,5 +91,7 @@ class execution_context {
 
     pthread_mutex_t big_fat_lock;
     void allocate_guest_memory();
+    void enter_multithreaded();
+    void advise_huge_pages(uintptr_t addr, size_t length) const;
 };
 } // namespace arancini::runtime::exec
@@ -1,16 +1,20 @@
 #pragma once
 
 #include <boost/program_options.hpp>
+#include <iosfwd>
 #include <memory>
+#include <set>
 #include <string>
 
 namespace arancini::elf {
 class elf_reader;
+class elf_writer;
 class symbol;
 class symbol_table;
 class program_header;
 class rela_table;
 class relr_array;
+class plt_table;
 } // namespace arancini::elf
 
 namespace arancini::ir {
@@ -43,6 +47,18 @@ class txlat_engine {
     std::shared_ptr<ir::chunk> translate_symbol(arancini::input::input_arch &ia,
                                                 elf::elf_reader &reader,
                                                 const elf::symbol &sym);
+    void recover_jump_tables(
+        arancini::input::input_arch &ia, elf::elf_reader &elf,
+        arancini::output::o_static::static_output_engine &oe,
+        const elf::symbol &sym);
+    void recover_functions(
+        arancini::input::input_arch &ia, elf::elf_reader &elf,
+        arancini::output::o_static::static_output_engine &oe,
+        const std::set<elf::symbol> &translated,
+        const std::shared_ptr<elf::plt_table> &plt_tab,
+        const std::vector<std::shared_ptr<elf::rela_table>> &relocations,
+        const std::vector<std::shared_ptr<elf::relr_array>> &relocations_r,
+        const std::set<off_t> &profiled, bool discover);
     void
     generate_dot_graph(arancini::output::o_static::static_output_engine &oe,
                        std::string filename);
@@ -51,7 +67,8 @@ class txlat_engine {
     static void add_symbol_to_output(
         const std::vector<std::shared_ptr<elf::program_header>> &phbins,
         const std::map<off_t, unsigned int> &end_addresses,
-        const elf::symbol &sym, std::ofstream &s,
+        const std::vector<unsigned int> &segment_sections,
+        const elf::symbol &sym, elf::elf_writer &w,
         std::map<uint64_t, std::string> &ifuncs, bool force_global = false,
         bool omit_prefix = false);
     static std::shared_ptr<ir::chunk>
@@ -59,13 +76,14 @@ class txlat_engine {
                      const native_lib::nlib_function &func);
 
     static std::map<uint64_t, std::string> generate_guest_sections(
-        const std::shared_ptr<util::basefile> &phobjsrc, elf::elf_reader &elf,
+        const std::shared_ptr<util::basefile> &phobj, std::ostream &l,
+        elf::elf_reader &elf,
         const std::vector<std::shared_ptr<elf::program_header>> &load_phdrs,
-        const std::basic_string<char> &filename,
         const std::shared_ptr<elf::symbol_table> &dyn_sym,
         const std::vector<std::shared_ptr<elf::rela_table>> &relocations,
         const std::vector<std::shared_ptr<elf::relr_array>> &relocations_r,
         const std::shared_ptr<elf::symbol_table> &sym_t,
-        const std::vector<std::shared_ptr<elf::program_header>> &tls);
+        const std::vector<std::shared_ptr<elf::program_header>> &tls,
+        const std::set<std::string> &wrapped);
 };
 } // namespace arancini::txlat
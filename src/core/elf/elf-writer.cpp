@@ -0,0 +1,294 @@
+#include <arancini/elf/elf-writer.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+using namespace arancini::elf;
+
+unsigned int elf_writer::get_section(const std::string &name, uint32_t type,
+                                     uint64_t flags, uint64_t align) {
+    for (size_t i = 1; i < sections_.size(); i++) {
+        if (sections_[i].name == name) {
+            return i;
+        }
+    }
+
+    section s;
+    s.name = name;
+    s.type = type;
+    s.flags = flags;
+    s.align = align;
+    sections_.push_back(std::move(s));
+    return sections_.size() - 1;
+}
+
+void elf_writer::set_contents(unsigned int section, const void *data,
+                              size_t size) {
+    auto &s = sections_.at(section);
+    if (s.type == SHT_NOBITS || s.size) {
+        throw std::runtime_error("cannot set contents of section " + s.name);
+    }
+    s.external = data;
+    s.size = size;
+}
+
+void elf_writer::append(unsigned int section, const void *data, size_t size) {
+    auto &s = sections_.at(section);
+    if (s.type == SHT_NOBITS || s.external) {
+        throw std::runtime_error("cannot append to section " + s.name);
+    }
+    const auto *bytes = static_cast<const char *>(data);
+    s.contents.insert(s.contents.end(), bytes, bytes + size);
+    s.size += size;
+}
+
+void elf_writer::reserve(unsigned int section, size_t size) {
+    auto &s = sections_.at(section);
+    if (s.type != SHT_NOBITS) {
+        throw std::runtime_error("cannot reserve space in section " + s.name);
+    }
+    s.size += size;
+}
+
+elf_writer::symbol &elf_writer::get_symbol(const std::string &name) {
+    auto it = symbol_index_.find(name);
+    if (it != symbol_index_.end()) {
+        return symbols_[it->second];
+    }
+
+    symbol_index_.emplace(name, symbols_.size());
+    auto &sym = symbols_.emplace_back();
+    sym.name = name;
+    return sym;
+}
+
+void elf_writer::add_relocation(unsigned int section, uint64_t offset,
+                                uint32_t type, const std::string &sym,
+                                int64_t addend) {
+    long index = -1;
+    if (!sym.empty()) {
+        get_symbol(sym);
+        index = symbol_index_.at(sym);
+    }
+    relocations_[section].push_back({offset, type, index, addend});
+}
+
+void elf_writer::add_section_relocation(unsigned int section, uint64_t offset,
+                                        uint32_t type, unsigned int target,
+                                        int64_t addend) {
+    relocations_[section].push_back(
+        {offset, type, -static_cast<long>(target) - 1, addend});
+}
+
+static uint32_t add_string(std::vector<char> &table, const std::string &s) {
+    uint32_t offset = table.size();
+    table.insert(table.end(), s.begin(), s.end());
+    table.push_back('\0');
+    return offset;
+}
+
+static uint64_t align_to(uint64_t v, uint64_t align) {
+    return align > 1 ? (v + align - 1) & ~(align - 1) : v;
+}
+
+void elf_writer::write(const std::string &filename) const {
+    std::vector<char> strtab{'\0'};
+    std::vector<char> shstrtab{'\0'};
+
+    // Symbol table: null symbol, one symbol per section, locals, then the
+    // global and weak symbols as the ELF specification requires.
+    // Undefined symbols cannot be local.
+    std::vector<Elf64_Sym> syms(sections_.size());
+    for (size_t i = 1; i < sections_.size(); i++) {
+        syms[i].st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+        syms[i].st_shndx = i;
+    }
+
+    std::vector<uint32_t> final_index(symbols_.size());
+    auto emit = [&](size_t i) {
+        const auto &sym = symbols_[i];
+        unsigned char binding = sym.binding;
+        if (binding == STB_LOCAL && sym.section == SHN_UNDEF) {
+            binding = STB_GLOBAL;
+        }
+
+        Elf64_Sym es{};
+        es.st_name = add_string(strtab, sym.name);
+        es.st_info = ELF64_ST_INFO(binding, sym.type);
+        es.st_other = ELF64_ST_VISIBILITY(sym.visibility);
+        es.st_shndx = sym.section;
+        es.st_value = sym.value;
+        es.st_size = sym.size;
+
+        final_index[i] = syms.size();
+        syms.push_back(es);
+    };
+    for (size_t i = 0; i < symbols_.size(); i++) {
+        if (symbols_[i].binding == STB_LOCAL &&
+            symbols_[i].section != SHN_UNDEF) {
+            emit(i);
+        }
+    }
+    uint32_t first_global = syms.size();
+    for (size_t i = 0; i < symbols_.size(); i++) {
+        if (symbols_[i].binding != STB_LOCAL ||
+            symbols_[i].section == SHN_UNDEF) {
+            emit(i);
+        }
+    }
+
+    // Relocation sections, in the order of the sections they apply to
+    std::vector<std::pair<unsigned int, std::vector<Elf64_Rela>>> relas;
+    for (const auto &[target, rs] : relocations_) {
+        std::vector<Elf64_Rela> entries;
+        for (const auto &r : rs) {
+            uint32_t sym = 0;
+            if (r.sym >= 0) {
+                sym = final_index[r.sym];
+            } else if (r.sym < -1) {
+                sym = -r.sym - 1;
+            }
+
+            Elf64_Rela er{};
+            er.r_offset = r.offset;
+            er.r_info = ELF64_R_INFO(sym, r.type);
+            er.r_addend = r.addend;
+            entries.push_back(er);
+        }
+        relas.emplace_back(target, std::move(entries));
+    }
+
+    unsigned int symtab_index = sections_.size() + relas.size();
+    unsigned int strtab_index = symtab_index + 1;
+    unsigned int shstrtab_index = symtab_index + 2;
+
+    // Lay out the file: header, section contents, then the section headers
+    std::vector<Elf64_Shdr> shdrs(shstrtab_index + 1);
+
+    uint64_t offset = sizeof(Elf64_Ehdr);
+    auto place = [&](Elf64_Shdr &sh, uint64_t size) {
+        if (sh.sh_type != SHT_NOBITS) {
+            offset = align_to(offset, sh.sh_addralign);
+        }
+        sh.sh_offset = offset;
+        sh.sh_size = size;
+        if (sh.sh_type != SHT_NOBITS) {
+            offset += size;
+        }
+    };
+
+    for (size_t i = 1; i < sections_.size(); i++) {
+        const auto &s = sections_[i];
+        auto &sh = shdrs[i];
+        sh.sh_name = add_string(shstrtab, s.name);
+        sh.sh_type = s.type;
+        sh.sh_flags = s.flags;
+        sh.sh_addralign = s.align;
+        place(sh, s.size);
+    }
+
+    for (size_t i = 0; i < relas.size(); i++) {
+        const auto &[target, entries] = relas[i];
+        auto &sh = shdrs[sections_.size() + i];
+        sh.sh_name = add_string(shstrtab, ".rela" + sections_[target].name);
+        sh.sh_type = SHT_RELA;
+        sh.sh_flags = SHF_INFO_LINK;
+        sh.sh_link = symtab_index;
+        sh.sh_info = target;
+        sh.sh_entsize = sizeof(Elf64_Rela);
+        sh.sh_addralign = 8;
+        place(sh, entries.size() * sizeof(Elf64_Rela));
+    }
+
+    auto &symtab = shdrs[symtab_index];
+    symtab.sh_name = add_string(shstrtab, ".symtab");
+    symtab.sh_type = SHT_SYMTAB;
+    symtab.sh_link = strtab_index;
+    symtab.sh_info = first_global;
+    symtab.sh_entsize = sizeof(Elf64_Sym);
+    symtab.sh_addralign = 8;
+    place(symtab, syms.size() * sizeof(Elf64_Sym));
+
+    auto &strtab_sh = shdrs[strtab_index];
+    strtab_sh.sh_name = add_string(shstrtab, ".strtab");
+    strtab_sh.sh_type = SHT_STRTAB;
+    strtab_sh.sh_addralign = 1;
+    place(strtab_sh, strtab.size());
+
+    auto &shstrtab_sh = shdrs[shstrtab_index];
+    shstrtab_sh.sh_name = add_string(shstrtab, ".shstrtab");
+    shstrtab_sh.sh_type = SHT_STRTAB;
+    shstrtab_sh.sh_addralign = 1;
+    place(shstrtab_sh, shstrtab.size());
+
+    uint64_t shoff = align_to(offset, 8);
+
+    Elf64_Ehdr ehdr{};
+    std::memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+    ehdr.e_type = ET_REL;
+    ehdr.e_machine = machine_;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_flags = flags_;
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_shentsize = sizeof(Elf64_Shdr);
+    ehdr.e_shnum = shdrs.size();
+    ehdr.e_shstrndx = shstrtab_index;
+    ehdr.e_shoff = shoff;
+
+    std::ofstream out(filename, std::ios::out | std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("unable to open file for writing '" +
+                                 filename + "'");
+    }
+
+    auto pad_to = [&](uint64_t target) {
+        static const char zeros[16] = {};
+        for (auto pos = (uint64_t)out.tellp(); pos < target;) {
+            auto n = std::min<uint64_t>(target - pos, sizeof(zeros));
+            out.write(zeros, n);
+            pos += n;
+        }
+    };
+
+    out.write(reinterpret_cast<const char *>(&ehdr), sizeof(ehdr));
+
+    for (size_t i = 1; i < sections_.size(); i++) {
+        const auto &s = sections_[i];
+        if (s.type == SHT_NOBITS) {
+            continue;
+        }
+        pad_to(shdrs[i].sh_offset);
+        out.write(s.external ? static_cast<const char *>(s.external)
+                             : s.contents.data(),
+                  s.size);
+    }
+
+    for (size_t i = 0; i < relas.size(); i++) {
+        const auto &entries = relas[i].second;
+        pad_to(shdrs[sections_.size() + i].sh_offset);
+        out.write(reinterpret_cast<const char *>(entries.data()),
+                  entries.size() * sizeof(Elf64_Rela));
+    }
+
+    pad_to(symtab.sh_offset);
+    out.write(reinterpret_cast<const char *>(syms.data()),
+              syms.size() * sizeof(Elf64_Sym));
+    pad_to(strtab_sh.sh_offset);
+    out.write(strtab.data(), strtab.size());
+    pad_to(shstrtab_sh.sh_offset);
+    out.write(shstrtab.data(), shstrtab.size());
+
+    pad_to(shoff);
+    out.write(reinterpret_cast<const char *>(shdrs.data()),
+              shdrs.size() * sizeof(Elf64_Shdr));
+
+    if (!out) {
+        throw std::runtime_error("unable to write '" + filename + "'");
+    }
+}
@@ -4,6 +4,9 @@
 #include <arancini/native_lib/nlib_func.h>
 #include <arancini/util/logger.h>
 
+#include <cstring>
+#include <optional>
+
 using namespace arancini::ir;
 using namespace arancini::input;
 using namespace arancini::input::x86;
@@ -461,6 +464,7 @@ void x86_input_arch::translate_chunk(ir_builder &builder, off_t base_address,
     std::string disasm;
 
     translation_result r;
+    bool falls_through = true;
 
     while (offset < code_size) {
         xed_decoded_inst_t xedd;
@@ -478,6 +482,9 @@ void x86_input_arch::translate_chunk(ir_builder &builder, off_t base_address,
         }
 
         xed_uint_t length = xed_decoded_inst_get_length(&xedd);
+        falls_through =
+            xed_decoded_inst_get_category(&xedd) != XED_CATEGORY_UNCOND_BR &&
+            xed_decoded_inst_get_category(&xedd) != XED_CATEGORY_RET;
 
         r = translate_instruction(builder, base_address, &xedd, debug(), da_,
                                   disasm);
@@ -505,17 +512,343 @@ void x86_input_arch::translate_chunk(ir_builder &builder, off_t base_address,
         base_address += length;
     }
 
-    if (r == translation_result::normal) {
-        // End of translation but no set of PC
+    // End of translation but no set of PC. Static chunks also continue at the
+    // following instruction after a call, or when the function was cut short
+    // at the next function entry, instead of returning.
+    if (basic_block ? r == translation_result::normal : falls_through) {
         builder.begin_packet(0);
-        builder.insert_write_pc(
-            builder.insert_constant_u64(base_address)->val(), br_type::br);
+        auto *next = builder.insert_constant_u64(base_address);
+        if (!basic_block) {
+            // Relative to the PC, as libraries are relocated
+            next = builder.insert_add(builder.insert_read_pc()->val(),
+                                      next->val());
+        }
+        builder.insert_write_pc(next->val(), br_type::br);
         builder.end_packet();
     }
 
     builder.end_chunk();
 }
 
+/*
+Recursive-descent disassembly used to find functions that are not described by
+the symbol table (e.g. in stripped binaries).
+
+Each function is explored from its entry point, following direct conditional
+and unconditional jumps within the function.  Direct call targets become new
+function entry points, whilst direct jumps to known function entry points are
+treated as tail calls.  Exploration of a path stops at returns, indirect jumps,
+instructions that never fall through and undecodable bytes.
+*/
+std::map<off_t, size_t>
+x86_input_arch::recover_functions(const std::vector<code_region> &regions,
+                                  const std::set<off_t> &entries,
+                                  const std::set<off_t> &external) {
+    initialise_xed();
+
+    auto find_region = [&](off_t addr) -> const code_region * {
+        for (const auto &r : regions) {
+            if (addr >= r.address && addr < r.address + (off_t)r.size) {
+                return &r;
+            }
+        }
+        return nullptr;
+    };
+
+    std::set<off_t> functions;
+    std::vector<off_t> pending_functions;
+    for (auto entry : entries) {
+        if (!external.count(entry) && find_region(entry)) {
+            functions.insert(entry);
+            pending_functions.push_back(entry);
+        }
+    }
+
+    // End of the last reachable instruction of each function
+    std::map<off_t, off_t> ends;
+
+    while (!pending_functions.empty()) {
+        off_t fn = pending_functions.back();
+        pending_functions.pop_back();
+
+        std::set<off_t> visited;
+        std::vector<off_t> pending_blocks{fn};
+        off_t end = fn;
+
+        while (!pending_blocks.empty()) {
+            off_t addr = pending_blocks.back();
+            pending_blocks.pop_back();
+
+            const code_region *region = find_region(addr);
+            while (region && visited.insert(addr).second) {
+                const uint8_t *mc = (const uint8_t *)region->code +
+                                    (addr - region->address);
+                size_t avail = region->address + region->size - addr;
+
+                xed_decoded_inst_t xedd;
+                xed_decoded_inst_zero(&xedd);
+                xed_decoded_inst_set_mode(&xedd, XED_MACHINE_MODE_LONG_64,
+                                          XED_ADDRESS_WIDTH_64b);
+                xed_decoded_inst_set_input_chip(&xedd, XED_CHIP_ALL);
+
+                if (xed_decode(&xedd, mc, avail) != XED_ERROR_NONE) {
+                    util::global_logger.debug(
+                        "CFG recovery: unable to decode @ {:#x}\n", addr);
+                    break;
+                }
+
+                off_t next = addr + xed_decoded_inst_get_length(&xedd);
+                end = std::max(end, next);
+
+                bool direct =
+                    xed_decoded_inst_get_branch_displacement_width(&xedd) != 0;
+                off_t target =
+                    next + xed_decoded_inst_get_branch_displacement(&xedd);
+
+                bool falls_through = true;
+                switch (xed_decoded_inst_get_category(&xedd)) {
+                case XED_CATEGORY_CALL:
+                    if (direct && !external.count(target) &&
+                        find_region(target) &&
+                        functions.insert(target).second) {
+                        pending_functions.push_back(target);
+                    }
+                    break;
+                case XED_CATEGORY_COND_BR:
+                    if (direct) {
+                        pending_blocks.push_back(target);
+                    }
+                    break;
+                case XED_CATEGORY_UNCOND_BR:
+                    if (direct && !functions.count(target) &&
+                        !external.count(target)) {
+                        pending_blocks.push_back(target);
+                    }
+                    falls_through = false;
+                    break;
+                case XED_CATEGORY_RET:
+                    falls_through = false;
+                    break;
+                default:
+                    switch (xed_decoded_inst_get_iclass(&xedd)) {
+                    case XED_ICLASS_HLT:
+                    case XED_ICLASS_UD2:
+                    case XED_ICLASS_INT3:
+                        falls_through = false;
+                        break;
+                    default:
+                        break;
+                    }
+                    break;
+                }
+
+                if (!falls_through) {
+                    break;
+                }
+
+                addr = next;
+                region = find_region(addr);
+            }
+        }
+
+        ends[fn] = end;
+    }
+
+    std::map<off_t, size_t> result;
+    for (auto it = functions.begin(); it != functions.end(); ++it) {
+        off_t end = ends[*it];
+
+        auto next = std::next(it);
+        if (next != functions.end() && *next < end) {
+            end = *next;
+        }
+
+        result[*it] = end - *it;
+    }
+
+    util::global_logger.info("CFG recovery: found {} functions\n",
+                             result.size());
+
+    return result;
+}
+
+/*
+Jump table recognition for indirect jumps, covering the two forms emitted by
+GCC and Clang:
+
+    cmp index, N                        cmp index, N
+    ja default                          ja default
+    lea base, [rip + table]             jmp qword ptr [table + index * 8]
+    movsxd target, dword ptr [base + index * 4]
+    add target, base
+    jmp target
+
+If no bound is found, the table is read until the first entry that does not
+point into the function.
+*/
+std::map<off_t, std::set<off_t>>
+x86_input_arch::recover_jump_tables(const code_region &function,
+                                    const std::vector<code_region> &data) {
+    initialise_xed();
+
+    // Maximum number of instructions to look back from an indirect jump
+    constexpr size_t window = 16;
+    constexpr size_t max_entries = 1024;
+
+    struct decoded_inst {
+        off_t address;
+        xed_decoded_inst_t xedd;
+    };
+
+    std::vector<decoded_inst> insns;
+    const uint8_t *mc = (const uint8_t *)function.code;
+    size_t offset = 0;
+    while (offset < function.size) {
+        decoded_inst d;
+        d.address = function.address + offset;
+        xed_decoded_inst_zero(&d.xedd);
+        xed_decoded_inst_set_mode(&d.xedd, XED_MACHINE_MODE_LONG_64,
+                                  XED_ADDRESS_WIDTH_64b);
+        xed_decoded_inst_set_input_chip(&d.xedd, XED_CHIP_ALL);
+
+        if (xed_decode(&d.xedd, &mc[offset], function.size - offset) !=
+            XED_ERROR_NONE) {
+            break;
+        }
+
+        offset += xed_decoded_inst_get_length(&d.xedd);
+        insns.push_back(d);
+    }
+
+    auto same_reg = [](xed_reg_enum_t a, xed_reg_enum_t b) {
+        return a != XED_REG_INVALID && b != XED_REG_INVALID &&
+               xed_get_largest_enclosing_register(a) ==
+                   xed_get_largest_enclosing_register(b);
+    };
+
+    auto read_entry = [&](off_t addr, unsigned size) -> std::optional<off_t> {
+        for (const auto &r : data) {
+            if (addr >= r.address && addr + size <= r.address + r.size) {
+                const uint8_t *p = (const uint8_t *)r.code + (addr - r.address);
+                if (size == 8) {
+                    uint64_t v;
+                    std::memcpy(&v, p, sizeof(v));
+                    return v;
+                }
+                int32_t v;
+                std::memcpy(&v, p, sizeof(v));
+                return v;
+            }
+        }
+        return std::nullopt;
+    };
+
+    std::map<off_t, std::set<off_t>> result;
+    for (size_t i = 0; i < insns.size(); i++) {
+        const xed_decoded_inst_t *jmp = &insns[i].xedd;
+        if (xed_decoded_inst_get_iclass(jmp) != XED_ICLASS_JMP ||
+            xed_decoded_inst_get_branch_displacement_width(jmp)) {
+            continue;
+        }
+
+        size_t first = i > window ? i - window : 0;
+        size_t load = i;
+        off_t table = 0;
+        unsigned entry_size = 0; // 8: absolute, 4: relative to the table
+        xed_reg_enum_t index = XED_REG_INVALID;
+
+        if (xed_decoded_inst_number_of_memory_operands(jmp)) {
+            if (xed_decoded_inst_get_base_reg(jmp, 0) == XED_REG_INVALID &&
+                xed_decoded_inst_get_scale(jmp, 0) == 8) {
+                table = xed_decoded_inst_get_memory_displacement(jmp, 0);
+                index = xed_decoded_inst_get_index_reg(jmp, 0);
+                entry_size = 8;
+            }
+        } else {
+            xed_reg_enum_t target =
+                xed_decoded_inst_get_reg(jmp, XED_OPERAND_REG0);
+            xed_reg_enum_t base = XED_REG_INVALID;
+
+            for (size_t j = i; j-- > first;) {
+                const xed_decoded_inst_t *x = &insns[j].xedd;
+                auto iclass = xed_decoded_inst_get_iclass(x);
+                auto reg0 = xed_decoded_inst_get_reg(x, XED_OPERAND_REG0);
+
+                if (base == XED_REG_INVALID) {
+                    if (iclass == XED_ICLASS_ADD && same_reg(reg0, target)) {
+                        base = xed_decoded_inst_get_reg(x, XED_OPERAND_REG1);
+                        if (base == XED_REG_INVALID) {
+                            break;
+                        }
+                    }
+                } else if (index == XED_REG_INVALID) {
+                    if (iclass == XED_ICLASS_MOVSXD && same_reg(reg0, target) &&
+                        xed_decoded_inst_number_of_memory_operands(x) &&
+                        same_reg(xed_decoded_inst_get_base_reg(x, 0), base) &&
+                        xed_decoded_inst_get_scale(x, 0) == 4) {
+                        index = xed_decoded_inst_get_index_reg(x, 0);
+                        load = j;
+                    }
+                } else if (iclass == XED_ICLASS_LEA && same_reg(reg0, base) &&
+                           xed_decoded_inst_get_base_reg(x, 0) == XED_REG_RIP) {
+                    table = insns[j].address + xed_decoded_inst_get_length(x) +
+                            xed_decoded_inst_get_memory_displacement(x, 0);
+                    entry_size = 4;
+                    break;
+                }
+            }
+        }
+
+        if (!entry_size || index == XED_REG_INVALID) {
+            continue;
+        }
+
+        // Look for the bounds check of the index
+        size_t entries = max_entries;
+        bool bounded = false;
+        for (size_t j = load; j-- > first;) {
+            const xed_decoded_inst_t *x = &insns[j].xedd;
+            if (xed_decoded_inst_get_iclass(x) == XED_ICLASS_CMP &&
+                same_reg(xed_decoded_inst_get_reg(x, XED_OPERAND_REG0),
+                         index) &&
+                xed_decoded_inst_get_immediate_width(x)) {
+                entries = std::min<size_t>(
+                    xed_decoded_inst_get_unsigned_immediate(x) + 1,
+                    max_entries);
+                bounded = true;
+                break;
+            }
+        }
+
+        std::set<off_t> targets;
+        for (size_t e = 0; e < entries; e++) {
+            auto entry = read_entry(table + e * entry_size, entry_size);
+            if (!entry) {
+                break;
+            }
+
+            off_t target = entry_size == 8 ? *entry : table + *entry;
+            if (target < function.address ||
+                target >= function.address + (off_t)function.size) {
+                if (!bounded) {
+                    break;
+                }
+                continue;
+            }
+            targets.insert(target);
+        }
+
+        if (!targets.empty()) {
+            util::global_logger.debug(
+                "Jump table @ {:#x} for jump @ {:#x}: {} targets\n", table,
+                insns[i].address, targets.size());
+            result[insns[i].address] = std::move(targets);
+        }
+    }
+
+    return result;
+}
+
 void x86_input_arch::gen_wrapper(ir_builder &builder,
                                  const native_lib::nlib_function &func) {
 
@@ -538,7 +871,8 @@ void x86_input_arch::gen_wrapper(ir_builder &builder,
     std::vector<port *> args;
     args.reserve(params.size());
 
-    for (const auto &item : params) {
+    for (std::size_t i = 0; i < params.size(); i++) {
+        const auto &item = params[i];
         switch (item.type_class()) {
         case value_type_class::none:
             break;
@@ -548,14 +882,27 @@ void x86_input_arch::gen_wrapper(ir_builder &builder,
                 throw std::runtime_error(
                     "Stack args unsupported in native lib wrapper.");
             } else {
-                args.push_back(
+                port *arg =
                     &builder
                          .insert_read_reg(item,
                                           (unsigned long)gpr_arg_regoff[gri],
                                           (unsigned long)gpr_arg_regidx[gri],
                                           gpr_arg_regname[gri])
-                         ->val());
+                         ->val();
                 gri++;
+
+                // Guest function pointers cannot be called by native code;
+                // hand it a host trampoline that re-enters the translated
+                // code instead.
+                if (func.param_classes.size() > i &&
+                    func.param_classes[i] == native_lib::NLTC_FNPTR) {
+                    arg = &builder
+                               .insert_internal_call(
+                                   builder.ifr().resolve("nlib_guest_callback"),
+                                   {arg})
+                               ->val();
+                }
+                args.push_back(arg);
             }
             break;
         case value_type_class::floating_point:
@@ -577,6 +924,16 @@ void x86_input_arch::gen_wrapper(ir_builder &builder,
             builder.insert_write_reg(
                 static_cast<unsigned long>(reg_offsets::RAX),
                 static_cast<unsigned long>(reg_idx::RAX), "RAX", call->val());
+        } else if (retty.element_width() == 128) {
+            // Small structs returned by value come back in RAX:RDX
+            builder.insert_write_reg(
+                static_cast<unsigned long>(reg_offsets::RAX),
+                static_cast<unsigned long>(reg_idx::RAX), "RAX",
+                builder.insert_trunc(value_type::u64(), call->val())->val());
+            builder.insert_write_reg(
+                static_cast<unsigned long>(reg_offsets::RDX),
+                static_cast<unsigned long>(reg_idx::RDX), "RDX",
+                builder.insert_bit_extract(call->val(), 64, 64)->val());
         } else {
             throw std::runtime_error(
                 "Return types > 64bit unsupported in native lib wrapper.");
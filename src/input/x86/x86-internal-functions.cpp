@@ -18,6 +18,10 @@ x86_internal_functions::create(const std::string &name) const {
     } else if (name == "hlt") {
         return std::make_shared<internal_function>(
             "hlt", function_type(value_type::v(), {}));
+    } else if (name == "nlib_guest_callback") {
+        return std::make_shared<internal_function>(
+            "nlib_guest_callback",
+            function_type(value_type::u64(), {value_type::u64()}));
     } else if (name == "sin") {
         return std::make_shared<internal_function>(
             "sin", function_type(value_type::f64(), {value_type::f64()}));
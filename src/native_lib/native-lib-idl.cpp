@@ -4,6 +4,75 @@
 
 namespace arancini::native_lib {
 
+/// Number of u64 registers a by-value struct occupies. Only structs of at
+/// most 16 bytes are passed in registers; larger ones go through memory,
+/// which the wrapper does not support.
+static int struct_words(const idl_ast_node &ty) {
+    if (ty.width <= 0 || ty.width > 128) {
+        throw Parser::syntax_error(
+            location{}, "nlib: idl: by-value structs must be 1 to 16 bytes\n");
+    }
+    return (ty.width + 63) / 64;
+}
+
+/// Checks that a callback can be called through the runtime's trampolines,
+/// which pass at most six integer arguments and return RAX.
+static void check_callback(const idl_ast_node &ty) {
+    if (ty.nr_children == 0) {
+        throw Parser::syntax_error(
+            location{}, "nlib: idl: fnptr parameters need a signature, e.g. "
+                        "fnptr(i32, const ptr a, const ptr b)\n");
+    }
+
+    const idl_ast_node &rv = ty.children[0];
+    switch (rv.tc) {
+    case NLTC_VOID:
+    case NLTC_SINT:
+    case NLTC_UINT:
+    case NLTC_STRING:
+    case NLTC_MEMPTR:
+    case NLTC_FD:
+        break;
+    case NLTC_STRUCT:
+        if (struct_words(rv) == 1) {
+            break;
+        }
+        [[fallthrough]];
+    default:
+        throw Parser::syntax_error(
+            location{}, "nlib: idl: callbacks can only return integers, "
+                        "pointers and structs of at most 8 bytes\n");
+    }
+
+    int words = 0;
+    const idl_ast_node &params = ty.children[1];
+    for (int i = 0; i < params.nr_children; i++) {
+        const idl_ast_node &arg = params.children[i].children[0];
+        switch (arg.tc) {
+        case NLTC_SINT:
+        case NLTC_UINT:
+        case NLTC_STRING:
+        case NLTC_MEMPTR:
+        case NLTC_FD:
+            words++;
+            break;
+        case NLTC_STRUCT:
+            words += struct_words(arg);
+            break;
+        default:
+            throw Parser::syntax_error(
+                location{}, "nlib: idl: callback arguments must be integers, "
+                            "pointers or small structs\n");
+        }
+    }
+
+    if (words > 6) {
+        throw Parser::syntax_error(
+            location{}, "nlib: idl: callbacks take at most six integer "
+                        "arguments\n");
+    }
+}
+
 [[maybe_unused]] void NativeLibs::idl_commit(idl_ast_node &root) {
     idl_ast_node &defs = root.children[0];
 
@@ -25,11 +94,18 @@ namespace arancini::native_lib {
                 static_cast<ir::value_type::size_type>(
                     rv.width)};              // is_const ignored
             std::vector<ir::value_type> args{};
+            std::vector<nlib_type_class> classes{};
             if (rv.tc == NLTC_CPLX) {
                 retty = ir::value_type::v(); // No actual return value
                 args.reserve(def.nr_children);
                 args.emplace_back(
                     ir::value_type::u64());  // ptr for return value
+                classes.push_back(NLTC_MEMPTR);
+            } else if (rv.tc == NLTC_STRUCT) {
+                // Returned in RAX:RDX on the guest and in the first two
+                // integer return registers on every supported host.
+                retty = struct_words(rv) == 1 ? ir::value_type::u64()
+                                              : ir::value_type::u128();
             } else {
                 args.reserve(def.nr_children - 1);
             }
@@ -38,13 +114,25 @@ namespace arancini::native_lib {
                 idl_ast_node &params = def.children[1];
                 for (int j = 0; j < params.nr_children; j++) {
                     idl_ast_node &arg_v = params.children[j].children[0];
-                    args.emplace_back(
-                        nlib_tc_to_vt(static_cast<nlib_type_class>(arg_v.tc)),
-                        arg_v.width);
+                    auto tc = static_cast<nlib_type_class>(arg_v.tc);
+                    if (tc == NLTC_FNPTR) {
+                        check_callback(arg_v);
+                    }
+                    if (tc == NLTC_STRUCT) {
+                        // Small structs are split into consecutive integer
+                        // registers by both the guest and host ABIs.
+                        for (int w = struct_words(arg_v); w > 0; w--) {
+                            args.emplace_back(ir::value_type::u64());
+                            classes.push_back(NLTC_STRUCT);
+                        }
+                        continue;
+                    }
+                    args.emplace_back(nlib_tc_to_vt(tc), arg_v.width);
+                    classes.push_back(tc);
                 }
             }
 
-            add_function(def.value, curlib, retty, args);
+            add_function(def.value, curlib, retty, args, classes);
         } else {
             throw Parser::syntax_error(location{},
                                        "nlib: idl: unknown definition type\n");
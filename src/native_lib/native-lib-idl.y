@@ -53,9 +53,11 @@
  * libdef : `library` libname `;`
  * libname : `"` .* `"`
  * fndef : ctypedef fname `(` params `)` `;`
- * typedef : `i8` | `i16` | `i32` | `i64` | `ilong` | `u1` | `u8` | `u16` | `u32` | `u64` | `ulong` | `f32` | `f64` | `fd` | `string` | ptrdef
+ * typedef : `i8` | `i16` | `i32` | `i64` | `ilong` | `u1` | `u8` | `u16` | `u32` | `u64` | `ulong` | `f32` | `f64` | `fd` | `string` | fnptrdef | ptrdef | structdef
  * ctypedef: typedef | `const` typedef
  * ptrdef : `ptr` | `ptr` `(` paramname `)`
+ * structdef : `struct` `(` [0-9]+ `)`      -- by-value struct of that many bytes
+ * fnptrdef : `fnptr` | `fnptr` `(` full_typedef `)` | `fnptr` `(` full_typedef `,` params `)`   -- callback with its return type and parameters
  * params : params `,` param
  *        | param
  *        |
@@ -64,14 +66,14 @@
  */
 
 
-%token T_LIBRARY T_CALLCONV T_STRING T_FD T_CPLX T_CONST T_PTR T_VOID
+%token T_LIBRARY T_CALLCONV T_STRING T_FD T_CPLX T_CONST T_PTR T_FNPTR T_STRUCT T_VOID
 %token T_I8 T_I16 T_I32 T_I64 T_ILONG T_U1 T_U8 T_U16 T_U32 T_U64 T_ULONG T_F32 T_F64
 %token T_STAR T_SEMI T_LPAREN T_RPAREN T_LBRACKET T_RBRACKET T_COMMA
-%token <std::string> STRING_LITERAL IDENTIFIER
+%token <std::string> STRING_LITERAL IDENTIFIER NUMBER
 
 %start idl
 
-%type <idl_ast_node> idl defs def libdef fndef const_typedef typedef ptrdef params param attrs attr maybe_attrlist ccdef full_typedef
+%type <idl_ast_node> idl defs def libdef fndef const_typedef typedef ptrdef structdef fnptrdef params param attrs attr maybe_attrlist ccdef full_typedef
 
 %%
 
@@ -124,6 +126,9 @@ typedef: ptrdef { $$ = $1; }
     | T_F32     { $$ = idl_ast_node(IANT_TYPEDEF); $$.width = 32; $$.tc = 3; }
     | T_F64     { $$ = idl_ast_node(IANT_TYPEDEF); $$.width = 64; $$.tc = 3; }
     | T_STRING  { $$ = idl_ast_node(IANT_TYPEDEF); $$.width = 64; $$.tc = 4; }
+    | fnptrdef  { $$ = $1; }
+    | T_FD      { $$ = idl_ast_node(IANT_TYPEDEF); $$.width = 32; $$.tc = 7; }
+    | structdef { $$ = $1; }
     | T_VOID    { $$ = idl_ast_node(IANT_TYPEDEF); $$.width = 0; $$.tc = 0; }
     | T_CPLX    { $$ = idl_ast_node(IANT_TYPEDEF); $$.width = 0; $$.tc = 8; }
     ;
@@ -132,6 +137,14 @@ ptrdef: T_PTR { $$ = idl_ast_node(IANT_TYPEDEF); $$.width = 64; $$.tc = 5; }
       | T_PTR T_LPAREN IDENTIFIER T_RPAREN { $$ = idl_ast_node(IANT_TYPEDEF); $$.width = 64; $$.tc = 5; }
       ;
 
+fnptrdef: T_FNPTR { $$ = idl_ast_node(IANT_TYPEDEF); $$.width = 64; $$.tc = 6; }
+        | T_FNPTR T_LPAREN full_typedef T_RPAREN { $$ = idl_ast_node(IANT_TYPEDEF); $$.width = 64; $$.tc = 6; $$.add_child(std::move($3)); $$.add_child(idl_ast_node(IANT_PARAMS)); }
+        | T_FNPTR T_LPAREN full_typedef T_COMMA params T_RPAREN { $$ = idl_ast_node(IANT_TYPEDEF); $$.width = 64; $$.tc = 6; $$.add_child(std::move($3)); $$.add_child(std::move($5)); }
+        ;
+
+structdef: T_STRUCT T_LPAREN NUMBER T_RPAREN { $$ = idl_ast_node(IANT_TYPEDEF); $$.width = std::stoi($3) * 8; $$.tc = 9; }
+         ;
+
 params: params T_COMMA param    { $$ = $1;  $$.add_child(std::move($3)); }
       | param                   { $$ = idl_ast_node(IANT_PARAMS);  $$.add_child(std::move($1)); }
       |                         { $$ = idl_ast_node(IANT_PARAMS); }
@@ -9,10 +9,12 @@ namespace arancini::native_lib {
  */
 void NativeLibs::add_function(const std::string &fname, std::string libname,
                               ir::value_type type,
-                              std::vector<ir::value_type> vector) {
+                              std::vector<ir::value_type> vector,
+                              std::vector<nlib_type_class> classes) {
 
     // Copy in the function details that we know at this time.
-    nlib_function fn{fname, std::move(libname), {type, vector}};
+    nlib_function fn{fname, std::move(libname), {type, vector},
+                     std::move(classes)};
 
     // Add the new function to the list.
     native_functions_.emplace(fname, std::move(fn));
@@ -22,16 +24,19 @@ ir::value_type_class NativeLibs::nlib_tc_to_vt(nlib_type_class tc) {
     case NLTC_VOID:
         return ir::value_type_class::none;
     case NLTC_SINT:
+    case NLTC_FD: // int
         return ir::value_type_class::signed_integer;
+    // Guest memory is mapped at the same addresses in the host and never
+    // moves, so strings and buffers are passed zero-copy as raw pointers.
     case NLTC_UINT:
     case NLTC_STRING: // uintptr_t
     case NLTC_MEMPTR: // uintptr_t
     case NLTC_CPLX:   // uintptr_t
+    case NLTC_FNPTR:  // uintptr_t, rebound to a host trampoline by the wrapper
+    case NLTC_STRUCT: // passed by value in one or two u64 registers
         return ir::value_type_class::unsigned_integer;
     case NLTC_FLOAT:
         return ir::value_type_class::floating_point;
-    case NLTC_FNPTR:
-    case NLTC_FD:
     default:
         throw std::runtime_error("Unsupported arg type for nlib def");
     }
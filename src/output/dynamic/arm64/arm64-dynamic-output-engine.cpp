@@ -8,5 +8,5 @@ using namespace arancini::output::dynamic::arm64;
 std::shared_ptr<translation_context>
 arm64_dynamic_output_engine::create_translation_context(
     machine_code_writer &writer) {
-    return std::make_shared<arm64_translation_context>(writer);
+    return std::make_shared<arm64_translation_context>(writer, ordering_);
 }
@@ -88,7 +88,7 @@ void instruction_builder::allocate() {
                 vri = reg->index();
                 type = reg->type();
             } else if (auto *mem = std::get_if<memory_operand>(&o.get());
-                       mem && mem->is_virtual()) {
+                       mem && mem->base_register().is_virtual()) {
                 auto vreg = mem->base_register();
                 vri = vreg.index();
                 type = vreg.type();
@@ -184,7 +184,7 @@ void instruction_builder::allocate() {
                              "reference {}\n",
                              o);
 
-                if (mem->is_virtual()) {
+                if (mem->base_register().is_virtual()) {
                     unsigned int vri = mem->base_register().index();
 
                     if (!vreg_to_preg.count(vri)) {
@@ -195,6 +195,21 @@ void instruction_builder::allocate() {
                         o.allocate_base(vreg_to_preg.at(vri), type);
                     }
                 }
+
+                // Index registers are always integer registers
+                if (mem->has_index() && mem->index_register().is_virtual()) {
+                    unsigned int vri = mem->index_register().index();
+                    auto type = mem->index_register().type();
+
+                    if (!vreg_to_preg.count(vri)) {
+                        std::size_t allocation = avail_physregs._Find_first();
+                        avail_physregs.flip(allocation);
+                        vreg_to_preg[vri] = allocation;
+                    }
+
+                    o.allocate_index(vreg_to_preg.at(vri), type);
+                    logger.debug("Allocating index register to {}\n", o);
+                }
             }
         }
 
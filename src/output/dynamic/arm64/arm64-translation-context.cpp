@@ -4,6 +4,7 @@
 #include <arancini/ir/value-type.h>
 #include <arancini/output/dynamic/arm64/arm64-instruction.h>
 #include <arancini/output/dynamic/arm64/arm64-translation-context.h>
+#include <arancini/output/dynamic/chain.h>
 #include <arancini/util/type-utils.h>
 
 #include <arancini/runtime/exec/x86/x86-cpu-state.h>
@@ -11,6 +12,7 @@
 #include <cctype>
 #include <cmath>
 #include <cstddef>
+#include <cstdint>
 #include <string>
 #include <unordered_map>
 
@@ -131,17 +133,34 @@ register_operand arm64_translation_context::mov_immediate(T imm,
     throw backend_exception("Immediate {} is too large", imm);
 }
 
+// Immediate offsets of LDR/STR are either unscaled 9-bit signed values
+// (LDUR/STUR) or unsigned 12-bit values scaled by the access size. The latter
+// are limited here to what fits in the u12 immediate operand.
+static bool is_valid_offset(std::int64_t offset, std::size_t size) {
+    if (offset >= -256 && offset <= 255)
+        return true;
+    return offset >= 0 && offset <= 4095 &&
+           offset % static_cast<std::int64_t>(size) == 0;
+}
+
 memory_operand arm64_translation_context::guestreg_memory_operand(
-    int regoff, memory_operand::address_mode mode) {
-    if (regoff > 255 || regoff < -256) {
-        const register_operand &base_vreg = vreg_alloc_.allocate(addr_type());
-        builder_.mov(base_vreg, immediate_operand(regoff, value_type::u32()));
-        builder_.add(base_vreg, context_block_reg, base_vreg);
-        return memory_operand(base_vreg, immediate_operand(0, u12()), mode);
-    } else {
+    int regoff, std::size_t size, memory_operand::address_mode mode) {
+    // Pre- and post-indexed accesses only take unscaled offsets
+    bool direct = mode == memory_operand::address_mode::direct;
+    if ((regoff >= 0 && regoff <= 255) ||
+        (direct && regoff >= 0 && is_valid_offset(regoff, size)))
         return memory_operand(context_block_reg,
                               immediate_operand(regoff, u12()), mode);
+
+    const register_operand &base_vreg = vreg_alloc_.allocate(addr_type());
+    if (regoff >= 0 && regoff <= 4095) {
+        builder_.add(base_vreg, context_block_reg,
+                     immediate_operand(regoff, u12()));
+    } else {
+        builder_.mov(base_vreg, immediate_operand(regoff, value_type::u32()));
+        builder_.add(base_vreg, context_block_reg, base_vreg);
     }
+    return memory_operand(base_vreg, immediate_operand(0, u12()), mode);
 }
 
 register_operand
@@ -154,11 +173,197 @@ arm64_translation_context::add_membase(const register_operand &addr,
     return mem_addr_vreg;
 }
 
+// Values that are only used by a single memory access (and whose flags are
+// not consumed) can be folded into its addressing mode without being
+// materialised on their own
+static bool foldable(const port &p) {
+    if (p.kind() != port_kinds::value || p.targets().size() != 1)
+        return false;
+
+    switch (p.owner()->kind()) {
+    case node_kinds::binary_arith: {
+        const auto *n = reinterpret_cast<const binary_arith_node *>(p.owner());
+        return n->zero().targets().empty() &&
+               n->negative().targets().empty() &&
+               n->overflow().targets().empty() &&
+               n->carry().targets().empty();
+    }
+    case node_kinds::bit_shift: {
+        const auto *n = reinterpret_cast<const bit_shift_node *>(p.owner());
+        return n->zero().targets().empty() && n->negative().targets().empty();
+    }
+    case node_kinds::constant:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static std::size_t access_size(const value_type &type) {
+    return std::max<std::size_t>(type.width() / 8, 1);
+}
+
+// Immediate for an offset that fold_address() accepted (see is_valid_offset())
+static immediate_operand offset_immediate(std::int64_t offset) {
+    if (offset < 0)
+        return immediate_operand(offset, s9());
+    return immediate_operand(offset, u12());
+}
+
+// Operand for the i-th register of a multi-register access
+static memory_operand element_operand(const memory_operand &address,
+                                      std::size_t offset) {
+    if (!offset)
+        return address;
+    return memory_operand(
+        address.base_register(),
+        offset_immediate(static_cast<std::int64_t>(address.offset().value()) +
+                         static_cast<std::int64_t>(offset)));
+}
+
+// Negative offsets are only encodable by the unscaled forms (LDUR/STUR)
+static bool is_unscaled(const memory_operand &mem) {
+    return !mem.has_index() && mem.offset().is_signed();
+}
+
+static bool is_gpr_access(const register_sequence &regs) {
+    for (std::size_t i = 0; i < regs.size(); ++i) {
+        if (regs[i].type().is_floating_point() || regs[i].type().is_vector())
+            return false;
+    }
+    return true;
+}
+
+static const binary_arith_node *as_foldable_add(const port &p) {
+    if (!foldable(p) || p.owner()->kind() != node_kinds::binary_arith)
+        return nullptr;
+
+    const auto *n = reinterpret_cast<const binary_arith_node *>(p.owner());
+    if (n->op() != binary_arith_op::add || n->val().type().is_vector() ||
+        n->val().type().element_width() != 64)
+        return nullptr;
+    return n;
+}
+
+memory_operand
+arm64_translation_context::fold_address(const port &address, std::size_t size,
+                                        std::size_t count, bool membase) {
+    // The x86 frontend computes addresses as
+    // ((base + (index << scale)) + displacement) (see compute_address())
+    const port *base = &address;
+    const port *index = nullptr;
+    unsigned int shift = 0;
+    std::int64_t displacement = 0;
+
+    // RIP-relative addresses carry two constants (length and displacement)
+    while (const auto *add = as_foldable_add(*base)) {
+        if (add->rhs().owner()->kind() != node_kinds::constant ||
+            !foldable(add->rhs()))
+            break;
+
+        const auto *c =
+            reinterpret_cast<const constant_node *>(add->rhs().owner());
+        auto value = displacement + static_cast<std::int64_t>(c->const_val_i());
+        auto last = value + static_cast<std::int64_t>((count - 1) * size);
+        if (!is_valid_offset(value, size) || !is_valid_offset(last, size))
+            break;
+
+        displacement = value;
+        base = &add->lhs();
+    }
+
+    if (const auto *add = as_foldable_add(*base);
+        add && add->rhs().type().element_width() == 64 &&
+        add->rhs().owner()->kind() != node_kinds::constant) {
+        index = &add->rhs();
+        base = &add->lhs();
+
+        if (const auto *shl = index->owner();
+            shl->kind() == node_kinds::bit_shift && foldable(*index)) {
+            const auto *n = reinterpret_cast<const bit_shift_node *>(shl);
+            const auto *amount = n->amount().owner();
+            if (n->op() == shift_op::lsl &&
+                amount->kind() == node_kinds::constant) {
+                auto value = reinterpret_cast<const constant_node *>(amount)
+                                 ->const_val_i();
+                if (value <= 3) {
+                    shift = value;
+                    index = &n->input();
+                }
+            }
+        }
+    }
+
+    register_operand base_vreg = materialise_port(*base)[0];
+    if (membase)
+        base_vreg = add_membase(base_vreg);
+
+    if (index) {
+        const auto &index_vreg = materialise_port(*index)[0];
+
+        // [base, index, LSL #shift] can only scale by the access size and does
+        // not take an additional displacement
+        auto access_shift = static_cast<unsigned int>(std::log2(size));
+        if (!displacement && count == 1 &&
+            (shift == 0 || shift == access_shift))
+            return memory_operand(base_vreg, index_vreg, shift);
+
+        const auto &addr_vreg = vreg_alloc_.allocate(addr_type());
+        builder_.add(addr_vreg, base_vreg, index_vreg,
+                     shift_operand("LSL", immediate_operand(shift, u12())));
+        base_vreg = addr_vreg;
+    }
+
+    return memory_operand(base_vreg, offset_immediate(displacement));
+}
+
+register_operand
+arm64_translation_context::address_register(const memory_operand &mem) {
+    if (mem.has_index()) {
+        const auto &addr_vreg = vreg_alloc_.allocate(addr_type());
+        builder_.add(
+            addr_vreg, mem.base_register(), mem.index_register(),
+            shift_operand("LSL", immediate_operand(mem.index_shift(), u12())));
+        return addr_vreg;
+    }
+
+    if (is_unscaled(mem)) {
+        const auto &addr_vreg = vreg_alloc_.allocate(addr_type());
+        builder_.sub(addr_vreg, mem.base_register(),
+                     immediate_operand(
+                         -static_cast<std::intmax_t>(mem.offset().value()),
+                         u12()));
+        return addr_vreg;
+    }
+
+    if (mem.offset().value()) {
+        const auto &addr_vreg = vreg_alloc_.allocate(addr_type());
+        builder_.add(addr_vreg, mem.base_register(), mem.offset());
+        return addr_vreg;
+    }
+
+    return mem.base_register();
+}
+
 void arm64_translation_context::begin_block() {
     ret_ = 0;
+    exit_ = block_exit::none;
+    exit_condition_ = nullptr;
     instr_cnt_ = 0;
     builder_ = instruction_builder();
     materialised_nodes_.clear();
+
+    if (block_counter()) {
+        const auto &counter = mov_immediate(
+            reinterpret_cast<std::uintptr_t>(block_counter()),
+            value_type::u64());
+        const auto &count = vreg_alloc_.allocate(value_type::u64());
+        const auto &incremented = vreg_alloc_.allocate(value_type::u64());
+        memory_operand mem(counter, immediate_operand(0, u12()));
+        builder_.ldr(count, mem, "load block execution count");
+        builder_.add(incremented, count, immediate_operand(1, u12()));
+        builder_.str(incremented, mem, "store block execution count");
+    }
 }
 
 [[nodiscard]]
@@ -210,15 +415,49 @@ void arm64_translation_context::end_instruction() {
     }
 }
 
-void arm64_translation_context::end_block() {
-    // Return value in x0 = 0;
+void arm64_translation_context::chain_exit(const std::string &site) {
     builder_.mov(register_operand(register_operand::x0),
-                 mov_immediate(ret_, value_type::u64()));
+                 mov_immediate(0, value_type::u64()));
+    builder_.label(site);
+    builder_.nop("chain site, patched to a branch to the successor");
+    builder_.adr(register_operand(register_operand::x1), site,
+                 "address of the chain site");
+    builder_.ret();
+}
+
+void arm64_translation_context::end_block() {
+    // Only normal block ends to static targets are chained
+    if (ret_ != 0)
+        exit_ = block_exit::none;
+
+    switch (exit_) {
+    case block_exit::direct:
+        chain_exit("chain_site");
+        break;
+    case block_exit::conditional: {
+        // PC already holds the selected target, each side gets its own site
+        const auto &cond = materialise_port(*exit_condition_);
+        builder_.cbnz(cond, std::string("chain_taken"),
+                      "branch to taken chain site");
+        chain_exit("chain_site_fallthrough");
+        builder_.label("chain_taken");
+        chain_exit("chain_site_taken");
+        break;
+    }
+    case block_exit::none:
+        // Return value in x0, 0 in x1 = no chain
+        builder_.mov(register_operand(register_operand::x0),
+                     mov_immediate(ret_, value_type::u64()));
+        builder_.mov(register_operand(register_operand::x1),
+                     mov_immediate(0, value_type::u64()));
+        break;
+    }
 
     try {
         builder_.allocate();
 
-        builder_.ret();
+        if (exit_ == block_exit::none)
+            builder_.ret();
 
         builder_.emit(writer());
     } catch (std::exception &e) {
@@ -238,6 +477,50 @@ void arm64_translation_context::end_block() {
     reset_context();
 }
 
+// NOP
+static constexpr std::uint32_t chain_site_encoding = 0xd503201f;
+
+void arm64_translation_context::chain(uint64_t chain_address,
+                                      void *chain_target) {
+    auto *site = reinterpret_cast<std::uint32_t *>(chain_address);
+    auto offset = reinterpret_cast<std::intptr_t>(chain_target) -
+                  static_cast<std::intptr_t>(chain_address);
+
+    // Another thread may have chained this site already
+    if (__atomic_load_n(site, __ATOMIC_ACQUIRE) != chain_site_encoding)
+        return;
+
+    // B reaches +/-128MiB, farther successors keep returning to the runtime
+    if (offset < -(1l << 27) || offset >= (1l << 27)) {
+        logger.debug("Cannot chain site {:#x} to {}\n", chain_address,
+                     chain_target);
+        return;
+    }
+
+    // NOP and B are among the instructions that the architecture allows to be
+    // exchanged while another thread executes them, see chain.h
+    patch_instruction(writer(), site,
+                      0x14000000 | ((offset >> 2) & 0x3FFFFFF));
+
+    // Only needed to undo chains when going multi-threaded, which happens
+    // while no other thread exists
+    if (single_threaded_)
+        chained_sites_.push_back(site);
+}
+
+bool arm64_translation_context::enter_multithreaded() {
+    single_threaded_ = false;
+    if (ordering_ == memory_ordering::relaxed)
+        return false;
+
+    // The translations are discarded, so no chain may lead back into them
+    for (auto *site : chained_sites_)
+        patch_instruction(writer(), site, chain_site_encoding);
+    chained_sites_.clear();
+
+    return true;
+}
+
 void arm64_translation_context::reset_context() {
     nodes_.clear();
     materialised_nodes_.clear();
@@ -374,7 +657,8 @@ void arm64_translation_context::materialise_read_reg(const read_reg_node &n) {
     auto &dest_vregs = vreg_alloc_.allocate(n.val());
     for (std::size_t i = 0; i < dest_vregs.size(); ++i) {
         std::size_t width = dest_vregs[i].type().width();
-        auto addr = guestreg_memory_operand(n.regoff() + i * width);
+        auto addr = guestreg_memory_operand(n.regoff() + i * width,
+                                            access_size(dest_vregs[i].type()));
         switch (width) {
         case 1:
         case 8:
@@ -404,7 +688,7 @@ void arm64_translation_context::materialise_write_reg(const write_reg_node &n) {
     auto &src_vregs = materialise_port(n.value());
     if (is_flag_port(n.value())) {
         const auto &src_vreg = flag_map.at(n.regoff());
-        auto addr = guestreg_memory_operand(n.regoff());
+        auto addr = guestreg_memory_operand(n.regoff(), 1);
         builder_.strb(src_vreg, addr,
                       fmt::format("write flag: {}", n.regname()));
         return;
@@ -428,7 +712,8 @@ void arm64_translation_context::materialise_write_reg(const write_reg_node &n) {
             src_vregs[i] = cast(src_vregs[i], n.value().type());
 
         std::size_t width = src_vregs[i].type().width();
-        auto addr = guestreg_memory_operand(n.regoff() + i * width);
+        auto addr = guestreg_memory_operand(n.regoff() + i * width,
+                                            access_size(src_vregs[i].type()));
         switch (width) {
         case 1:
         case 8:
@@ -451,8 +736,6 @@ void arm64_translation_context::materialise_write_reg(const write_reg_node &n) {
 }
 
 void arm64_translation_context::materialise_read_mem(const read_mem_node &n) {
-    const register_operand &addr_vreg = materialise_port(n.address());
-
     // Sanity checks
     auto type = n.val().type();
     if (type.is_vector() && type.element_width() > base_type().element_width())
@@ -460,23 +743,49 @@ void arm64_translation_context::materialise_read_mem(const read_mem_node &n) {
                                 "individual elements larger than 64-bits");
 
     const auto &dest_vregs = vreg_alloc_.allocate(n.val());
+    std::size_t size = access_size(dest_vregs[0].type());
+    auto address = fold_address(n.address(), size, dest_vregs.size(), false);
+
+    // LDAR only loads general purpose registers; floating point loads are
+    // followed by a barrier instead
+    bool ordered = !single_threaded_ &&
+                   ordering_ == memory_ordering::acquire_release;
+    bool acquire = ordered && is_gpr_access(dest_vregs);
 
     auto comment = "read memory";
     for (std::size_t i = 0; i < dest_vregs.size(); ++i) {
         std::size_t width = dest_vregs[i].type().width();
 
-        memory_operand mem_op(addr_vreg, immediate_operand(i * width, u12()));
+        auto mem_op = element_operand(address, i * size);
+        if (acquire)
+            mem_op = memory_operand(address_register(mem_op));
+
         switch (width) {
         case 1:
         case 8:
-            builder_.ldrb(dest_vregs[i], mem_op, comment);
+            if (acquire)
+                builder_.ldarb(dest_vregs[i], mem_op, comment);
+            else if (is_unscaled(mem_op))
+                builder_.ldurb(dest_vregs[i], mem_op, comment);
+            else
+                builder_.ldrb(dest_vregs[i], mem_op, comment);
             break;
         case 16:
-            builder_.ldrh(dest_vregs[i], mem_op, comment);
+            if (acquire)
+                builder_.ldarh(dest_vregs[i], mem_op, comment);
+            else if (is_unscaled(mem_op))
+                builder_.ldurh(dest_vregs[i], mem_op, comment);
+            else
+                builder_.ldrh(dest_vregs[i], mem_op, comment);
             break;
         case 32:
         case 64:
-            builder_.ldr(dest_vregs[i], mem_op, comment);
+            if (acquire)
+                builder_.ldar(dest_vregs[i], mem_op, comment);
+            else if (is_unscaled(mem_op))
+                builder_.ldur(dest_vregs[i], mem_op, comment);
+            else
+                builder_.ldr(dest_vregs[i], mem_op, comment);
             break;
         default:
             // This is by definition; registers >= 64-bits are always vector
@@ -485,11 +794,12 @@ void arm64_translation_context::materialise_read_mem(const read_mem_node &n) {
                 "Cannot load individual memory values larger than 64-bits");
         }
     }
+
+    if (ordered && !acquire)
+        builder_.dmb("ishld", "order load before later accesses");
 }
 
 void arm64_translation_context::materialise_write_mem(const write_mem_node &n) {
-    const auto &addr_vreg = materialise_port(n.address());
-
     auto type = n.val().type();
 
     // Sanity check; cannot by definition load a register larger than 64-bit
@@ -498,25 +808,52 @@ void arm64_translation_context::materialise_write_mem(const write_mem_node &n) {
         throw backend_exception(
             "Larger than 64-bit integers in vectors not supported by backend");
 
-    const auto &address = add_membase(addr_vreg);
     const auto &src_vregs = materialise_port(n.value());
+    std::size_t size = access_size(src_vregs[0].type());
+    auto address = fold_address(n.address(), size, src_vregs.size(), true);
+
+    // STLR only stores general purpose registers; floating point stores are
+    // preceded by a barrier instead
+    bool ordered = !single_threaded_ &&
+                   ordering_ == memory_ordering::acquire_release;
+    bool release = ordered && is_gpr_access(src_vregs);
+    if (ordered && !release)
+        builder_.dmb("ish", "order earlier accesses before store");
 
     auto comment = "write memory";
     for (std::size_t i = 0; i < src_vregs.size(); ++i) {
         std::size_t width = src_vregs[i].type().width();
 
-        memory_operand mem_op(address, immediate_operand(i * width, u12()));
+        auto mem_op = element_operand(address, i * size);
+        if (release)
+            mem_op = memory_operand(address_register(mem_op));
+
         switch (width) {
         case 1:
         case 8:
-            builder_.strb(src_vregs[i], mem_op, comment);
+            if (release)
+                builder_.stlrb(src_vregs[i], mem_op, comment);
+            else if (is_unscaled(mem_op))
+                builder_.sturb(src_vregs[i], mem_op, comment);
+            else
+                builder_.strb(src_vregs[i], mem_op, comment);
             break;
         case 16:
-            builder_.strh(src_vregs[i], mem_op, comment);
+            if (release)
+                builder_.stlrh(src_vregs[i], mem_op, comment);
+            else if (is_unscaled(mem_op))
+                builder_.sturh(src_vregs[i], mem_op, comment);
+            else
+                builder_.strh(src_vregs[i], mem_op, comment);
             break;
         case 32:
         case 64:
-            builder_.str(src_vregs[i], mem_op, comment);
+            if (release)
+                builder_.stlr(src_vregs[i], mem_op, comment);
+            else if (is_unscaled(mem_op))
+                builder_.stur(src_vregs[i], mem_op, comment);
+            else
+                builder_.str(src_vregs[i], mem_op, comment);
             break;
         default:
             // This is by definition; registers >= 64-bits are always vector
@@ -533,6 +870,23 @@ void arm64_translation_context::materialise_read_pc(const read_pc_node &n) {
                  "read program counter");
 }
 
+// Whether a branch target is known at translation time
+static bool is_static_target(const port &p) {
+    switch (p.owner()->kind()) {
+    case node_kinds::constant:
+    case node_kinds::read_pc:
+        return true;
+    case node_kinds::binary_arith: {
+        const auto *n = reinterpret_cast<const binary_arith_node *>(p.owner());
+        return (n->op() == binary_arith_op::add ||
+                n->op() == binary_arith_op::sub) &&
+               is_static_target(n->lhs()) && is_static_target(n->rhs());
+    }
+    default:
+        return false;
+    }
+}
+
 void arm64_translation_context::materialise_write_pc(const write_pc_node &n) {
     const auto &new_pc_vreg = materialise_port(n.value());
 
@@ -543,8 +897,22 @@ void arm64_translation_context::materialise_write_pc(const write_pc_node &n) {
         ret_ = 4;
     }
 
+    exit_ = block_exit::none;
+    if (n.updates_pc() == br_type::br && is_static_target(n.value())) {
+        exit_ = block_exit::direct;
+    } else if (n.updates_pc() == br_type::csel &&
+               n.value().owner()->kind() == node_kinds::csel) {
+        const auto &node =
+            *reinterpret_cast<const csel_node *>(n.value().owner());
+        if (is_static_target(node.trueval()) &&
+            is_static_target(node.falseval())) {
+            exit_ = block_exit::conditional;
+            exit_condition_ = &node.condition();
+        }
+    }
+
     builder_.str(new_pc_vreg,
-                 guestreg_memory_operand(static_cast<int>(reg_offsets::PC)),
+                 guestreg_memory_operand(static_cast<int>(reg_offsets::PC), 8),
                  "write program counter");
 }
 
@@ -1,12 +1,73 @@
 #include <arancini/output/dynamic/riscv64/riscv64-dynamic-output-engine.h>
 #include <arancini/output/dynamic/riscv64/riscv64-translation-context.h>
+#include <arancini/util/logger.h>
+
+#include <cstdint>
 #include <stdexcept>
+#include <sys/auxv.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 using namespace arancini::output::dynamic;
 using namespace arancini::output::dynamic::riscv64;
 
+// From <asm/hwprobe.h>, which older kernel headers lack
+#ifndef __NR_riscv_hwprobe
+#define __NR_riscv_hwprobe 258
+#endif
+
+struct hwprobe_pair {
+    std::int64_t key;
+    std::uint64_t value;
+};
+
+static constexpr std::int64_t hwprobe_key_ima_ext_0 = 4;
+static constexpr std::uint64_t hwprobe_ext_zba = 1ull << 3;
+static constexpr std::uint64_t hwprobe_ext_zbb = 1ull << 4;
+static constexpr std::uint64_t hwprobe_ext_zbs = 1ull << 5;
+static constexpr std::uint64_t hwprobe_ext_zicond = 1ull << 35;
+
+static ExtensionSet optional_extension(bool present, Extension extension) {
+    return present ? ExtensionSet(extension) : ExtensionSet::Empty();
+}
+
+/**
+ * Extensions beyond RV64GC the host supports. Queried with riscv_hwprobe
+ * (Linux 6.4+, and QEMU user mode which honours -cpu rv64,zba=...). Older
+ * kernels only report single-letter extensions in AT_HWCAP, where B implies
+ * Zba, Zbb and Zbs.
+ */
+static ExtensionSet detect_host_extensions() {
+    hwprobe_pair pair{hwprobe_key_ima_ext_0, 0};
+    if (syscall(__NR_riscv_hwprobe, &pair, 1, 0, nullptr, 0) == 0 &&
+        pair.key != -1) {
+        return RV_GC |
+               optional_extension(pair.value & hwprobe_ext_zba, RV_Zba) |
+               optional_extension(pair.value & hwprobe_ext_zbb, RV_Zbb) |
+               optional_extension(pair.value & hwprobe_ext_zbs, RV_Zbs) |
+               optional_extension(pair.value & hwprobe_ext_zicond, RV_Zicond);
+    }
+
+    bool b = getauxval(AT_HWCAP) & (1ul << ('B' - 'A'));
+    return RV_GC | optional_extension(b, RV_Zba) |
+           optional_extension(b, RV_Zbb) | optional_extension(b, RV_Zbs);
+}
+
+static ExtensionSet host_extensions() {
+    static const ExtensionSet extensions = [] {
+        auto detected = detect_host_extensions();
+        util::global_logger.info(
+            "RISC-V extensions: Zba={} Zbb={} Zbs={} Zicond={}\n",
+            detected.Includes(RV_Zba), detected.Includes(RV_Zbb),
+            detected.Includes(RV_Zbs), detected.Includes(RV_Zicond));
+        return detected;
+    }();
+    return extensions;
+}
+
 std::shared_ptr<translation_context>
 riscv64_dynamic_output_engine::create_translation_context(
     machine_code_writer &writer) {
-    return std::make_shared<riscv64_translation_context>(writer);
+    return std::make_shared<riscv64_translation_context>(writer,
+                                                         host_extensions());
 }
@@ -11,6 +11,7 @@
 #include <arancini/output/dynamic/riscv64/utils.h>
 
 #include <algorithm>
+#include <cstring>
 #include <unordered_map>
 
 using namespace arancini::output::dynamic::riscv64;
@@ -243,6 +244,15 @@ void riscv64_translation_context::begin_block() {
 #endif
 
     add_marker(1);
+
+    if (block_counter()) {
+        TypedRegister &counter = materialise_constant(
+            reinterpret_cast<intptr_t>(block_counter()));
+        TypedRegister &count = allocate_register(nullptr).first;
+        builder_.ld(count, AddressOperand{counter, 0});
+        builder_.addi(count, count, 1);
+        builder_.sd(count, AddressOperand{counter, 0});
+    }
 }
 
 void riscv64_translation_context::begin_instruction(off_t address,
@@ -819,8 +829,67 @@ TypedRegister &riscv64_translation_context::materialise_binary_atomic(
     return out_reg;
 }
 
+/**
+ * Matches the byte reversal the x86 frontend emits for BSWAP, i.e. a bitcast of
+ * insert(...insert(v, 0, extract(v, n-1))..., n-1, extract(v, 0)) where v is a
+ * byte vector bitcast from a scalar.
+ * @return The port of the reversed scalar, nullptr if n is something else
+ */
+static const port *byte_reversed_value(const cast_node &n) {
+    if (n.op() != cast_op::bitcast || !is_gpr(n.val())) {
+        return nullptr;
+    }
+
+    const int nr_bytes = n.val().type().width() / 8;
+    if (nr_bytes != 4 && nr_bytes != 8) {
+        return nullptr;
+    }
+
+    const port *vct = &n.source_value();
+    const port *bytes = nullptr;
+    for (int i = nr_bytes - 1; i >= 0; i--) {
+        if (vct->owner()->kind() != node_kinds::vector_insert) {
+            return nullptr;
+        }
+        const auto &insert =
+            *reinterpret_cast<const vector_insert_node *>(vct->owner());
+        const port &value = insert.insert_value();
+        if ((int)insert.index() != i ||
+            value.owner()->kind() != node_kinds::vector_extract) {
+            return nullptr;
+        }
+        const auto &extract =
+            *reinterpret_cast<const vector_extract_node *>(value.owner());
+        if ((int)extract.index() != nr_bytes - 1 - i ||
+            (bytes && &extract.source_vector() != bytes)) {
+            return nullptr;
+        }
+        bytes = &extract.source_vector();
+        vct = &insert.source_vector();
+    }
+
+    if (vct != bytes || bytes->owner()->kind() != node_kinds::cast) {
+        return nullptr;
+    }
+    const auto &src = *reinterpret_cast<const cast_node *>(bytes->owner());
+    if (src.op() != cast_op::bitcast || !is_gpr(src.source_value())) {
+        return nullptr;
+    }
+    return &src.source_value();
+}
+
 TypedRegister &
 riscv64_translation_context::materialise_cast(const cast_node &n) {
+    if (builder_.supports(RV_Zbb)) {
+        if (const port *value = byte_reversed_value(n)) {
+            auto [out_reg, valid] = allocate_register(&n.val());
+            if (valid) {
+                byte_reverse(builder_, out_reg, *materialise(value->owner()));
+            }
+            return out_reg;
+        }
+    }
+
     TypedRegister &src_reg = *materialise(n.source_value().owner());
 
     bool works =
@@ -986,7 +1055,18 @@ riscv64_translation_context::materialise_bit_insert(const bit_insert_node &n) {
                is_gpr(n.bits())) {
         // Insert into 64B register
         auto [out_reg, valid] = allocate_register(&n.val());
-        if (valid) {
+        if (!valid) {
+            return out_reg;
+        }
+
+        const std::optional<int64_t> &bit = get_as_int(n.bits().owner());
+        if (length == 1 && bit && builder_.supports(RV_Zbs)) {
+            if (*bit & 1) {
+                builder_.bseti(out_reg, src, to);
+            } else {
+                builder_.bclri(out_reg, src, to);
+            }
+        } else {
             bit_insert(builder_, out_reg, src, bits, to, length);
         }
         return out_reg;
@@ -1174,9 +1254,7 @@ void riscv64_translation_context::materialise_write_pc(const write_pc_node &n) {
             write_back_registers();
             // Now A1 register is available
 
-            // Save address to patch jump into when chaining (A1 second ret
-            // value)
-            builder_.auipc(A1, 0);
+            emit_chain_site(false);
 
             TypedRegister &reg = materialise_constant(*target);
             builder_.sd(reg, AddressOperand{
@@ -1193,23 +1271,18 @@ void riscv64_translation_context::materialise_write_pc(const write_pc_node &n) {
                 TypedRegister &cond = *materialise(node.condition().owner());
                 extend_to_64(builder_, cond, cond);
 
-                // Set up chain
+                // Set up chain, each side gets its own site
 
                 // Write back all registers
                 write_back_registers();
                 // Now A1 register is available
 
-                // Save address to patch jump into when chaining (A1 second ret
-                // value)
-                builder_.auipc(A1, 0);
-
                 Label *false_calc = builder_.alloc_label();
                 Label *end = builder_.alloc_label();
 
                 builder_.beqz(cond, false_calc, Assembler::kNearJump);
 
-                builder_.Align(Assembler::label_align);
-                builder_.auipc_keep(A1, 0);
+                emit_chain_site(false);
                 TypedRegister &trueval = materialise_constant(*target2);
                 builder_.sd(trueval, AddressOperand{FP, static_cast<intptr_t>(
                                                             reg_offsets::PC)});
@@ -1217,6 +1290,8 @@ void riscv64_translation_context::materialise_write_pc(const write_pc_node &n) {
 
                 builder_.Bind(false_calc);
 
+                // Keeps A1 of the first site live across this path
+                emit_chain_site(true);
                 TypedRegister &falseval = materialise_constant(*target1);
                 builder_.sd(falseval, AddressOperand{FP, static_cast<intptr_t>(
                                                              reg_offsets::PC)});
@@ -1483,6 +1558,11 @@ TypedRegister &riscv64_translation_context::materialise_binary_arith(
         allocate_in_order<reg_idx::ZF, reg_idx::OF, reg_idx::CF, reg_idx::SF>(
             &n.zero(), &n.overflow(), &n.carry(), &n.negative());
 
+    if (n.op() == binary_arith_op::add && !(zf || of || cf || sf) &&
+        materialise_shift_add(out_reg, n)) {
+        return out_reg;
+    }
+
     TypedRegister &src_reg1 = *materialise(n.lhs().owner());
 
     const std::optional<int64_t> &i = get_as_int(n.rhs().owner());
@@ -1616,6 +1696,49 @@ standardPath:
     return out_reg;
 }
 
+/**
+ * Folds the addition of a value shifted left by 1 to 3 bits into a single Zba
+ * shNadd, as used for scaled index addressing.
+ * @return Whether the addition was emitted
+ */
+bool riscv64_translation_context::materialise_shift_add(
+    TypedRegister &out, const binary_arith_node &n) {
+    if (!builder_.supports(RV_Zba) || !is_int(n.val(), 64)) {
+        return false;
+    }
+
+    for (const port *shifted : {&n.rhs(), &n.lhs()}) {
+        if (shifted->owner()->kind() != node_kinds::bit_shift) {
+            continue;
+        }
+        const auto &shift =
+            *reinterpret_cast<const bit_shift_node *>(shifted->owner());
+        const std::optional<int64_t> &amt = get_as_int(shift.amount().owner());
+        if (shift.op() != shift_op::lsl || !is_int(shift.input(), 64) ||
+            !amt || *amt < 1 || *amt > 3) {
+            continue;
+        }
+
+        const port &base = shifted == &n.rhs() ? n.lhs() : n.rhs();
+        TypedRegister &index_reg = *materialise(shift.input().owner());
+        TypedRegister &base_reg = *materialise(base.owner());
+        switch (*amt) {
+        case 1:
+            builder_.sh1add(out, index_reg, base_reg);
+            break;
+        case 2:
+            builder_.sh2add(out, index_reg, base_reg);
+            break;
+        case 3:
+            builder_.sh3add(out, index_reg, base_reg);
+            break;
+        }
+        return true;
+    }
+
+    return false;
+}
+
 TypedRegister &riscv64_translation_context::materialise_constant(int64_t imm) {
     // Optimizations with left or right shift at the end not implemented (for
     // constants with trailing or leading zeroes)
@@ -1640,9 +1763,6 @@ riscv64_translation_context::materialise_csel(const csel_node &n) {
         return out_reg;
     }
 
-    Label *false_calc = builder_.alloc_label();
-    Label *end = builder_.alloc_label();
-
     TypedRegister &cond = *materialise(n.condition().owner());
 
     extend_to_64(builder_, cond, cond);
@@ -1651,18 +1771,29 @@ riscv64_translation_context::materialise_csel(const csel_node &n) {
 
     TypedRegister &falseval = *materialise(n.falseval().owner());
 
-    builder_.beqz(cond,
-                  false_calc); // TODO Single instruction jump optimization
+    if (builder_.supports(RV_Zicond)) {
+        // Branchless: (trueval if cond != 0) | (falseval if cond == 0)
+        RegisterOperand temp = builder_.next_register();
+        builder_.czeronez(temp, falseval, cond);
+        builder_.czeroeqz(out_reg, trueval, cond);
+        builder_.or_(out_reg, out_reg, temp);
+    } else {
+        Label *false_calc = builder_.alloc_label();
+        Label *end = builder_.alloc_label();
 
-    builder_.mv(out_reg, trueval);
+        builder_.beqz(cond,
+                      false_calc); // TODO Single instruction jump optimization
 
-    builder_.j(end);
+        builder_.mv(out_reg, trueval);
 
-    builder_.Bind(false_calc);
+        builder_.j(end);
 
-    builder_.mv_keep(out_reg, falseval);
+        builder_.Bind(false_calc);
 
-    builder_.Bind(end);
+        builder_.mv_keep(out_reg, falseval);
+
+        builder_.Bind(end);
+    }
 
     // In-types might be wider than out-type so out accurate to narrower of the
     // two
@@ -1805,345 +1936,79 @@ TypedRegister &riscv64_translation_context::materialise_vector_extract(
 }
 
 /*
-         Instructions:
-         If FOLLOWING instruction is NOT a branch (so we do unconditional
-   control flow or we are in the trueval part of conditional): If PREVIOUS
-   instruction is NOT a nop: overwrite AUIPC with J (or if it doesn't fit with
-   AUIPC + JR) If it is a NOP (previous instruction was an already chained
-   branch, see below): overwrite previous instruction with J (or if it doesn't
-   fit with AUIPC + JR) If following instruction IS a branch (so it is falseval
-   part of conditional control flow): 1a. overwrite AUIPC with that branch +
-   adjusted offset to following block 1b. and the branch with a NOP if the
-   instruction following the branch is a J OR an AUIPC + JR: move the J (or
-   AUIPC + JR) in place of the NOP (trueval part already chained)
-         2. if offset doesn't fit:
-                        a) overwrite AUIPC with inverted branch + single ins
-   offset b) the branch with unconditional branch to block If that still doesn't
-   fit: a) overwrite AUIPC with inverted branch + single ins offset b) move the
-   constant generation of trueval by 1 instruction (falseval not needed anymore,
-   can be overwritten) c) overwrite the branch with AUIPC d) overwrite the
-   "hole" with JR
+  A chain site is an aligned AUIPC that leaves the address of the site in A1
+  for the runtime. It is followed by a jump over 8 reserved bytes, the stub:
+
+        auipc a1, 0       <- patched to J successor, or J stub
+        j     1f
+  stub: nop                  auipc a1, %hi(successor)
+        nop               -> jr    %lo(successor)(a1)
+    1:  ...
+
+  The site is patched with a single atomic store, the stub is written before
+  and only reached once the site is patched (see chain.h).
 */
+void riscv64_translation_context::emit_chain_site(bool keep_a1) {
+    builder_.Align(Assembler::label_align);
+    if (keep_a1) {
+        builder_.auipc_keep(A1, 0);
+    } else {
+        builder_.auipc(A1, 0);
+    }
+
+    Label *skip = builder_.alloc_label();
+    builder_.j(skip, Assembler::kNearJump);
+    builder_.nop(true);
+    builder_.nop(true);
+    builder_.Bind(skip);
+}
+
+// AUIPC A1, 0
+static const uint32_t chain_site_encoding =
+    EncodeUTypeImm(0) | EncodeRd(A1) | EncodeOpcode(AUIPC);
+
 void riscv64_translation_context::chain(uint64_t chain_address,
                                         void *chain_target) {
-    auto instr_p = reinterpret_cast<uint32_t *>(chain_address);
-    uint32_t following_instr_enc = *(instr_p + 1);
-    if (IsCInstruction(following_instr_enc)) {
-        CInstruction following_instr{
-            static_cast<uint16_t>(following_instr_enc)};
-        if (following_instr.opcode() == C_BEQZ ||
-            following_instr.opcode() == C_BNEZ) {
-            chain_machine_code_writer writer =
-                chain_machine_code_writer{instr_p, 12};
-
-            Assembler ass{&writer, false, RV_GC};
-
-            intptr_t offset = ass.offset_from_target(
-                reinterpret_cast<intptr_t>(chain_target));
-
-            if (!IsBTypeImm(offset)) {
-                Label end{};
-
-                if (following_instr.opcode() == C_BEQZ) {
-                    ass.bnez(following_instr.rs1p(), &end,
-                             Assembler::kNearJump);
-                } else {
-                    ass.beqz(following_instr.rs1p(), &end,
-                             Assembler::kNearJump);
-                }
+    auto *site = reinterpret_cast<uint32_t *>(chain_address);
 
-                offset = ass.offset_from_target(
-                    reinterpret_cast<intptr_t>(chain_target));
-
-                if (!IsJTypeImm(offset)) {
-                    // We need to "make room" for "branch" (above) + AUIPC + JR.
-                    // So we still need 8 Bytes (2 full size instructions) after
-                    // the branch. We already have 4 Bytes due to the AUIPC, so
-                    // move everything by 4 Bytes until a terminating J/JR,
-                    // possibly compressed.
-                    auto instr_p_next = reinterpret_cast<uint32_t *>(
-                        reinterpret_cast<uint16_t *>(instr_p + 1) + 1);
-                    auto save = *instr_p_next;
-
-                    auto offLo32 = (int32_t)offset;
-                    auto offLo12 = offLo32 << (32 - 12) >>
-                                   (32 - 12); // sign extend lower 12 bit
-                    int32_t off32Hi20 = (offLo32 - offLo12);
-                    ass.auipc(A1, off32Hi20);
-                    ass.jr(A1, offLo12);
-                    if (!offLo12) { // JR will be compressed
-                        ass.nop();  // CNOP
-                    }
-                    instr_p_next++;
-
-                    for (bool skip_lower = false;; instr_p_next++) {
-                        const uint32_t parcel = *instr_p_next;
-                        *instr_p_next = save;
-
-                        if (skip_lower || IsCInstruction(save)) {
-                            // Handle lower half
-                            if (!skip_lower) {
-                                CInstruction c_instr{
-                                    static_cast<uint16_t>(save)};
-                                if (c_instr.opcode() == C_J) {
-                                    // Found termination point, decrease offset
-                                    // by 4 and reemit
-                                    intptr_t new_off = c_instr.j_imm() - 4;
-
-                                    chain_machine_code_writer writer1 =
-                                        chain_machine_code_writer{instr_p_next,
-                                                                  8};
-                                    Assembler ass1{&writer1, false, RV_GC};
-                                    ass1.j(new_off);
-
-                                    break;
-                                }
-                                if (c_instr.opcode() == C_JR) {
-                                    // Found termination point
-                                    chain_machine_code_writer writer1 =
-                                        chain_machine_code_writer{instr_p_next,
-                                                                  8};
-                                    Assembler ass1{&writer1, false, RV_GC};
-                                    ass1.jr(c_instr.rs1(), -4);
-                                    break;
-                                }
-                            } else {
-                                skip_lower = false;
-                            }
-                            // Handle upper half
-                            if (IsCInstruction(save >> 16)) {
-                                // Second 16 Bit instruction in the upper half
-                                CInstruction c_instr2{
-                                    static_cast<uint16_t>(save >> 16)};
-
-                                if (c_instr2.opcode() == C_J) {
-                                    // Found termination point, decrease offset
-                                    // by 4 and reemit
-                                    intptr_t new_off = c_instr2.j_imm() - 4;
-
-                                    chain_machine_code_writer writer1 =
-                                        chain_machine_code_writer{
-                                            reinterpret_cast<uint16_t *>(
-                                                instr_p_next) +
-                                                1,
-                                            8};
-                                    Assembler ass1{&writer1, false, RV_GC};
-                                    ass1.j(new_off);
-
-                                    break;
-                                }
-                                if (c_instr2.opcode() == C_JR) {
-                                    // Found termination point
-                                    chain_machine_code_writer writer1 =
-                                        chain_machine_code_writer{
-                                            reinterpret_cast<uint16_t *>(
-                                                instr_p_next) +
-                                                1,
-                                            8};
-                                    Assembler ass1{&writer1, false, RV_GC};
-                                    ass1.jr(c_instr2.rs1(), -4);
-                                    break;
-                                }
-                            } else {
-                                // Lower half of a 32bit instruction in the
-                                // upper half
-                                skip_lower = true;
-                                Instruction split_instr{parcel << 16 |
-                                                        save >> 16};
-                                if (split_instr.opcode() == JAL) {
-                                    // Instruction should be a J
-                                    // Found termination point, decrease offset
-                                    // by 4 and reemit
-                                    intptr_t new_off =
-                                        split_instr.jtype_imm() - 4;
-                                    chain_machine_code_writer writer1 =
-                                        chain_machine_code_writer{
-                                            reinterpret_cast<uint16_t *>(
-                                                instr_p_next) +
-                                                1,
-                                            8};
-                                    Assembler ass1{&writer1, false, RV_GC};
-                                    ass1.j(new_off);
-                                    break;
-                                }
-                                if (split_instr.opcode() == JALR) {
-                                    // Instruction should be a JR
-                                    // Found termination point
-                                    chain_machine_code_writer writer1 =
-                                        chain_machine_code_writer{
-                                            reinterpret_cast<uint16_t *>(
-                                                instr_p_next) +
-                                                1,
-                                            8};
-                                    Assembler ass1{&writer1, false, RV_GC};
-                                    ass1.jr(split_instr.rs1(),
-                                            split_instr.itype_imm() - 4);
-                                    break;
-                                }
-                            }
-
-                        } else {
-                            Instruction instr{save};
-                            if (instr.opcode() == JAL) {
-                                // Instruction should be a J
-                                // Found termination point, decrease offset by 4
-                                // and reemit
-                                intptr_t new_off = instr.jtype_imm() - 4;
-                                chain_machine_code_writer writer1 =
-                                    chain_machine_code_writer{instr_p_next, 8};
-                                Assembler ass1{&writer1, false, RV_GC};
-                                ass1.j(new_off);
-                                break;
-                            }
-                            if (instr.opcode() == JALR) {
-                                // Instruction should be a JR
-                                // Found termination point
-                                chain_machine_code_writer writer1 =
-                                    chain_machine_code_writer{instr_p_next, 8};
-                                Assembler ass1{&writer1, false, RV_GC};
-                                ass1.jr(instr.rs1(), instr.itype_imm() - 4);
-                                break;
-                            }
-                        }
-                        save = parcel;
-                    }
-                } else {
-                    ass.j(offset);
-                }
-                ass.Align(Assembler::label_align);
-                ass.Bind(&end);
-            } else {
-                if (following_instr.opcode() == C_BEQZ) {
-                    ass.beqz(following_instr.rs1p(), offset);
-                } else {
-                    ass.bnez(following_instr.rs1p(), offset);
-                }
+    // Another thread may have chained this site already
+    if (__atomic_load_n(site, __ATOMIC_ACQUIRE) != chain_site_encoding) {
+        return;
+    }
 
-                ass.nop(IsCBImm(
-                    offset)); // AUIPC full and c_bxx half size, so replacement
-                              // one full and one half instruction
+    intptr_t offset = reinterpret_cast<intptr_t>(chain_target) -
+                      static_cast<intptr_t>(chain_address);
 
-                // TODO Check if next instruction is J or AUIPC + JR, move those
-                // inplace of the NOP
-            }
-        } else {
-            // NOP before? Use the NOP
-            chain_machine_code_writer writer =
-                *(instr_p - 1) == 0b10011
-                    ? chain_machine_code_writer{instr_p - 1, 16}
-                    : chain_machine_code_writer{instr_p, 16};
-
-            Assembler ass{&writer, false, RV_GC};
-            intptr_t offset = ass.offset_from_target(
-                reinterpret_cast<intptr_t>(chain_target));
-
-            if (!IsJTypeImm(offset)) {
-                throw std::runtime_error("Chaining failed. Jump offset too big "
-                                         "for single direct jump instruction.");
-            }
-            ass.j(offset);
-        }
-    } else {
-        Instruction following_instr{following_instr_enc};
-        if (following_instr.opcode() == BRANCH) {
-            chain_machine_code_writer writer =
-                chain_machine_code_writer{instr_p, 16};
-
-            Assembler ass{&writer, false, RV_GC};
-
-            intptr_t offset = ass.offset_from_target(
-                reinterpret_cast<intptr_t>(chain_target));
-
-            if (!IsBTypeImm(offset)) {
-                Label end{};
-                switch (following_instr.funct3()) {
-                case BEQ:
-                    ass.bne(following_instr.rs1(), following_instr.rs2(), &end);
-                    break;
-                case BNE:
-                    ass.beq(following_instr.rs1(), following_instr.rs2(), &end);
-                    break;
-                case BLT:
-                    ass.bge(following_instr.rs1(), following_instr.rs2(), &end);
-                    break;
-                case BGE:
-                    ass.blt(following_instr.rs1(), following_instr.rs2(), &end);
-                    break;
-                case BLTU:
-                    ass.bgeu(following_instr.rs1(), following_instr.rs2(),
-                             &end);
-                    break;
-                case BGEU:
-                    ass.bltu(following_instr.rs1(), following_instr.rs2(),
-                             &end);
-                    break;
-                default:
-                    throw std::runtime_error("Should not happen");
-                }
+    if (!IsJTypeImm(offset)) {
+        // The jump over the stub may be compressed
+        auto *skip = reinterpret_cast<uint16_t *>(site + 1);
+        auto *stub = reinterpret_cast<char *>(IsCInstruction(*skip) ? skip + 1
+                                                                    : skip + 2);
 
-                offset = ass.offset_from_target(
-                    reinterpret_cast<intptr_t>(chain_target));
-                ass.j(offset);
-                ass.Align(Assembler::label_align);
-                ass.Bind(&end);
-            } else {
-                switch (following_instr.funct3()) {
-                case BEQ:
-                    ass.beq(following_instr.rs1(), following_instr.rs2(),
-                            offset);
-                    break;
-                case BNE:
-                    ass.bne(following_instr.rs1(), following_instr.rs2(),
-                            offset);
-                    break;
-                case BLT:
-                    ass.blt(following_instr.rs1(), following_instr.rs2(),
-                            offset);
-                    break;
-                case BGE:
-                    ass.bge(following_instr.rs1(), following_instr.rs2(),
-                            offset);
-                    break;
-                case BLTU:
-                    ass.bltu(following_instr.rs1(), following_instr.rs2(),
-                             offset);
-                    break;
-                case BGEU:
-                    ass.bgeu(following_instr.rs1(), following_instr.rs2(),
-                             offset);
-                    break;
-
-                default:
-                    throw std::runtime_error("Should not happen");
-                }
+        intptr_t stub_offset = reinterpret_cast<intptr_t>(chain_target) -
+                               reinterpret_cast<intptr_t>(stub);
+        auto offLo32 = (int32_t)stub_offset;
+        auto offLo12 = offLo32 << (32 - 12) >>
+                       (32 - 12); // sign extend lower 12 bit
+        intptr_t off32Hi20 = stub_offset - offLo12;
+        if (!IsUTypeImm(off32Hi20)) {
+            throw std::runtime_error("Chaining failed. Jump offset too big "
+                                     "for AUIPC + JR.");
+        }
 
-                ass.nop(true); // AUIPC and BXX both full size, so both
-                               // replacements full size
+        const uint32_t code[] = {
+            EncodeUTypeImm(off32Hi20) | EncodeRd(A1) | EncodeOpcode(AUIPC),
+            EncodeITypeImm(offLo12) | EncodeRs1(A1) | EncodeFunct3(F3_0) |
+                EncodeRd(ZERO) | EncodeOpcode(JALR),
+        };
+        // The stub may only be 2-byte aligned
+        std::memcpy(writer().writable(stub), code, sizeof(code));
+        synchronise_code(stub, stub + sizeof(code), true);
 
-                // TODO Check if next instruction is J or AUIPC + JR, move those
-                // inplace of the NOP
-            }
-        } else {
-            // NOP before? Use the NOP
-            chain_machine_code_writer writer =
-                *(instr_p - 1) == 0b10011
-                    ? chain_machine_code_writer{instr_p - 1, 16}
-                    : chain_machine_code_writer{instr_p, 16};
-
-            Assembler ass{&writer, false, RV_GC};
-            intptr_t offset = ass.offset_from_target(
-                reinterpret_cast<intptr_t>(chain_target));
-
-            if (!IsJTypeImm(offset)) {
-                auto offLo32 = (int32_t)offset;
-                auto offLo12 = offLo32 << (32 - 12) >>
-                               (32 - 12); // sign extend lower 12 bit
-                int32_t off32Hi20 = (offLo32 - offLo12);
-                ass.auipc(A1, off32Hi20);
-                ass.jr(A1, offLo12);
-            } else {
-                ass.j(offset);
-            }
-        }
+        offset = stub - reinterpret_cast<char *>(site);
     }
+
+    patch_instruction(writer(), site,
+                      EncodeJTypeImm(offset) | EncodeRd(ZERO) |
+                          EncodeOpcode(JAL));
 }
@@ -10,9 +10,26 @@ extern "C" {
 using namespace arancini::output::dynamic::x86;
 using namespace arancini::ir;
 
+static x86_operand virtreg_operand(unsigned int index, int width) {
+    return x86_operand(x86_virtual_register_operand(index),
+                       width == 1 ? 8 : width);
+}
+
+static x86_operand imm_operand(unsigned long value, int width) {
+    return x86_operand(x86_immediate_operand(value), width == 1 ? 8 : width);
+}
+
 void x86_translation_context::begin_block() {
     std::cerr << "INPUT ASSEMBLY:" << std::endl;
     // builder_.int3();
+
+    if (block_counter()) {
+        int counter_vreg = alloc_vreg();
+        builder_.mov(virtreg_operand(counter_vreg, 64),
+                     imm_operand((unsigned long)block_counter(), 64));
+        builder_.add(x86_operand(x86_memory_operand(counter_vreg, 0), 64),
+                     imm_operand(1, 64));
+    }
 }
 
 void x86_translation_context::begin_instruction(off_t address,
@@ -115,15 +132,6 @@ void x86_translation_context::materialise(node *n) {
     materialised_nodes_.insert(n);
 }
 
-static x86_operand virtreg_operand(unsigned int index, int width) {
-    return x86_operand(x86_virtual_register_operand(index),
-                       width == 1 ? 8 : width);
-}
-
-static x86_operand imm_operand(unsigned long value, int width) {
-    return x86_operand(x86_immediate_operand(value), width == 1 ? 8 : width);
-}
-
 static x86_operand guestreg_memory_operand(int width, int regoff) {
     return x86_operand(x86_memory_operand(x86_register_names::BP, regoff),
                        width == 1 ? 8 : width);
@@ -0,0 +1,43 @@
+#include "arancini/output/static/llvm/llvm-fence-guard.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+#include <vector>
+
+using namespace ::llvm;
+
+PreservedAnalyses FenceGuardPass::run(Function &F,
+                                      FunctionAnalysisManager &AM) {
+    std::vector<FenceInst *> fences;
+    for (BasicBlock &BB : F) {
+        for (Instruction &I : BB) {
+            if (auto *fence = dyn_cast<FenceInst>(&I))
+                fences.push_back(fence);
+        }
+    }
+
+    if (fences.empty())
+        return PreservedAnalyses::all();
+
+    auto *i8 = Type::getInt8Ty(F.getContext());
+    auto *flag = F.getParent()->getOrInsertGlobal(guest_multithreaded_flag, i8);
+
+    for (auto *fence : fences) {
+        IRBuilder<> builder(fence);
+
+        // The flag only ever changes from 0 to 1, while the guest has a single
+        // thread, so a relaxed load is sufficient
+        auto *threaded = builder.CreateLoad(i8, flag, "multithreaded");
+        threaded->setAtomic(AtomicOrdering::Monotonic);
+        threaded->setAlignment(Align(1));
+
+        auto *guarded = SplitBlockAndInsertIfThen(
+            builder.CreateICmpNE(threaded, ConstantInt::get(i8, 0)), fence,
+            false);
+        fence->moveBefore(guarded);
+    }
+
+    return PreservedAnalyses::none();
+}
@@ -6,10 +6,13 @@
 #include <arancini/output/static/llvm/llvm-static-output-engine-impl.h>
 #include <arancini/output/static/llvm/llvm-static-output-engine.h>
 #include <arancini/output/static/llvm/llvm-static-visitor.h>
+#include <algorithm>
 #include <iterator>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/MDBuilder.h>
 #include <map>
+#include <optional>
 #include <ostream>
 #include <unordered_map>
 #include <unordered_set>
@@ -269,6 +272,69 @@ void llvm_arg_visitor::resolve_waiting() {
     }
 }
 
+void llvm_reg_usage_visitor::visit_chunk(chunk &c) {
+    current_chunk_ = c.packets()[0]->address();
+    read_[current_chunk_].insert(boundary_regs.begin(), boundary_regs.end());
+    written_[current_chunk_].insert(boundary_regs.begin(),
+                                    boundary_regs.end());
+    vector_widths_[current_chunk_];
+
+    default_visitor::visit_chunk(c);
+}
+
+void llvm_reg_usage_visitor::record_vector_width(reg_offsets reg,
+                                                 unsigned width) {
+    if (reg < reg_offsets::ZMM0 || reg > reg_offsets::ZMM31)
+        return;
+
+    unsigned rounded = 128;
+    while (rounded < width)
+        rounded *= 2;
+
+    auto &current = vector_widths_[current_chunk_][reg];
+    current = std::max(current, rounded);
+}
+
+void llvm_reg_usage_visitor::visit_read_reg_node(read_reg_node &n) {
+    read_[current_chunk_].insert((reg_offsets)n.regoff());
+    record_vector_width((reg_offsets)n.regoff(), n.val().type().width());
+}
+
+void llvm_reg_usage_visitor::visit_write_reg_node(write_reg_node &n) {
+    written_[current_chunk_].insert((reg_offsets)n.regoff());
+    record_vector_width((reg_offsets)n.regoff(), n.value().type().width());
+    default_visitor::visit_write_reg_node(n);
+}
+
+void llvm_reg_usage_visitor::visit_write_pc_node(write_pc_node &n) {
+    written_[current_chunk_].insert(reg_offsets::PC);
+    default_visitor::visit_write_pc_node(n);
+}
+
+void llvm_reg_usage_visitor::visit_binary_atomic_node(binary_atomic_node &n) {
+    // xadd and xchg write the old memory value back to the source register
+    if ((n.op() == binary_atomic_op::xadd ||
+         n.op() == binary_atomic_op::xchg) &&
+        n.rhs().owner()->kind() == node_kinds::read_reg) {
+        auto reg = ((read_reg_node *)n.rhs().owner())->regoff();
+        written_[current_chunk_].insert((reg_offsets)reg);
+    }
+    default_visitor::visit_binary_atomic_node(n);
+}
+
+void llvm_reg_usage_visitor::visit_ternary_atomic_node(ternary_atomic_node &n) {
+    // cmpxchg implicitly uses RAX and sets ZF
+    read_[current_chunk_].insert({reg_offsets::RAX, reg_offsets::ZF});
+    written_[current_chunk_].insert({reg_offsets::RAX, reg_offsets::ZF});
+    default_visitor::visit_ternary_atomic_node(n);
+}
+
+std::set<reg_offsets> llvm_reg_usage_visitor::touched(unsigned long fn) const {
+    auto regs = read_.at(fn);
+    regs.insert(written_.at(fn).begin(), written_.at(fn).end());
+    return regs;
+}
+
 Instruction *llvm_static_output_engine_impl::create_static_br(
     IRBuilder<> *builder, std::shared_ptr<packet> pkt,
     std::map<unsigned long, BasicBlock *> *blocks, BasicBlock *mid) {
@@ -311,6 +377,28 @@ Instruction *llvm_static_output_engine_impl::create_static_br(
 
     if (follow_block != mid)
         fixed_branches++;
+
+    // Indirect branch, dispatch directly to the targets recovered from a jump
+    // table (if any) rather than all blocks of the function
+    auto targets = e_.branch_targets().find(pkt->address());
+    if (follow_block == mid && targets != e_.branch_targets().end()) {
+        Value *pc = it->getOperand(0);
+        if (!e_.is_exec()) {
+            Value *gvar = module_->getOrInsertGlobal("guest_base", types.i8);
+            pc = builder->CreateSub(pc,
+                                    builder->CreatePtrToInt(gvar, types.i64));
+        }
+
+        auto sw = builder->CreateSwitch(pc, mid, targets->second.size());
+        for (auto target : targets->second) {
+            bb_it = blocks->find(target);
+            if (bb_it != blocks->end()) {
+                sw->addCase(ConstantInt::get(types.i64, target), bb_it->second);
+            }
+        }
+        return sw;
+    }
+
     return builder->CreateBr(follow_block);
 };
 
@@ -330,11 +418,14 @@ Instruction *llvm_static_output_engine_impl::create_static_condbr(
 
     BasicBlock *true_block = mid;
     BasicBlock *false_block = mid;
+    // Guest addresses of the successors, if constant
+    std::optional<unsigned long> true_pc, false_pc;
     std::map<unsigned long, BasicBlock *>::iterator bb_it;
 
     // Add can constant fold on creation
     if (true_addr) {
-        bb_it = blocks->find(true_addr->getZExtValue());
+        true_pc = true_addr->getZExtValue();
+        bb_it = blocks->find(*true_pc);
         true_block = bb_it != blocks->end() ? bb_it->second : mid;
     } else {
         auto true_addr1 = dyn_cast<ConstantExpr>(it->getOperand(1));
@@ -352,13 +443,15 @@ Instruction *llvm_static_output_engine_impl::create_static_condbr(
             offs = dyn_cast<ConstantInt>(true_addr1->getOperand(1));
         }
         if (offs && pc_val) {
-            bb_it = blocks->find(offs->getZExtValue() + pc_val->getZExtValue());
+            true_pc = offs->getZExtValue() + pc_val->getZExtValue();
+            bb_it = blocks->find(*true_pc);
             true_block = bb_it != blocks->end() ? bb_it->second : mid;
         }
     }
 
     if (false_addr) {
-        bb_it = blocks->find(false_addr->getZExtValue());
+        false_pc = false_addr->getZExtValue();
+        bb_it = blocks->find(*false_pc);
         false_block = bb_it != blocks->end() ? bb_it->second : mid;
     } else {
         auto false_addr1 = dyn_cast<ConstantExpr>(it->getOperand(2));
@@ -376,11 +469,33 @@ Instruction *llvm_static_output_engine_impl::create_static_condbr(
             offs = dyn_cast<ConstantInt>(false_addr1->getOperand(1));
         }
         if (offs && pc_val) {
-            bb_it = blocks->find(offs->getZExtValue() + pc_val->getZExtValue());
+            false_pc = offs->getZExtValue() + pc_val->getZExtValue();
+            bb_it = blocks->find(*false_pc);
             false_block = bb_it != blocks->end() ? bb_it->second : mid;
         }
     }
     if (true_block != mid && false_block != mid)
         fixed_branches++;
-    return builder->CreateCondBr(cond, true_block, false_block);
+    auto br = builder->CreateCondBr(cond, true_block, false_block);
+
+    // Weigh the successors by how often the runtime profile saw them execute
+    if (true_pc && false_pc) {
+        const auto &counts = e_.block_counts();
+        auto true_count = counts.find(*true_pc);
+        auto false_count = counts.find(*false_pc);
+        if (true_count != counts.end() || false_count != counts.end()) {
+            uint64_t t = true_count != counts.end() ? true_count->second : 0;
+            uint64_t f = false_count != counts.end() ? false_count->second : 0;
+
+            // Weights are 32-bit, a successor that was never seen keeps a
+            // small non-zero weight
+            auto scale = std::max<uint64_t>(1, std::max(t, f) >> 31);
+            MDBuilder mdb(*llvm_context_);
+            br->setMetadata(LLVMContext::MD_prof,
+                            mdb.createBranchWeights(t / scale + 1,
+                                                    f / scale + 1));
+        }
+    }
+
+    return br;
 };
@@ -3,9 +3,12 @@
 #include "arancini/ir/port.h"
 #include "arancini/ir/visitor.h"
 #include "arancini/output/static/llvm/llvm-fence-combine.h"
+#include "arancini/output/static/llvm/llvm-fence-guard.h"
 #include "arancini/output/static/llvm/llvm-static-visitor.h"
 #include "arancini/runtime/exec/x86/x86-cpu-state.h"
 #include "arancini/util/logger.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/Config/llvm-config.h"
 #include "llvm/IR/GlobalAlias.h"
 #include "llvm/Support/raw_ostream.h"
@@ -15,10 +18,13 @@
 #include <arancini/ir/chunk.h>
 #include <arancini/output/static/llvm/llvm-static-output-engine-impl.h>
 #include <arancini/output/static/llvm/llvm-static-output-engine.h>
+#include <algorithm>
+#include <array>
 #include <cstdint>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <llvm/ADT/ArrayRef.h>
 #include <llvm/ADT/FloatingPointMode.h>
 #include <llvm/ADT/StringExtras.h>
@@ -34,13 +40,23 @@
 #include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/PassManager.h>
 #include <llvm/Support/CodeGen.h>
+#include <llvm/Support/SHA1.h>
 #include <llvm/Support/TimeProfiler.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 #include <llvm/Transforms/Utils/Mem2Reg.h>
+#include <llvm/Transforms/Utils/SplitModule.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
+#include <exception>
+#include <filesystem>
+#include <functional>
 #include <map>
 #include <memory>
 #include <ostream>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
 #if LLVM_VERSION_MAJOR < 16
@@ -57,6 +73,40 @@ using namespace ::llvm;
 using arancini::input::x86::off_to_idx;
 using arancini::input::x86::regnames;
 
+// SysV passes floating-point and vector arguments in XMM0-7 and returns them in
+// XMM0 and XMM1. They are passed as <2 x i64>, which x86-64 and AArch64 hosts
+// keep in their SIMD registers, both as arguments and as results next to RAX
+// and RDX.  Without the vector extension, RISC-V would split them into integer
+// registers and the stack, so there they stay in the CPU state.
+#if defined(ARCH_RISCV64)
+static constexpr std::array<reg_offsets, 0> vector_arg_regs{};
+static constexpr std::array<reg_offsets, 0> vector_ret_regs{};
+#else
+static constexpr std::array vector_arg_regs = {
+    reg_offsets::ZMM0, reg_offsets::ZMM1, reg_offsets::ZMM2, reg_offsets::ZMM3,
+    reg_offsets::ZMM4, reg_offsets::ZMM5, reg_offsets::ZMM6, reg_offsets::ZMM7};
+static constexpr std::array vector_ret_regs = {reg_offsets::ZMM0,
+                                               reg_offsets::ZMM1};
+#endif
+
+// Guest accesses that can be lowered to a single acquire load or release
+// store. Wider accesses (e.g. 128-bit or x87) would become LL/SC loops or
+// library calls, so they keep using fences.
+static bool is_atomic_access_type(const Type *ty) {
+    if (!ty->isIntegerTy() && !ty->isFloatingPointTy())
+        return false;
+
+    switch (ty->getPrimitiveSizeInBits()) {
+    case 8:
+    case 16:
+    case 32:
+    case 64:
+        return true;
+    default:
+        return false;
+    }
+}
+
 llvm_static_output_engine::llvm_static_output_engine(
     const std::string &output_filename, const bool is_exec)
     : static_output_engine(output_filename),
@@ -68,6 +118,11 @@ llvm_static_output_engine::~llvm_static_output_engine() = default;
 
 void llvm_static_output_engine::generate() { oei_->generate(); }
 
+const std::vector<std::string> &
+llvm_static_output_engine::additional_objects() const {
+    return oei_->additional_objects();
+}
+
 llvm_static_output_engine_impl::llvm_static_output_engine_impl(
     const llvm_static_output_engine &e,
     const std::vector<std::pair<unsigned long, std::string>> &extern_fns,
@@ -85,8 +140,291 @@ void llvm_static_output_engine_impl::generate() {
     InitializeAllAsmPrinters();
 
     build();
-    optimise();
-    compile();
+
+    std::cout << "Fixed branches: " << fixed_branches << std::endl;
+
+    if (e_.cache_dir_.has_value()) {
+        cache_functions();
+    }
+
+    if (!e_.partition_outputs_.empty()) {
+        generate_partitioned();
+        return;
+    }
+
+    optimise(*module_, "");
+    compile(*module_, e_.output_filename());
+}
+
+// Target the static code is compiled for
+struct target_description {
+    std::string triple;
+    const char *cpu;
+    const char *features;
+    // Empty for the default ABI
+    const char *abi;
+};
+
+static target_description static_target() {
+#ifndef CROSS_TRANSLATE
+    std::string triple = sys::getDefaultTargetTriple();
+#elif defined(ARCH_RISCV64)
+    std::string triple = "riscv64-unknown-linux-gnu";
+#elif defined(ARCH_AARCH64)
+    std::string triple = "aarch64-unknown-linux-gnu";
+#elif defined(ARCH_X86_64)
+    std::string triple = "x86_64-unknown-linux-gnu";
+#error Please check if the triple above is correct
+#endif
+
+#if defined(ARCH_RISCV64)
+    // Add multiply(M), atomics(A), single(F) and double(D) precision float and
+    // compressed(C) extensions
+    const char *features =
+        "+m,+a,+f,+d,+c,-v,+fast-unaligned-access,+xtheadba,+xtheadbb,+"
+        "xtheadbs,+xtheadcmo,+xtheadcondmov,+xtheadfmemidx,+xtheadmac,+"
+        "xtheadmemidx,+xtheadmempair,+xtheadsync";
+    // Specify abi as 64 bits using double float registers
+    return {triple, "generic-rv64", features, "lp64d"};
+#elif defined(ARCH_AARCH64)
+    return {triple, "thunderx2t99", "+fp-armv8,+v8.5a,+lse,+ls64", ""};
+#else
+    return {triple, "generic", "+avx", ""};
+#endif
+}
+
+static const OptimizationLevel &optimisation_level = OptimizationLevel::O2;
+
+/*
+ * Copies fn into a module of its own. Local variables it refers to are copied
+ * along with their initialisers, every other global is only declared. Unlike
+ * CloneModule(), this only visits what fn refers to, so splitting a module
+ * takes time linear in its size.
+ */
+static std::unique_ptr<Module> extract_function(Function &fn) {
+    auto part = std::make_unique<Module>("cached", fn.getContext());
+    part->setSourceFileName("cached");
+    part->setDataLayout(fn.getParent()->getDataLayout());
+    part->setTargetTriple(fn.getParent()->getTargetTriple());
+
+    ValueToValueMapTy vmap;
+    std::set<const Constant *> visited;
+    std::vector<std::pair<const GlobalVariable *, GlobalVariable *>> copies;
+
+    auto declare = [&](const GlobalValue &gv) -> GlobalValue * {
+        if (auto *f = dyn_cast<Function>(&gv)) {
+            auto *decl = Function::Create(
+                f->getFunctionType(),
+                f == &fn ? f->getLinkage() : GlobalValue::ExternalLinkage,
+                f->getAddressSpace(), f->getName(), part.get());
+            decl->copyAttributesFrom(f);
+            return decl;
+        }
+
+        auto *var = dyn_cast<GlobalVariable>(&gv);
+        bool copy = var && var->hasLocalLinkage() && var->hasInitializer();
+        auto *decl = new GlobalVariable(
+            *part, gv.getValueType(), var && var->isConstant(),
+            copy ? var->getLinkage() : GlobalValue::ExternalLinkage, nullptr,
+            gv.getName(), nullptr, gv.getThreadLocalMode(),
+            gv.getAddressSpace());
+        if (var) {
+            decl->copyAttributesFrom(var);
+        }
+        if (copy) {
+            copies.emplace_back(var, decl);
+        }
+        return decl;
+    };
+
+    std::function<void(const Value *)> visit = [&](const Value *v) {
+        auto *c = dyn_cast<Constant>(v);
+        if (!c || !visited.insert(c).second) {
+            return;
+        }
+
+        if (auto *gv = dyn_cast<GlobalValue>(c)) {
+            vmap[gv] = declare(*gv);
+            if (auto *var = dyn_cast<GlobalVariable>(gv);
+                var && var->hasLocalLinkage() && var->hasInitializer()) {
+                visit(var->getInitializer());
+            }
+            return;
+        }
+
+        for (const auto &op : c->operands()) {
+            visit(op.get());
+        }
+    };
+
+    visit(&fn);
+    if (fn.hasPersonalityFn()) {
+        visit(fn.getPersonalityFn());
+    }
+    for (const auto &bb : fn) {
+        for (const auto &inst : bb) {
+            for (const auto &op : inst.operands()) {
+                visit(op.get());
+            }
+        }
+    }
+
+    for (const auto &[var, copy] : copies) {
+        copy->setInitializer(
+            cast<Constant>(MapValue(var->getInitializer(), vmap)));
+    }
+
+    auto *copy = cast<Function>(vmap[&fn]);
+    auto arg = copy->arg_begin();
+    for (const auto &a : fn.args()) {
+        arg->setName(a.getName());
+        vmap[&a] = &*arg++;
+    }
+
+    SmallVector<ReturnInst *, 8> returns;
+    CloneFunctionInto(copy, &fn, vmap,
+                      CloneFunctionChangeType::DifferentModule, returns);
+    return part;
+}
+
+/*
+ * Moves every guest function into its own module, keyed by a hash of that
+ * module's bitcode.  The bitcode covers everything that influences the
+ * generated code of the function: the lifted instructions, the guest
+ * addresses and the callees resolved when lowering.  Functions whose key is
+ * already in the cache are reused, the rest are optimised, compiled and
+ * stored.  Either way, only a declaration remains in the main module.
+ */
+void llvm_static_output_engine_impl::cache_functions() {
+    const auto &cache_dir = e_.cache_dir_.value();
+    std::filesystem::create_directories(cache_dir);
+
+    // Aliases need their aliasee to be defined in the same module, apart from
+    // the address aliases, which are moved along with their function
+    std::set<const GlobalObject *> aliased;
+    for (const auto &alias : module_->aliases()) {
+        auto *aliasee = alias.getAliaseeObject();
+        auto it = address_aliases_.find(dyn_cast<Function>(aliasee));
+        if (it == address_aliases_.end() || it->second != &alias) {
+            aliased.insert(aliasee);
+        }
+    }
+
+    // Everything besides the bitcode that determines the generated code: the
+    // translator itself (see src/output/static/llvm/CMakeLists.txt), LLVM,
+    // the optimisation pipeline and the target
+    auto target = static_target();
+    auto key_prefix = fmt::format(
+        "{}-{}-llvm-{}-O{}s{}-{}-{}-{}-{}", ARANCINI_TRANSLATOR_ID,
+        DBT_ARCH_STR, LLVM_VERSION_STRING,
+        optimisation_level.getSpeedupLevel(), optimisation_level.getSizeLevel(),
+        target.triple, target.cpu, target.features, target.abi);
+
+    unsigned long hits = 0, misses = 0;
+    for (const auto &[addr, fn] : *fns_) {
+        if (fn->isDeclaration() || aliased.count(fn)) {
+            continue;
+        }
+
+        auto part = extract_function(*fn);
+
+        // The address alias moves along, as the body is removed from here
+        if (auto alias = address_aliases_.find(fn);
+            alias != address_aliases_.end()) {
+            GlobalAlias::create(alias->second->getName(),
+                                part->getFunction(fn->getName()));
+            alias->second->eraseFromParent();
+            address_aliases_.erase(alias);
+        }
+
+        SmallVector<char, 0> bitcode;
+        raw_svector_ostream os(bitcode);
+        WriteBitcodeToFile(*part, os);
+
+        SHA1 hasher;
+        hasher.update(key_prefix);
+        // Fence guards are only inserted by the optimisation pipeline
+        hasher.update(e_.lazy_fences_ ? "lazy-fences" : "");
+        hasher.update(StringRef(bitcode.data(), bitcode.size()));
+        auto key = toHex(hasher.final(), true);
+
+        auto object =
+            (std::filesystem::path(cache_dir) / (key + ".o")).string();
+        if (std::filesystem::exists(object)) {
+            hits++;
+        } else {
+            misses++;
+
+            // Write to a temporary name first, so that a concurrent or
+            // interrupted translation never sees a partial object
+            auto tmp = object + ".tmp." + std::to_string(getpid());
+            optimise(*part, "." + key);
+            compile(*part, tmp);
+            std::filesystem::rename(tmp, object);
+        }
+
+        fn->deleteBody();
+        additional_objects_.push_back(object);
+    }
+
+    ::util::global_logger.info("Function cache: {} hits, {} misses\n", hits,
+                             misses);
+}
+
+/*
+ * Splits the module into partitions and optimises and compiles each of them on
+ * its own thread.  LLVM contexts are not thread-safe, so each partition is
+ * round-tripped through bitcode into a fresh context that is owned by the
+ * worker thread.
+ */
+void llvm_static_output_engine_impl::generate_partitioned() {
+    std::vector<std::string> outputs{e_.output_filename()};
+    outputs.insert(outputs.end(), e_.partition_outputs_.begin(),
+                   e_.partition_outputs_.end());
+
+    std::vector<SmallVector<char, 0>> partitions;
+    SplitModule(*module_, outputs.size(), [&](std::unique_ptr<Module> part) {
+        auto &buffer = partitions.emplace_back();
+        raw_svector_ostream os(buffer);
+        WriteBitcodeToFile(*part, os);
+    });
+
+    // The partitions hold everything from now on
+    module_.reset();
+
+    std::vector<std::exception_ptr> errors(partitions.size());
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < partitions.size(); i++) {
+        workers.emplace_back([&, i] {
+            try {
+                LLVMContext ctx;
+                MemoryBufferRef buffer(
+                    StringRef(partitions[i].data(), partitions[i].size()),
+                    "partition-" + std::to_string(i));
+
+                auto part = parseBitcodeFile(buffer, ctx);
+                if (!part) {
+                    throw std::runtime_error("unable to load partition: " +
+                                             toString(part.takeError()));
+                }
+
+                optimise(**part, "." + std::to_string(i));
+                compile(**part, outputs[i]);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    for (const auto &error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
 }
 
 void llvm_static_output_engine_impl::initialise_types() {
@@ -102,6 +440,7 @@ void llvm_static_output_engine_impl::initialise_types() {
     types.f80 = Type::getX86_FP80Ty(*llvm_context_);
     types.f128 = Type::getFP128Ty(*llvm_context_);
     types.i128 = Type::getInt128Ty(*llvm_context_);
+    types.xmm = FixedVectorType::get(types.i64, 2);
     types.i80 = IntegerType::get(*llvm_context_, 80);
     types.i256 = IntegerType::get(*llvm_context_, 256);
     types.i512 = IntegerType::get(*llvm_context_, 512);
@@ -162,9 +501,6 @@ void llvm_static_output_engine_impl::initialise_types() {
          PointerType::get(PointerType::get(Type::getInt8Ty(*llvm_context_), 0),
                           0)},
         false);
-    types.register_static_fn =
-        FunctionType::get(Type::getVoidTy(*llvm_context_),
-                          {types.i64, types.i8->getPointerTo()}, false);
     types.lookup_static_fn =
         FunctionType::get(types.i8->getPointerTo(), {types.i64}, false);
     types.poison_fn = FunctionType::get(Type::getVoidTy(*llvm_context_),
@@ -196,14 +532,6 @@ void llvm_static_output_engine_impl::create_main_function(Function *loop_fn) {
     builder.CreateCondBr(is_not_null, run_block, fail_block);
 
     builder.SetInsertPoint(run_block);
-
-    auto registerFn = module_->getOrInsertFunction("register_static_fn_addr",
-                                                   types.register_static_fn);
-    for (auto it = fns_->begin(); it != fns_->end(); ++it) {
-        builder.CreateCall(registerFn,
-                           {builder.getInt64(it->first), it->second});
-    }
-
     builder.CreateCall(loop_fn, {init_dbt_result});
     builder.CreateRet(ConstantInt::get(types.i32, 0));
 
@@ -345,6 +673,7 @@ void llvm_static_output_engine_impl::build() {
     auto call_block = BasicBlock::Create(*llvm_context_, "call", loop_fn);
     auto ret_block = BasicBlock::Create(*llvm_context_, "return", loop_fn);
     auto exit_block = BasicBlock::Create(*llvm_context_, "exit", loop_fn);
+    auto leave_block = BasicBlock::Create(*llvm_context_, "leave", loop_fn);
 
     auto clk_ = module_->getOrInsertFunction("clk", types.clk_fn);
     IRBuilder<> builder(*llvm_context_);
@@ -361,6 +690,11 @@ void llvm_static_output_engine_impl::build() {
         types.cpu_state, state_arg,
         {ConstantInt::get(types.i64, 0), ConstantInt::get(types.i32, 0)},
         "pcptr");
+    // Number of guest calls entered since MainLoop was invoked. Calls and
+    // returns only adjust this counter instead of recursing, so the native
+    // stack does not grow with the guest call depth.
+    auto call_depth = builder.CreateAlloca(types.i64, nullptr, "call_depth");
+    builder.CreateStore(ConstantInt::get(types.i64, 0), call_depth);
     builder.CreateBr(loop_block);
 
     builder.SetInsertPoint(loop_block);
@@ -370,7 +704,8 @@ void llvm_static_output_engine_impl::build() {
     // builder.CreateCall(alert, { });
     auto program_counter_val =
         builder.CreateLoad(types.i64, program_counter, "top_pc");
-    lower_static_fn_lookup(builder, switch_to_dbt, program_counter_val);
+    lower_static_fn_lookup(builder, switch_to_dbt, ret_block,
+                           program_counter_val);
 
     lower_chunks(loop_fn);
 
@@ -389,8 +724,8 @@ void llvm_static_output_engine_impl::build() {
 #endif
     /*
      * RETURN CODES:
-     * 4: last instr was a ret  -> emit a return
-     * 3: last instr was a call -> call MainLoop to figure out the next Fn
+     * 4: last instr was a ret  -> return to the caller (or MainLoop's caller)
+     * 3: last instr was a call -> enter the callee
      * 2: do internal call
      * 1: do syscall
      * 0: all other instr		-> we did not leave the current unknown
@@ -446,10 +781,21 @@ void llvm_static_output_engine_impl::build() {
     builder.CreateRetVoid();
 
     builder.SetInsertPoint(call_block);
-    builder.CreateCall(loop_fn, {state_arg});
+    auto depth = builder.CreateLoad(types.i64, call_depth);
+    builder.CreateStore(
+        builder.CreateAdd(depth, ConstantInt::get(types.i64, 1)), call_depth);
     builder.CreateBr(loop_block);
 
+    // Reached on a dynamic return or once a static function has returned
     builder.SetInsertPoint(ret_block);
+    depth = builder.CreateLoad(types.i64, call_depth);
+    builder.CreateStore(
+        builder.CreateSub(depth, ConstantInt::get(types.i64, 1)), call_depth);
+    builder.CreateCondBr(builder.CreateCmp(CmpInst::Predicate::ICMP_EQ, depth,
+                                           ConstantInt::get(types.i64, 0)),
+                         leave_block, loop_block);
+
+    builder.SetInsertPoint(leave_block);
 #if defined(DEBUG)
     builder.CreateCall(clk_,
                        {state_arg, builder.CreateGlobalStringPtr("done-loop")});
@@ -482,8 +828,9 @@ void llvm_static_output_engine_impl::debug_dump() {
 Value *llvm_static_output_engine_impl::createLoadFromCPU(
     IRBuilder<> &builder, Argument *state_arg, unsigned long reg_idx) {
 
-    Type *ty = types.i512;
-    if (reg_idx < 27)
+    // Vector registers are only loaded as XMM values (i.e. arguments)
+    Type *ty = types.xmm;
+    if (reg_idx < off_to_idx.at((unsigned long)reg_offsets::ZMM0))
         ty = types.i64;
 
     return builder.CreateLoad(
@@ -512,34 +859,151 @@ void llvm_static_output_engine_impl::lower_chunks(Function *main_loop) {
 
     auto ret = llvm_ret_visitor();
     auto arg = llvm_arg_visitor();
+    auto usage = llvm_reg_usage_visitor();
 
     for (const auto &c : chunks_) {
         c->accept(ret);
         c->accept(arg);
+        c->accept(usage);
     }
 
+    // Only XMM registers that a function itself uses as 128-bit values are
+    // passed natively, wider state always goes through the CPU state.
+    // Functions that are replaced by wrappers keep taking everything from the
+    // CPU state.
     for (const auto &c : chunks_) {
+        auto addr = c->packets()[0]->address();
+        if (addr == 0 ||
+            wrapper_fns_->find(c->name() + "_wrapper") != wrapper_fns_->end())
+            continue;
+
+        auto fn = fns_->at(addr);
+        const auto &widths = usage.vector_widths(addr);
+        auto is_xmm = [&widths](reg_offsets reg) {
+            auto it = widths.find(reg);
+            return it != widths.end() && it->second == 128;
+        };
+
+        auto args = arg.get_type(addr);
+        auto &vargs = vector_args_[fn];
+        for (auto reg : vector_arg_regs) {
+            if (args.count(reg) && is_xmm(reg))
+                vargs.insert(reg);
+        }
+
+        auto rets = ret.get_type(addr);
+        auto &vrets = vector_rets_[fn];
+        for (auto reg : vector_ret_regs) {
+            if (rets.count(reg) && is_xmm(reg))
+                vrets.insert(reg);
+        }
+    }
+
+    for (const auto &c : chunks_) {
+        auto addr = c->packets()[0]->address();
+        touched_regs_ = usage.touched(addr);
+        written_regs_ = usage.written(addr);
+        vector_widths_ = usage.vector_widths(addr);
+
+        // Arguments are initialised from the parameters, not the CPU state
+        if (addr != 0) {
+            auto it = vector_args_.find(fns_->at(addr));
+            if (it != vector_args_.end()) {
+                touched_regs_.insert(it->second.begin(), it->second.end());
+                written_regs_.insert(it->second.begin(), it->second.end());
+            }
+        }
+
         lower_chunk(&builder, main_loop, c);
     }
+
+    apply_profile();
+}
+
+/*
+ * Functions containing blocks that the runtime profile saw executing are
+ * marked hot and moved to the front of the module, most frequently executed
+ * first, so that they are laid out together in .text.hot.  The profile only
+ * covers code that ran in the dynamic translator, so it says nothing about
+ * the remaining functions, which are left alone rather than marked cold.
+ */
+void llvm_static_output_engine_impl::apply_profile() {
+    const auto &counts = e_.block_counts();
+    if (counts.empty())
+        return;
+
+    std::map<Function *, uint64_t> fn_counts;
+    for (const auto &c : chunks_) {
+        auto addr = c->packets()[0]->address();
+        if (addr == 0)
+            continue;
+
+        uint64_t count = 0;
+        for (const auto &p : c->packets()) {
+            auto it = counts.find(p->address());
+            if (it != counts.end())
+                count = std::max(count, it->second);
+        }
+
+        auto fn = fns_->at(addr);
+        if (count && !fn->isDeclaration())
+            fn_counts[fn] = std::max(fn_counts[fn], count);
+    }
+
+    std::vector<std::pair<uint64_t, Function *>> hot;
+    for (const auto &[fn, count] : fn_counts)
+        hot.emplace_back(count, fn);
+    std::sort(hot.begin(), hot.end(), [](const auto &a, const auto &b) {
+        return a.first < b.first;
+    });
+
+    // Pushing to the front in increasing order leaves the hottest first
+    for (const auto &[count, fn] : hot) {
+        fn->addFnAttr(Attribute::Hot);
+        fn->setSectionPrefix("hot");
+        fn->removeFromParent();
+        module_->getFunctionList().push_front(fn);
+    }
+
+    ::util::global_logger.info("Profile: {} hot functions\n", hot.size());
 }
 
 void llvm_static_output_engine_impl::lower_static_fn_lookup(
-    IRBuilder<> &builder, BasicBlock *contblock, Value *guestAddr) {
+    IRBuilder<> &builder, BasicBlock *contblock, BasicBlock *retblock,
+    Value *guestAddr) {
     auto LookupFn = module_->getOrInsertFunction("lookup_static_fn_addr",
                                                  types.lookup_static_fn);
 
-    auto clk_ = module_->getOrInsertFunction("clk", types.clk_fn);
+    auto fn = contblock->getParent();
+    auto b = BasicBlock::Create(*llvm_context_, "call_static_fn", fn);
+    auto lookup_block =
+        BasicBlock::Create(*llvm_context_, "lookup_static_fn", fn);
+
+    auto fn_ptr_ty = PointerType::get(types.i8, 0);
+    auto target = PHINode::Create(fn_ptr_ty, fns_->size() + 1, "static_fn", b);
+
+    // Functions of this binary are known at build time, so resolve them with
+    // a switch (which LLVM turns into a lookup table) rather than asking the
+    // runtime.  Everything else, i.e. functions of translated libraries, goes
+    // through the runtime lookup.
+    auto fnswitch = builder.CreateSwitch(guestAddr, lookup_block, fns_->size());
+    for (const auto &[addr, static_fn] : *fns_) {
+        auto case_block = BasicBlock::Create(*llvm_context_, "", fn);
+        fnswitch->addCase(ConstantInt::get(types.i64, addr), case_block);
+
+        builder.SetInsertPoint(case_block);
+        builder.CreateBr(b);
+        target->addIncoming(static_fn, case_block);
+    }
 
+    builder.SetInsertPoint(lookup_block);
     auto result = builder.CreateCall(LookupFn, {guestAddr});
-    auto cmp = builder.CreateCmp(
-        CmpInst::Predicate::ICMP_NE, result,
-        ConstantPointerNull::get(PointerType::get(types.i8, 0)));
-
-    auto b = BasicBlock::Create(*llvm_context_, "call_static_fn",
-                                contblock->getParent());
-
+    auto cmp = builder.CreateCmp(CmpInst::Predicate::ICMP_NE, result,
+                                 ConstantPointerNull::get(fn_ptr_ty));
     builder.CreateCondBr(cmp, b, contblock);
-    auto cpu_state = contblock->getParent()->getArg(0);
+    target->addIncoming(result, lookup_block);
+
+    auto cpu_state = fn->getArg(0);
 
     builder.SetInsertPoint(b);
     auto rdi = createLoadFromCPU(builder, cpu_state, 8);
@@ -548,28 +1012,17 @@ void llvm_static_output_engine_impl::lower_static_fn_lookup(
     auto rcx = createLoadFromCPU(builder, cpu_state, 2);
     auto r8 = createLoadFromCPU(builder, cpu_state, 9);
     auto r9 = createLoadFromCPU(builder, cpu_state, 10);
-    //	auto zmm0 = createLoadFromCPU(builder, cpu_state, 27);
-    //	auto zmm1 = createLoadFromCPU(builder, cpu_state, 28);
-    //	auto zmm2 = createLoadFromCPU(builder, cpu_state, 29);
-    //	auto zmm3 = createLoadFromCPU(builder, cpu_state, 30);
-    //	auto zmm4 = createLoadFromCPU(builder, cpu_state, 31);
-    //	auto zmm5 = createLoadFromCPU(builder, cpu_state, 32);
-    //	auto zmm6 = createLoadFromCPU(builder, cpu_state, 33);
-    //	auto zmm7 = createLoadFromCPU(builder, cpu_state, 34);
-    auto f = builder.CreateBitCast(result, get_fn_type()->getPointerTo());
-    auto call = builder.CreateCall(
-        get_fn_type(), f,
-        {cpu_state, rdi, rsi, rdx, rcx, r8,
-         r9 /*, zmm0, zmm1, zmm2, zmm3, zmm4, zmm5, zmm6, zmm7*/});
+    std::vector<Value *> args = {cpu_state, rdi, rsi, rdx, rcx, r8, r9};
+    for (auto reg : vector_arg_regs) {
+        args.push_back(createLoadFromCPU(
+            builder, cpu_state, off_to_idx.at((unsigned long)reg)));
+    }
+    auto f = builder.CreateBitCast(target, get_fn_type()->getPointerTo());
+    auto call = builder.CreateCall(get_fn_type(), f, args);
     createStoreToCPU(builder, cpu_state, 0, call, 1);
     createStoreToCPU(builder, cpu_state, 1, call, 3);
-//	createStoreToCPU(builder, cpu_state, 2, call, 27);
-//	createStoreToCPU(builder, cpu_state, 3, call, 28);
-#if defined(DEBUG)
-    builder.CreateCall(clk_,
-                       {cpu_state, builder.CreateGlobalStringPtr("done-loop")});
-#endif
-    builder.CreateRetVoid();
+    // Vector results have already been saved to the CPU state by the callee
+    builder.CreateBr(retblock);
 }
 
 Value *llvm_static_output_engine_impl::materialise_port(
@@ -651,7 +1104,7 @@ Value *llvm_static_output_engine_impl::materialise_port(
         // auto gs_reg = builder.CreateGEP(types.cpu_state, state_arg, {
         // ConstantInt::get(types.i64, 0), ConstantInt::get(types.i32, 26) });
         // //TODO: move offset_2_idx into a common header
-        auto gs_reg = reg_to_alloca_.at(reg_offsets::GS);
+        // auto gs_reg = get_reg_alloca(reg_offsets::GS);
         // address = builder.CreateAdd(address, builder.CreateLoad(types.i64,
         // gs_reg));
 #endif
@@ -659,9 +1112,14 @@ Value *llvm_static_output_engine_impl::materialise_port(
             builder.CreateIntToPtr(address, PointerType::get(ty, 256));
 
         LoadInst *li = builder.CreateLoad(ty, address_ptr);
-        if (e_.fences_) {
-            if (!is_stack(rmn))
+        if (!is_stack(rmn)) {
+            if (e_.memory_model_ == memory_model::acquire_release &&
+                is_atomic_access_type(ty)) {
+                li->setAlignment(Align(ty->getPrimitiveSizeInBits() / 8));
+                li->setAtomic(AtomicOrdering::Acquire);
+            } else if (e_.memory_model_ != memory_model::none) {
                 builder.CreateFence(AtomicOrdering::Acquire);
+            }
         }
         li->setMetadata(LLVMContext::MD_alias_scope,
                         MDNode::get(li->getContext(), guest_mem_alias_scope_));
@@ -675,7 +1133,7 @@ Value *llvm_static_output_engine_impl::materialise_port(
         // auto src_reg = builder.CreateGEP(types.cpu_state, state_arg, {
         // ConstantInt::get(types.i64, 0), ConstantInt::get(types.i32,
         // rrn->regidx()) }, 	idx_to_reg_name(rrn->regidx()));
-        auto src_reg = reg_to_alloca_.at((reg_offsets)rrn->regoff());
+        auto src_reg = get_reg_alloca((reg_offsets)rrn->regoff());
 
         ::llvm::Type *ty;
         Align align = Align(8);
@@ -1502,7 +1960,7 @@ Value *llvm_static_output_engine_impl::materialise_port(
         // auto gs_reg = builder.CreateGEP(types.cpu_state, state_arg, {
         // ConstantInt::get(types.i64, 0), ConstantInt::get(types.i32, 26) });
         // //TODO: move offset_2_idx into a common header
-        auto gs_reg = reg_to_alloca_.at(reg_offsets::GS);
+        // auto gs_reg = get_reg_alloca(reg_offsets::GS);
         // lhs = builder.CreateAdd(lhs, builder.CreateLoad(types.i64, gs_reg));
 #endif
         auto value_port =
@@ -1581,7 +2039,7 @@ Value *llvm_static_output_engine_impl::materialise_port(
             // return
             // builder.CreateZExt(builder.CreateCmp(CmpInst::Predicate::ICMP_EQ,
             // top, lhs), types.i8);
-            auto z_reg = reg_to_alloca_.at(reg_offsets::ZF);
+            auto z_reg = get_reg_alloca(reg_offsets::ZF);
             return builder.CreateLoad(types.i8, z_reg);
         }
         // TODO: Flags
@@ -1682,7 +2140,7 @@ Value *llvm_static_output_engine_impl::lower_node(IRBuilder<> &builder,
         // auto dest_reg = builder.CreateGEP(types.cpu_state, state_arg, {
         // ConstantInt::get(types.i64, 0), ConstantInt::get(types.i32,
         // wrn->regidx()) }, 	idx_to_reg_name(wrn->regidx()));
-        auto dest_reg = reg_to_alloca_.at((reg_offsets)wrn->regoff());
+        auto dest_reg = get_reg_alloca((reg_offsets)wrn->regoff());
 
         // auto *reg_type =
         // ((GetElementPtrInst*)dest_reg)->getResultElementType();
@@ -1735,18 +2193,27 @@ Value *llvm_static_output_engine_impl::lower_node(IRBuilder<> &builder,
         // auto gs_reg = builder.CreateGEP(types.cpu_state, state_arg, {
         // ConstantInt::get(types.i64, 0), ConstantInt::get(types.i32, 26) });
         // //TODO: move offset_2_idx into a common header
-        auto gs_reg = reg_to_alloca_.at(reg_offsets::GS);
+        // auto gs_reg = get_reg_alloca(reg_offsets::GS);
         // address = builder.CreateAdd(address, builder.CreateLoad(types.i64,
         // gs_reg));
 #endif
         auto address_ptr = builder.CreateIntToPtr(
             address, PointerType::get(value->getType(), 256));
 
-        if (e_.fences_) {
-            if (!is_stack(wmn))
-                builder.CreateFence(AtomicOrdering::Release);
+        bool release_store =
+            !is_stack(wmn) &&
+            e_.memory_model_ == memory_model::acquire_release &&
+            is_atomic_access_type(value->getType());
+        if (!is_stack(wmn) && !release_store &&
+            e_.memory_model_ != memory_model::none) {
+            builder.CreateFence(AtomicOrdering::Release);
         }
         auto store = builder.CreateStore(value, address_ptr);
+        if (release_store) {
+            store->setAlignment(
+                Align(value->getType()->getPrimitiveSizeInBits() / 8));
+            store->setAtomic(AtomicOrdering::Release);
+        }
         store->setMetadata(
             LLVMContext::MD_alias_scope,
             MDNode::get(store->getContext(), guest_mem_alias_scope_));
@@ -1763,7 +2230,7 @@ Value *llvm_static_output_engine_impl::lower_node(IRBuilder<> &builder,
             types.cpu_state, state_arg,
             {ConstantInt::get(types.i64, 0), ConstantInt::get(types.i32, 0)},
             "pcptr");
-        auto dest_reg = reg_to_alloca_.at(reg_offsets::PC);
+        auto dest_reg = get_reg_alloca(reg_offsets::PC);
         auto val = lower_port(builder, state_arg, pkt, wpn->value());
 
         // For Debug only! This will break the static_csel pass
@@ -1862,7 +2329,7 @@ Value *llvm_static_output_engine_impl::lower_node(IRBuilder<> &builder,
         // auto gs_reg = builder.CreateGEP(types.cpu_state, state_arg, {
         // ConstantInt::get(types.i64, 0), ConstantInt::get(types.i32, 26) });
         // //TODO: move offset_2_idx into a common header
-        auto gs_reg = reg_to_alloca_.at(reg_offsets::GS);
+        // auto gs_reg = get_reg_alloca(reg_offsets::GS);
         // lhs = builder.CreateAdd(lhs, builder.CreateLoad(types.i64, gs_reg));
 #endif
         auto rhs = lower_port(builder, state_arg, pkt, ban->rhs());
@@ -1878,7 +2345,7 @@ Value *llvm_static_output_engine_impl::lower_node(IRBuilder<> &builder,
 
         lhs =
             builder.CreateIntToPtr(lhs, PointerType::get(rhs->getType(), 256));
-        if (e_.fences_) {
+        if (e_.memory_model_ != memory_model::none) {
             builder.CreateFence(AtomicOrdering::SequentiallyConsistent);
         }
         AtomicRMWInst *out;
@@ -1928,7 +2395,7 @@ Value *llvm_static_output_engine_impl::lower_node(IRBuilder<> &builder,
                 builder.CreateAtomicRMW(AtomicRMWInst::Add, lhs, rhs, align,
                                         AtomicOrdering::SequentiallyConsistent);
             if (reg_off != -1) {
-                auto reg = reg_to_alloca_.at((reg_offsets)reg_off);
+                auto reg = get_reg_alloca((reg_offsets)reg_off);
                 builder.CreateStore(out, reg);
             }
             break;
@@ -1943,7 +2410,7 @@ Value *llvm_static_output_engine_impl::lower_node(IRBuilder<> &builder,
                 builder.CreateAtomicRMW(AtomicRMWInst::Xchg, lhs, rhs, align,
                                         AtomicOrdering::SequentiallyConsistent);
             if (reg_off != -1) {
-                auto reg = reg_to_alloca_.at((reg_offsets)reg_off);
+                auto reg = get_reg_alloca((reg_offsets)reg_off);
                 builder.CreateStore(out, reg);
             }
             val = rhs;
@@ -1961,7 +2428,7 @@ Value *llvm_static_output_engine_impl::lower_node(IRBuilder<> &builder,
         //			default:
         //				break;
         //			}
-        if (e_.fences_) {
+        if (e_.memory_model_ != memory_model::none) {
             builder.CreateFence(AtomicOrdering::SequentiallyConsistent);
         }
         node_ports_to_llvm_values_[&ban->val()] = out;
@@ -1982,7 +2449,7 @@ Value *llvm_static_output_engine_impl::lower_node(IRBuilder<> &builder,
         // auto gs_reg = builder.CreateGEP(types.cpu_state, state_arg, {
         // ConstantInt::get(types.i64, 0), ConstantInt::get(types.i32, 26) });
         // //TODO: move offset_2_idx into a common header
-        auto gs_reg = reg_to_alloca_.at(reg_offsets::GS);
+        // auto gs_reg = get_reg_alloca(reg_offsets::GS);
         // lhs = builder.CreateAdd(lhs, builder.CreateLoad(types.i64, gs_reg));
 #endif
         auto rhs = lower_port(builder, state_arg, pkt, tan->rhs());
@@ -1994,8 +2461,8 @@ Value *llvm_static_output_engine_impl::lower_node(IRBuilder<> &builder,
         // auto rax_reg = builder.CreateGEP(types.cpu_state, state_arg, {
         // ConstantInt::get(types.i64, 0), ConstantInt::get(types.i32, reg_idx)
         // });
-        auto rax_reg = reg_to_alloca_.at(reg_offsets::RAX);
-        auto z_reg = reg_to_alloca_.at(reg_offsets::ZF);
+        auto rax_reg = get_reg_alloca(reg_offsets::RAX);
+        auto z_reg = get_reg_alloca(reg_offsets::ZF);
 
         Value *out;
         switch (tan->op()) {
@@ -2019,7 +2486,7 @@ Value *llvm_static_output_engine_impl::lower_node(IRBuilder<> &builder,
             }
             lhs = builder.CreateIntToPtr(lhs,
                                          PointerType::get(rhs->getType(), 256));
-            if (e_.fences_) {
+            if (e_.memory_model_ != memory_model::none) {
                 builder.CreateFence(AtomicOrdering::SequentiallyConsistent);
             }
             auto instr = builder.CreateAtomicCmpXchg(
@@ -2035,7 +2502,7 @@ Value *llvm_static_output_engine_impl::lower_node(IRBuilder<> &builder,
                 builder.CreateZExt(builder.CreateExtractValue(instr, 1),
                                    types.i8),
                 z_reg);
-            if (e_.fences_) {
+            if (e_.memory_model_ != memory_model::none) {
                 builder.CreateFence(AtomicOrdering::SequentiallyConsistent);
             }
 
@@ -2103,6 +2570,18 @@ Value *llvm_static_output_engine_impl::lower_node(IRBuilder<> &builder,
         } else if (icn->fn().name() == "handle_int") {
             return builder.CreateCall(
                 switch_callee, {state_arg, ConstantInt::get(types.i32, 2)});
+        } else if (icn->fn().name() == "nlib_guest_callback") {
+            // Binds the guest function to a host trampoline that runs it on
+            // this thread's CPU state
+            auto fn = module_->getOrInsertFunction(
+                "nlib_guest_callback",
+                FunctionType::get(types.i64, {types.cpu_state_ptr, types.i64},
+                                  false));
+            auto guest_fn =
+                lower_port(builder, state_arg, pkt, *icn->args()[0]);
+            auto out = builder.CreateCall(fn, {state_arg, guest_fn});
+            node_ports_to_llvm_values_[&icn->val()] = out;
+            return out;
         } else {
             const port &ret = icn->val();
             const std::vector<port *> &args = icn->args();
@@ -2132,6 +2611,9 @@ Value *llvm_static_output_engine_impl::lower_node(IRBuilder<> &builder,
                 case 64:
                     retty = types.i64;
                     break;
+                case 128:
+                    retty = types.i128;
+                    break;
                 default:
                     throw std::runtime_error(
                         "unsupported register width " +
@@ -2209,46 +2691,59 @@ Value *llvm_static_output_engine_impl::lower_node(IRBuilder<> &builder,
 
 std::vector<Value *>
 llvm_static_output_engine_impl::load_args(IRBuilder<> *builder,
-                                          Argument *state_arg) {
+                                          Argument *state_arg,
+                                          Function *callee) {
 
     std::vector<Value *> ret = {
         state_arg,
-        builder->CreateLoad(types.i64, reg_to_alloca_.at(reg_offsets::RDI)),
-        builder->CreateLoad(types.i64, reg_to_alloca_.at(reg_offsets::RSI)),
-        builder->CreateLoad(types.i64, reg_to_alloca_.at(reg_offsets::RDX)),
-        builder->CreateLoad(types.i64, reg_to_alloca_.at(reg_offsets::RCX)),
-        builder->CreateLoad(types.i64, reg_to_alloca_.at(reg_offsets::R8)),
-        builder->CreateLoad(types.i64, reg_to_alloca_.at(reg_offsets::R9)),
-        //			  builder->CreateLoad(types.i512,
-        // reg_to_alloca_.at(reg_offsets::ZMM0)),
-        // builder->CreateLoad(types.i512,
-        // reg_to_alloca_.at(reg_offsets::ZMM1)),
-        // builder->CreateLoad(types.i512,
-        // reg_to_alloca_.at(reg_offsets::ZMM2)),
-        // builder->CreateLoad(types.i512,
-        // reg_to_alloca_.at(reg_offsets::ZMM3)),
-        // builder->CreateLoad(types.i512,
-        // reg_to_alloca_.at(reg_offsets::ZMM4)),
-        // builder->CreateLoad(types.i512,
-        // reg_to_alloca_.at(reg_offsets::ZMM5)),
-        // builder->CreateLoad(types.i512,
-        // reg_to_alloca_.at(reg_offsets::ZMM6)),
-        // builder->CreateLoad(types.i512, reg_to_alloca_.at(reg_offsets::ZMM7))
+        builder->CreateLoad(types.i64, get_reg_alloca(reg_offsets::RDI)),
+        builder->CreateLoad(types.i64, get_reg_alloca(reg_offsets::RSI)),
+        builder->CreateLoad(types.i64, get_reg_alloca(reg_offsets::RDX)),
+        builder->CreateLoad(types.i64, get_reg_alloca(reg_offsets::RCX)),
+        builder->CreateLoad(types.i64, get_reg_alloca(reg_offsets::R8)),
+        builder->CreateLoad(types.i64, get_reg_alloca(reg_offsets::R9)),
     };
+
+    auto it = vector_args_.find(callee);
+    for (auto reg : vector_arg_regs) {
+        if (it != vector_args_.end() && !it->second.count(reg)) {
+            // Not used by the callee
+            ret.push_back(PoisonValue::get(types.xmm));
+        } else if (touched_regs_.count(reg)) {
+            // Low 128 bits of the (possibly wider) register
+            ret.push_back(builder->CreateLoad(types.xmm, get_reg_alloca(reg)));
+        } else {
+            ret.push_back(createLoadFromCPU(
+                *builder, state_arg, off_to_idx.at((unsigned long)reg)));
+        }
+    }
     return ret;
 };
 
 void llvm_static_output_engine_impl::unwrap_ret(IRBuilder<> *builder,
                                                 Value *value,
-                                                Argument *state_arg) {
+                                                Argument *state_arg,
+                                                Function *callee) {
     builder->CreateStore(builder->CreateExtractValue(value, {0}),
-                         reg_to_alloca_.at(reg_offsets::RAX));
+                         get_reg_alloca(reg_offsets::RAX));
     builder->CreateStore(builder->CreateExtractValue(value, {1}),
-                         reg_to_alloca_.at(reg_offsets::RDX));
-    //	builder->CreateStore(builder->CreateExtractValue(value, { 2 }),
-    // reg_to_alloca_.at(reg_offsets::ZMM0));
-    //	builder->CreateStore(builder->CreateExtractValue(value, { 3 }),
-    // reg_to_alloca_.at(reg_offsets::ZMM1));
+                         get_reg_alloca(reg_offsets::RDX));
+
+    // The callee also saved its vector results to the CPU state, where they
+    // have been restored from. Only plain XMM registers are forwarded, so
+    // that LLVM can drop the reload.
+    auto it = vector_rets_.find(callee);
+    if (it == vector_rets_.end())
+        return;
+    for (unsigned i = 0; i < std::size(vector_ret_regs); i++) {
+        auto reg = vector_ret_regs[i];
+        auto width = vector_widths_.find(reg);
+        if (!it->second.count(reg) || !touched_regs_.count(reg) ||
+            width == vector_widths_.end() || width->second != 128)
+            continue;
+        builder->CreateStore(builder->CreateExtractValue(value, {2 + i}),
+                             get_reg_alloca(reg));
+    }
 };
 
 std::vector<Value *>
@@ -2256,13 +2751,17 @@ llvm_static_output_engine_impl::wrap_ret(IRBuilder<> *builder,
                                          Argument *state_arg) {
     std::vector<Value *> ret;
     ret.push_back(
-        builder->CreateLoad(types.i64, reg_to_alloca_.at(reg_offsets::RAX)));
+        builder->CreateLoad(types.i64, get_reg_alloca(reg_offsets::RAX)));
     ret.push_back(
-        builder->CreateLoad(types.i64, reg_to_alloca_.at(reg_offsets::RDX)));
-    //	ret.push_back(builder->CreateLoad(types.i512,
-    // reg_to_alloca_.at(reg_offsets::ZMM0)));
-    //	ret.push_back(builder->CreateLoad(types.i512,
-    // reg_to_alloca_.at(reg_offsets::ZMM1)));
+        builder->CreateLoad(types.i64, get_reg_alloca(reg_offsets::RDX)));
+
+    auto it = vector_rets_.find(builder->GetInsertBlock()->getParent());
+    for (auto reg : vector_ret_regs) {
+        if (it != vector_rets_.end() && it->second.count(reg))
+            ret.push_back(builder->CreateLoad(types.xmm, get_reg_alloca(reg)));
+        else
+            ret.push_back(PoisonValue::get(types.xmm));
+    }
     return ret;
 }
 
@@ -2279,6 +2778,11 @@ void llvm_static_output_engine_impl::lower_chunk(IRBuilder<> *builder,
         if (it != wrapper_fns_->end()) {
             // Don't translate if we have a wrapper
             auto old = it->second;
+            if (auto alias = address_aliases_.find(fn);
+                alias != address_aliases_.end()) {
+                alias->second->eraseFromParent();
+                address_aliases_.erase(alias);
+            }
             fn->replaceAllUsesWith(old);
             fn->eraseFromParent();
             GlobalAlias::create(get_fn_type(), old->getAddressSpace(),
@@ -2290,6 +2794,14 @@ void llvm_static_output_engine_impl::lower_chunk(IRBuilder<> *builder,
         if (fn->begin() != fn->end())
             return;
 
+        // Imports of translated libraries refer to the chunk name, the guest
+        // address in the alias lets host profilers attribute samples to guest
+        // code (perf picks the longer of two global names)
+        address_aliases_[fn] = GlobalAlias::create(
+            get_fn_type(), fn->getAddressSpace(),
+            GlobalValue::LinkageTypes::ExternalLinkage,
+            fn->getName() + "." + utohexstr(addr, true), fn, module_.get());
+
         {
             Constant *gvar = module_->getOrInsertGlobal("guest_base", types.i8);
             gvar = reinterpret_cast<Constant *>(builder->CreateGEP(
@@ -2334,30 +2846,21 @@ void llvm_static_output_engine_impl::lower_chunk(IRBuilder<> *builder,
     init_regs(*builder);
     restore_callee_regs(*builder, state_arg, false);
 
-    builder->CreateStore(fn->getArg(1), reg_to_alloca_.at(reg_offsets::RDI));
-    builder->CreateStore(fn->getArg(2), reg_to_alloca_.at(reg_offsets::RSI));
-    builder->CreateStore(fn->getArg(3), reg_to_alloca_.at(reg_offsets::RDX));
-    builder->CreateStore(fn->getArg(4), reg_to_alloca_.at(reg_offsets::RCX));
-    builder->CreateStore(fn->getArg(5), reg_to_alloca_.at(reg_offsets::R8));
-    builder->CreateStore(fn->getArg(6), reg_to_alloca_.at(reg_offsets::R9));
-
-    //	builder->CreateStore(fn->getArg(7),
-    // reg_to_alloca_.at(reg_offsets::ZMM0));
-    // builder->CreateStore(fn->getArg(8),
-    // reg_to_alloca_.at(reg_offsets::ZMM1));
-    // builder->CreateStore(fn->getArg(9),
-    // reg_to_alloca_.at(reg_offsets::ZMM2));
-    //	builder->CreateStore(fn->getArg(10),
-    // reg_to_alloca_.at(reg_offsets::ZMM3));
-    //	builder->CreateStore(fn->getArg(11),
-    // reg_to_alloca_.at(reg_offsets::ZMM4));
-    //	builder->CreateStore(fn->getArg(12),
-    // reg_to_alloca_.at(reg_offsets::ZMM5));
-    //	builder->CreateStore(fn->getArg(13),
-    // reg_to_alloca_.at(reg_offsets::ZMM6));
-    //	builder->CreateStore(fn->getArg(14),
-    // reg_to_alloca_.at(reg_offsets::ZMM7));
-    auto pc_ptr = reg_to_alloca_.at(reg_offsets::PC);
+    builder->CreateStore(fn->getArg(1), get_reg_alloca(reg_offsets::RDI));
+    builder->CreateStore(fn->getArg(2), get_reg_alloca(reg_offsets::RSI));
+    builder->CreateStore(fn->getArg(3), get_reg_alloca(reg_offsets::RDX));
+    builder->CreateStore(fn->getArg(4), get_reg_alloca(reg_offsets::RCX));
+    builder->CreateStore(fn->getArg(5), get_reg_alloca(reg_offsets::R8));
+    builder->CreateStore(fn->getArg(6), get_reg_alloca(reg_offsets::R9));
+
+    if (auto it = vector_args_.find(fn); it != vector_args_.end()) {
+        for (unsigned i = 0; i < std::size(vector_arg_regs); i++) {
+            if (it->second.count(vector_arg_regs[i]))
+                builder->CreateStore(fn->getArg(7 + i),
+                                     get_reg_alloca(vector_arg_regs[i]));
+        }
+    }
+    auto pc_ptr = get_reg_alloca(reg_offsets::PC);
 
     for (auto p : c->packets()) {
         std::stringstream block_name;
@@ -2392,11 +2895,17 @@ void llvm_static_output_engine_impl::lower_chunk(IRBuilder<> *builder,
         case br_type::call: {
             auto f = get_static_fn(p);
             if (f) {
-                save_callee_regs(*builder, state_arg, false);
+                // Vector arguments the callee takes natively need not be
+                // saved
+                auto it = vector_args_.find(f);
+                save_callee_regs(*builder, state_arg, false,
+                                 it != vector_args_.end()
+                                     ? it->second
+                                     : std::set<reg_offsets>{});
                 auto ret =
-                    builder->CreateCall(f, load_args(builder, state_arg));
+                    builder->CreateCall(f, load_args(builder, state_arg, f));
                 restore_callee_regs(*builder, state_arg, false);
-                unwrap_ret(builder, ret, state_arg);
+                unwrap_ret(builder, ret, state_arg, f);
             } else {
                 save_callee_regs(*builder, state_arg);
                 builder->CreateCall(main_loop, {state_arg});
@@ -2426,7 +2935,8 @@ void llvm_static_output_engine_impl::lower_chunk(IRBuilder<> *builder,
             builder->CreateCall(
                 clk_, {state_arg, builder->CreateGlobalStringPtr(exit.str())});
 #endif
-            builder->CreateAggregateRet(wrap_ret(builder, state_arg).data(), 2);
+            auto rets = wrap_ret(builder, state_arg);
+            builder->CreateAggregateRet(rets.data(), rets.size());
             packet_block = nullptr;
             break;
         }
@@ -2439,7 +2949,8 @@ void llvm_static_output_engine_impl::lower_chunk(IRBuilder<> *builder,
         builder->CreateCall(
             clk_, {state_arg, builder->CreateGlobalStringPtr(exit.str())});
 #endif
-        builder->CreateAggregateRet(wrap_ret(builder, state_arg).data(), 2);
+        auto rets = wrap_ret(builder, state_arg);
+        builder->CreateAggregateRet(rets.data(), rets.size());
     }
 
     mid->insertInto(fn);
@@ -2468,7 +2979,8 @@ void llvm_static_output_engine_impl::lower_chunk(IRBuilder<> *builder,
     builder->CreateCall(
         clk_, {state_arg, builder->CreateGlobalStringPtr(exit.str())});
 #endif
-    builder->CreateAggregateRet(wrap_ret(builder, state_arg).data(), 2);
+    auto rets = wrap_ret(builder, state_arg);
+    builder->CreateAggregateRet(rets.data(), rets.size());
 
     if (verifyFunction(*fn, &errs())) {
         module_->print(errs(), nullptr);
@@ -2480,37 +2992,64 @@ FunctionType *llvm_static_output_engine_impl::get_fn_type() {
     std::vector<Type *> argv;
     StructType *retv;
 
-    retv = StructType::get(*llvm_context_,
-                           {types.i64, types.i64 /*, types.i512, types.i512*/},
-                           false);
+    // RAX, RDX and the vector (XMM) results
+    std::vector<Type *> rets{types.i64, types.i64};
+    rets.insert(rets.end(), std::size(vector_ret_regs), types.xmm);
+    retv = StructType::get(*llvm_context_, rets, false);
+
     argv = {
         types.cpu_state_ptr, types.i64, types.i64, types.i64,
         types.i64,           types.i64, types.i64,
-        //		types.i512,
-        //		types.i512,
-        //		types.i512,
-        //		types.i512,
-        //		types.i512,
-        //		types.i512,
-        //		types.i512,
-        //		types.i512,
-    }; // cpu_state, 6 int args, 8 float args
+    }; // cpu_state, 6 int args, vector (XMM) args
+    argv.insert(argv.end(), std::size(vector_arg_regs), types.xmm);
     return FunctionType::get(retv, argv, false);
 }
 
 void llvm_static_output_engine_impl::init_regs(IRBuilder<> &builder) {
+    // Allocas are created on first use by get_reg_alloca()
     reg_to_alloca_.clear();
-#define DEFREG(ctype, ltype, name)                                             \
-    do {                                                                       \
-        reg_to_alloca_[reg_offsets::name] =                                    \
-            builder.CreateAlloca(types.ltype, 128, nullptr, "reg" #name);      \
-        builder.CreateStore(ConstantInt::get(types.ltype, 0),                  \
-                            reg_to_alloca_.at(reg_offsets::name));             \
-    } while (0);
+    reg_alloca_block_ = builder.GetInsertBlock();
+}
+
+AllocaInst *llvm_static_output_engine_impl::get_reg_alloca(reg_offsets reg) {
+    if (auto it = reg_to_alloca_.find(reg); it != reg_to_alloca_.end())
+        return it->second;
+
+    // Place the alloca at the top of the entry block, so that it is promoted
+    // to SSA values regardless of where the register is first accessed
+    IRBuilder<> builder(reg_alloca_block_,
+                        reg_alloca_block_->getFirstInsertionPt());
+    Type *ty;
+    const char *name;
+    switch (reg) {
+#define DEFREG(ctype, ltype, regname)                                          \
+    case reg_offsets::regname:                                                 \
+        ty = types.ltype;                                                      \
+        name = "reg" #regname;                                                 \
+        break;
 #include <arancini/input/x86/reg.def>
 #undef DEFREG
+    default:
+        throw std::runtime_error("unknown register offset " +
+                                 std::to_string((unsigned long)reg));
+    }
+
+    // Vector registers are narrowed to the widest access in this function,
+    // e.g. to 128 bits for SSE-only code. The upper bits then stay untouched
+    // in the CPU state rather than being copied back and forth.
+    if (auto it = vector_widths_.find(reg); it != vector_widths_.end())
+        ty = IntegerType::get(*llvm_context_, it->second);
+
+    auto alloca = builder.CreateAlloca(ty, 128, nullptr, name);
+    builder.CreateStore(ConstantInt::get(ty, 0), alloca);
+
+    reg_to_alloca_[reg] = alloca;
+    return alloca;
 }
 
+// Registers the current function never writes still hold their value in the
+// CPU state, so they are never saved. Likewise, registers it never touches are
+// never restored.
 void llvm_static_output_engine_impl::save_all_regs(IRBuilder<> &builder,
                                                    Argument *state_arg) {
     auto regs = {
@@ -2519,12 +3058,14 @@ void llvm_static_output_engine_impl::save_all_regs(IRBuilder<> &builder,
 #undef DEFREG
     };
     for (auto reg : regs) {
+        if (!written_regs_.count(reg))
+            continue;
         auto ptr = builder.CreateGEP(
             types.cpu_state, state_arg,
             {ConstantInt::get(types.i64, 0),
              ConstantInt::get(types.i32, off_to_idx.at((unsigned long)reg))},
             "save_" + std::to_string((unsigned long)reg));
-        auto alloca = reg_to_alloca_.at(reg);
+        auto alloca = get_reg_alloca(reg);
         StoreInst *store = builder.CreateStore(
             builder.CreateLoad(alloca->getAllocatedType(), alloca), ptr);
         store->setMetadata(
@@ -2544,12 +3085,14 @@ void llvm_static_output_engine_impl::restore_all_regs(IRBuilder<> &builder,
 #undef DEFREG
     };
     for (auto reg : regs) {
+        if (!touched_regs_.count(reg))
+            continue;
         auto ptr = builder.CreateGEP(
             types.cpu_state, state_arg,
             {ConstantInt::get(types.i64, 0),
              ConstantInt::get(types.i32, off_to_idx.at((unsigned long)reg))},
             "restore_" + std::to_string((unsigned long)reg));
-        auto alloca = reg_to_alloca_.at(reg);
+        auto alloca = get_reg_alloca(reg);
         LoadInst *load = builder.CreateLoad(alloca->getAllocatedType(), ptr);
         load->setMetadata(
             LLVMContext::MD_alias_scope,
@@ -2562,9 +3105,9 @@ void llvm_static_output_engine_impl::restore_all_regs(IRBuilder<> &builder,
 }
 
 // well akshually, callee saved registers and permanent state
-void llvm_static_output_engine_impl::save_callee_regs(IRBuilder<> &builder,
-                                                      Argument *state_arg,
-                                                      bool with_args) {
+void llvm_static_output_engine_impl::save_callee_regs(
+    IRBuilder<> &builder, Argument *state_arg, bool with_args,
+    const std::set<reg_offsets> &passed) {
     auto args = {reg_offsets::RCX, reg_offsets::RDX, reg_offsets::RDI,
                  reg_offsets::RSI, reg_offsets::R8,  reg_offsets::R9};
     auto regs = {
@@ -2577,12 +3120,14 @@ void llvm_static_output_engine_impl::save_callee_regs(IRBuilder<> &builder,
         reg_offsets::ZMM4,     reg_offsets::ZMM5,       reg_offsets::ZMM6,
         reg_offsets::ZMM7};
     for (auto reg : regs) {
+        if (!written_regs_.count(reg) || passed.count(reg))
+            continue;
         auto ptr = builder.CreateGEP(
             types.cpu_state, state_arg,
             {ConstantInt::get(types.i64, 0),
              ConstantInt::get(types.i32, off_to_idx.at((unsigned long)reg))},
             "save_" + std::to_string((unsigned long)reg));
-        auto alloca = reg_to_alloca_.at(reg);
+        auto alloca = get_reg_alloca(reg);
         StoreInst *store = builder.CreateStore(
             builder.CreateLoad(alloca->getAllocatedType(), alloca), ptr);
         store->setMetadata(
@@ -2595,12 +3140,14 @@ void llvm_static_output_engine_impl::save_callee_regs(IRBuilder<> &builder,
     if (!with_args)
         return;
     for (auto reg : args) {
+        if (!written_regs_.count(reg))
+            continue;
         auto ptr = builder.CreateGEP(
             types.cpu_state, state_arg,
             {ConstantInt::get(types.i64, 0),
              ConstantInt::get(types.i32, off_to_idx.at((unsigned long)reg))},
             "save_" + std::to_string((unsigned long)reg));
-        auto alloca = reg_to_alloca_.at(reg);
+        auto alloca = get_reg_alloca(reg);
         StoreInst *store = builder.CreateStore(
             builder.CreateLoad(alloca->getAllocatedType(), alloca), ptr);
         store->setMetadata(
@@ -2634,12 +3181,14 @@ void llvm_static_output_engine_impl::restore_callee_regs(IRBuilder<> &builder,
                  reg_offsets::ZMM0,
                  reg_offsets::ZMM1};
     for (auto reg : regs) {
+        if (!touched_regs_.count(reg))
+            continue;
         auto ptr = builder.CreateGEP(
             types.cpu_state, state_arg,
             {ConstantInt::get(types.i64, 0),
              ConstantInt::get(types.i32, off_to_idx.at((unsigned long)reg))},
             "restore_" + std::to_string((unsigned long)reg));
-        auto alloca = reg_to_alloca_.at(reg);
+        auto alloca = get_reg_alloca(reg);
         LoadInst *load = builder.CreateLoad(alloca->getAllocatedType(), ptr);
         load->setMetadata(
             LLVMContext::MD_alias_scope,
@@ -2652,12 +3201,14 @@ void llvm_static_output_engine_impl::restore_callee_regs(IRBuilder<> &builder,
     if (!with_rets)
         return;
     for (auto reg : rets) {
+        if (!touched_regs_.count(reg))
+            continue;
         auto ptr = builder.CreateGEP(
             types.cpu_state, state_arg,
             {ConstantInt::get(types.i64, 0),
              ConstantInt::get(types.i32, off_to_idx.at((unsigned long)reg))},
             "restore_" + std::to_string((unsigned long)reg));
-        auto alloca = reg_to_alloca_.at(reg);
+        auto alloca = get_reg_alloca(reg);
         LoadInst *load = builder.CreateLoad(alloca->getAllocatedType(), ptr);
         load->setMetadata(
             LLVMContext::MD_alias_scope,
@@ -2692,7 +3243,8 @@ llvm_static_output_engine_impl::get_static_fn(std::shared_ptr<packet> pkt) {
     return nullptr;
 };
 
-void llvm_static_output_engine_impl::optimise() {
+void llvm_static_output_engine_impl::optimise(Module &module,
+                                              const std::string &dump_suffix) {
     LoopAnalysisManager LAM;
     FunctionAnalysisManager FAM;
     CGSCCAnalysisManager CGAM;
@@ -2708,19 +3260,20 @@ void llvm_static_output_engine_impl::optimise() {
     PB.registerOptimizerLastEPCallback(
         [&](ModulePassManager &mpm, OptimizationLevel Level) {
             mpm.addPass(createModuleToFunctionPassAdaptor(FenceCombinePass()));
+            if (e_.lazy_fences_)
+                mpm.addPass(
+                    createModuleToFunctionPassAdaptor(FenceGuardPass()));
         });
 
     ModulePassManager MPM =
-        PB.buildPerModuleDefaultPipeline(OptimizationLevel::O2);
-    MPM.run(*module_, MAM);
+        PB.buildPerModuleDefaultPipeline(optimisation_level);
+    MPM.run(module, MAM);
 
     // Compiled modules now exists
-    if (e_.dbg_) {
-        std::cerr << "Fixed branches: " << fixed_branches << std::endl;
-    }
     if (e_.debug_dump_filename.has_value()) {
         std::error_code EC;
-        std::string filename = e_.debug_dump_filename.value() + ".opt.ll";
+        std::string filename =
+            e_.debug_dump_filename.value() + dump_suffix + ".opt.ll";
         raw_fd_ostream file(filename, EC);
 
         if (EC) {
@@ -2728,58 +3281,33 @@ void llvm_static_output_engine_impl::optimise() {
                    << "': " << EC.message() << "\n";
         }
 
-        module_->print(file, nullptr);
+        module.print(file, nullptr);
         file.close();
     }
 }
 
-void llvm_static_output_engine_impl::compile() {
-    std::cout << "Fixed branches: " << fixed_branches << std::endl;
-#ifndef CROSS_TRANSLATE
-    auto TT = sys::getDefaultTargetTriple();
-#elif defined(ARCH_RISCV64)
-    auto TT = "riscv64-unknown-linux-gnu";
-#elif defined(ARCH_AARCH64)
-    auto TT = "aarch64-unknown-linux-gnu";
-#elif defined(ARCH_X86_64)
-    auto TT = "x86_64-unknown-linux-gnu";
-#error Please check if the triple above is correct
-#endif
-    module_->setTargetTriple(TT);
+void llvm_static_output_engine_impl::compile(
+    Module &module, const std::string &output_filename) {
+    auto target = static_target();
+    module.setTargetTriple(target.triple);
 
     std::string error_message;
-    auto T = TargetRegistry::lookupTarget(TT, error_message);
+    auto T = TargetRegistry::lookupTarget(target.triple, error_message);
     if (!T) {
         throw std::runtime_error(error_message);
     }
 
     TargetOptions TO;
+    TO.MCOptions.ABIName = target.abi;
     auto RM = optional<Reloc::Model>(Reloc::Model::PIC_);
-#if defined(ARCH_RISCV64)
-    // Add multiply(M), atomics(A), single(F) and double(D) precision float and
-    // compressed(C) extensions
-    const char *features =
-        "+m,+a,+f,+d,+c,-v,+fast-unaligned-access,+xtheadba,+xtheadbb,+"
-        "xtheadbs,+xtheadcmo,+xtheadcondmov,+xtheadfmemidx,+xtheadmac,+"
-        "xtheadmemidx,+xtheadmempair,+xtheadsync";
-    const char *cpu = "generic-rv64";
-    // Specify abi as 64 bits using double float registers
-    TO.MCOptions.ABIName = "lp64d";
-#elif defined(ARCH_AARCH64)
-    const char *features = "+fp-armv8,+v8.5a,+lse,+ls64";
-    const char *cpu = "thunderx2t99";
-#else
-    const char *features = "+avx";
-    const char *cpu = "generic";
-#endif
-
-    auto TM = T->createTargetMachine(TT, cpu, features, TO, RM);
+    auto TM = T->createTargetMachine(target.triple, target.cpu,
+                                     target.features, TO, RM);
 
-    module_->setDataLayout(TM->createDataLayout());
-    module_->setPICLevel(PICLevel::BigPIC);
+    module.setDataLayout(TM->createDataLayout());
+    module.setPICLevel(PICLevel::BigPIC);
 
     std::error_code EC;
-    raw_fd_ostream output_file(e_.output_filename(), EC, sys::fs::OF_None);
+    raw_fd_ostream output_file(output_filename, EC, sys::fs::OF_None);
 
     if (EC) {
         throw std::runtime_error("could not create output file: " +
@@ -2792,5 +3320,5 @@ void llvm_static_output_engine_impl::compile() {
         throw std::runtime_error("unable to emit file");
     }
 
-    OPM.run(*module_);
+    OPM.run(module);
 }
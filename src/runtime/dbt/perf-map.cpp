@@ -0,0 +1,153 @@
+#include <arancini/runtime/dbt/perf-map.h>
+#include <arancini/util/logger.h>
+
+#include <cstdint>
+#include <ctime>
+#include <stdexcept>
+#include <string>
+
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace arancini::runtime::dbt;
+
+// The jitdump format, see tools/perf/Documentation/jitdump-specification.txt
+// in the Linux sources
+namespace jitdump {
+static constexpr std::uint32_t magic = 0x4a695444;
+static constexpr std::uint32_t version = 1;
+
+enum record_type : std::uint32_t { code_load = 0, code_close = 3 };
+
+struct file_header {
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t total_size;
+    std::uint32_t elf_mach;
+    std::uint32_t pad1;
+    std::uint32_t pid;
+    std::uint64_t timestamp;
+    std::uint64_t flags;
+};
+
+struct record_header {
+    std::uint32_t id;
+    std::uint32_t total_size;
+    std::uint64_t timestamp;
+};
+
+// Followed by the name, including its terminator, and the code
+struct code_load_record {
+    record_header header;
+    std::uint32_t pid;
+    std::uint32_t tid;
+    std::uint64_t vma;
+    std::uint64_t code_addr;
+    std::uint64_t code_size;
+    std::uint64_t code_index;
+};
+} // namespace jitdump
+
+// perf expects CLOCK_MONOTONIC timestamps unless the header says otherwise
+static std::uint64_t timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+perf_map::perf_map(bool jitdump)
+    : map_(fmt::format("/tmp/perf-{}.map", getpid()), std::ios::app) {
+    if (!map_) {
+        throw std::runtime_error("unable to open perf map");
+    }
+
+    if (jitdump) {
+        open_jitdump();
+    }
+}
+
+perf_map::~perf_map() {
+    if (jitdump_fd_ < 0) {
+        return;
+    }
+
+    jitdump::record_header record{jitdump::code_close,
+                                  sizeof(jitdump::record_header), timestamp()};
+    write_jitdump(&record, sizeof(record));
+
+    munmap(jitdump_marker_, sysconf(_SC_PAGESIZE));
+    close(jitdump_fd_);
+}
+
+void perf_map::open_jitdump() {
+    auto filename = fmt::format("/tmp/jit-{}.dump", getpid());
+    jitdump_fd_ =
+        open(filename.c_str(), O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0666);
+    if (jitdump_fd_ < 0) {
+        throw std::runtime_error("unable to open jitdump file " + filename);
+    }
+
+    // perf record finds the file through this executable mapping of it
+    jitdump_marker_ = mmap(nullptr, sysconf(_SC_PAGESIZE),
+                           PROT_READ | PROT_EXEC, MAP_PRIVATE, jitdump_fd_, 0);
+    if (jitdump_marker_ == MAP_FAILED) {
+        close(jitdump_fd_);
+        jitdump_fd_ = -1;
+        throw std::runtime_error("unable to map jitdump file " + filename);
+    }
+
+    jitdump::file_header header{};
+    header.magic = jitdump::magic;
+    header.version = jitdump::version;
+    header.total_size = sizeof(header);
+#if defined(ARCH_X86_64)
+    header.elf_mach = EM_X86_64;
+#elif defined(ARCH_AARCH64)
+    header.elf_mach = EM_AARCH64;
+#elif defined(ARCH_RISCV64)
+    header.elf_mach = EM_RISCV;
+#endif
+    header.pid = getpid();
+    header.timestamp = timestamp();
+    write_jitdump(&header, sizeof(header));
+}
+
+void perf_map::write_jitdump(const void *data, std::size_t size) {
+    const auto *bytes = static_cast<const char *>(data);
+    while (size) {
+        auto written = write(jitdump_fd_, bytes, size);
+        if (written < 0) {
+            throw std::runtime_error("unable to write jitdump record");
+        }
+        bytes += written;
+        size -= written;
+    }
+}
+
+void perf_map::add(const void *code, std::size_t size,
+                   const std::string &name) {
+    // The process may end without destroying the map, so nothing is buffered
+    map_ << fmt::format("{:x} {:x} {}\n",
+                        reinterpret_cast<std::uintptr_t>(code), size, name)
+         << std::flush;
+
+    if (jitdump_fd_ < 0) {
+        return;
+    }
+
+    jitdump::code_load_record record{};
+    record.header.id = jitdump::code_load;
+    record.header.total_size = sizeof(record) + name.size() + 1 + size;
+    record.header.timestamp = timestamp();
+    record.pid = getpid();
+    record.tid = gettid();
+    record.vma = record.code_addr = reinterpret_cast<std::uintptr_t>(code);
+    record.code_size = size;
+    record.code_index = code_index_++;
+
+    write_jitdump(&record, sizeof(record));
+    write_jitdump(name.c_str(), name.size() + 1);
+    write_jitdump(code, size);
+}
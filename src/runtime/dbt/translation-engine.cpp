@@ -3,6 +3,7 @@
 #include <arancini/ir/default-ir-builder.h>
 #include <arancini/ir/dot-graph-generator.h>
 #include <arancini/ir/opt.h>
+#include <arancini/output/dynamic/chain.h>
 #include <arancini/output/dynamic/dynamic-output-engine.h>
 #include <arancini/output/dynamic/machine-code-writer.h>
 #include <arancini/output/dynamic/translation-context.h>
@@ -12,17 +13,25 @@
 #include <arancini/runtime/exec/execution-context.h>
 #include <arancini/util/logger.h>
 
+#include <algorithm>
 #include <cstdlib>
+#include <dlfcn.h>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <optional>
 #include <stdexcept>
+#include <string>
 #include <utility>
+#include <vector>
 
 using namespace arancini::runtime::dbt;
 using namespace arancini::runtime::exec;
 using namespace arancini::output::dynamic;
 using namespace arancini::ir;
 
-translation *translation_engine::get_translation(unsigned long pc) {
+translation *translation_engine::get_translation(unsigned long pc,
+                                                 std::uint64_t chain_address) {
     translation *t;
     if (!cache_.lookup(pc, t)) {
         t = translate(pc);
@@ -31,6 +40,22 @@ translation *translation_engine::get_translation(unsigned long pc) {
         }
 
         cache_.insert(pc, t);
+
+        if (hot_threshold_) {
+            cold_blocks_.emplace(
+                reinterpret_cast<std::uintptr_t>(t->get_code_ptr()), pc);
+        }
+    }
+
+    if (hot_threshold_) {
+        if (chain_address) {
+            record_exit(chain_address, pc);
+        }
+
+        auto &heat = heat_[pc];
+        if (!heat.hot && ++heat.entries >= hot_threshold_) {
+            t = promote(pc);
+        }
     }
 
     return t;
@@ -67,7 +92,7 @@ class dbt_ir_builder : public ir_builder {
         auto &writer = tctx_->writer();
 
         writer.finalise();
-        auto *translation_p = new translation(writer.ptr(), writer.size());
+        auto *translation_p = new translation(writer.exec_ptr(), writer.size());
         writer.reset();
 
         return translation_p;
@@ -129,7 +154,7 @@ class opt_dbt_ir_builder : public default_ir_builder {
         auto &writer = tctx_->writer();
 
         writer.finalise();
-        auto *translation_p = new translation(writer.ptr(), writer.size());
+        auto *translation_p = new translation(writer.exec_ptr(), writer.size());
         writer.reset();
 
         return translation_p;
@@ -140,23 +165,208 @@ class opt_dbt_ir_builder : public default_ir_builder {
     deadflags_opt_visitor &deadflags_;
 };
 
+// Name of the guest symbol containing the given address, if it is exported by
+// the translated binary
+static std::string guest_symbol(unsigned long pc) {
+    Dl_info info;
+    if (!dladdr(reinterpret_cast<void *>(pc), &info) || !info.dli_sname) {
+        return "?";
+    }
+
+    std::string name = info.dli_sname;
+    static const std::string prefix = "__guest__";
+    if (name.compare(0, prefix.size(), prefix) == 0) {
+        name.erase(0, prefix.size());
+    }
+    return fmt::format("{}+{:#x}", name,
+                       pc - reinterpret_cast<unsigned long>(info.dli_saddr));
+}
+
 translation *translation_engine::translate(unsigned long pc) {
     void *code = ec_.get_memory_ptr(pc);
 
     ::util::global_logger.debug("translating PC = {:#x}\n", pc);
 
+    block_profile *profile = nullptr;
+    if (block_profile_) {
+        profile = &block_profiles_.emplace_back(block_profile{pc, 0, 0});
+        ctx_->set_block_counter(&profile->count);
+    }
+
+    translation *txln;
     if (deadflags_) {
         opt_dbt_ir_builder builder(ia_.get_internal_function_resolver(), ctx_,
                                    *deadflags_);
         ia_.translate_chunk(builder, pc, code, 0x1000, true, "");
-        return builder.create_translation();
+        txln = builder.create_translation();
+    } else {
+        dbt_ir_builder builder(ia_.get_internal_function_resolver(), ctx_);
+        ia_.translate_chunk(builder, pc, code, 0x1000, true, "");
+        txln = builder.create_translation();
+    }
+
+    if (profile) {
+        profile->size = txln->get_code_size();
+        ctx_->set_block_counter(nullptr);
+    }
+
+    // Other threads may branch to the new code as soon as it is in the cache
+    // or chained to
+    auto *begin = static_cast<char *>(txln->get_code_ptr());
+    synchronise_code(begin, begin + txln->get_code_size(),
+                     ec_.is_multithreaded());
+
+    if (perf_map_) {
+        auto name = fmt::format("guest {:#x} {}", pc, guest_symbol(pc));
+        if (alloc_.region_of(alloc_.writable(begin)) == code_region::hot) {
+            name += " [hot]";
+        }
+        perf_map_->add(begin, txln->get_code_size(), name);
     }
 
-    dbt_ir_builder builder(ia_.get_internal_function_resolver(), ctx_);
-    ia_.translate_chunk(builder, pc, code, 0x1000, true, "");
-    return builder.create_translation();
+    return txln;
 }
 
 void translation_engine::chain(uint64_t chain_address, void *chain_target) {
+    // Entries of cold blocks must go through the runtime to be counted
+    if (hot_placement_.load(std::memory_order_relaxed) &&
+        alloc_.region_of(alloc_.writable(chain_target)) == code_region::cold) {
+        return;
+    }
+
     ctx_->chain(chain_address, chain_target);
 }
+
+void translation_engine::enter_multithreaded() {
+    if (ctx_->enter_multithreaded()) {
+        ::util::global_logger.info(
+            "Discarding translations of the single-threaded guest\n");
+        cache_.clear();
+        heat_.clear();
+        cold_blocks_.clear();
+    }
+}
+
+void translation_engine::enable_hot_placement(std::uint64_t threshold) {
+    hot_threshold_ = threshold;
+    hot_placement_ = threshold != 0;
+}
+
+// Remembers that the cold block containing the chain site exited to target
+void translation_engine::record_exit(std::uint64_t chain_address,
+                                     unsigned long target) {
+    // Cold code is allocated in ascending order, so the site belongs to the
+    // last block starting before it. Sites in hot code come before all cold
+    // blocks.
+    auto it = cold_blocks_.upper_bound(chain_address);
+    if (it == cold_blocks_.begin()) {
+        return;
+    }
+
+    heat_[std::prev(it)->second].successors.insert(target);
+}
+
+/*
+ * Translates pc again into the hot region. The successors that are about to
+ * become hot follow it directly, so that a hot path is contiguous in the code
+ * cache and each block falls through to the next in the common case. The
+ * fall-through successor of a block is the first one after its PC, so it is
+ * preferred over the targets of backward branches.
+ *
+ * The cold translation is left in place, as threads may still execute it.
+ * Nothing chains to it, and its cache entry is replaced.
+ */
+translation *translation_engine::promote(unsigned long pc) {
+    // Blocks the trace may include, relative to the promotion threshold
+    static constexpr unsigned trace_heat_divisor = 2;
+    // Longest trace placed at once
+    static constexpr unsigned max_trace_length = 16;
+    // Bound on the code generated for one block
+    static constexpr std::size_t max_block_size = 0x40000;
+
+    translation *head = nullptr;
+    unsigned long next = pc;
+    alloc_.select_region(code_region::hot);
+    for (unsigned n = 0; n < max_trace_length; n++) {
+        if (alloc_.available(code_region::hot) < max_block_size) {
+            ::util::global_logger.warn(
+                "Hot code region full, placing all code in the cold region\n");
+            hot_placement_ = false;
+            hot_threshold_ = 0;
+            break;
+        }
+
+        auto &heat = heat_[next];
+        auto *t = translate(next);
+        cache_.insert(next, t);
+        heat.hot = true;
+        if (!head) {
+            head = t;
+        }
+
+        ::util::global_logger.debug("Placed PC = {:#x} in the hot region\n",
+                                    next);
+
+        std::optional<unsigned long> successor;
+        for (auto target : heat.successors) {
+            auto it = heat_.find(target);
+            if (it == heat_.end() || it->second.hot ||
+                it->second.entries < hot_threshold_ / trace_heat_divisor) {
+                continue;
+            }
+
+            successor = target;
+            if (target > next) {
+                break;
+            }
+        }
+
+        if (!successor) {
+            break;
+        }
+        next = *successor;
+    }
+    alloc_.select_region(code_region::cold);
+
+    if (!head) {
+        cache_.lookup(pc, head);
+    }
+    return head;
+}
+
+std::map<unsigned long, translation_engine::block_profile>
+translation_engine::block_profiles() const {
+    // Blocks are translated again after the cache is flushed
+    std::map<unsigned long, block_profile> blocks;
+    for (const auto &profile : block_profiles_) {
+        auto [it, inserted] = blocks.emplace(profile.pc, profile);
+        if (!inserted) {
+            it->second.count += profile.count;
+            it->second.size = profile.size;
+        }
+    }
+    return blocks;
+}
+
+void translation_engine::report_block_profile(std::ostream &os,
+                                              std::size_t limit) const {
+    std::uint64_t total = 0;
+    std::vector<block_profile> sorted;
+    for (const auto &[pc, profile] : block_profiles()) {
+        sorted.push_back(profile);
+        total += profile.count;
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) {
+        return a.count > b.count;
+    });
+
+    os << fmt::format("arancini: block profile: blocks={} executions={}\n",
+                      sorted.size(), total);
+    for (std::size_t i = 0; i < sorted.size() && i < limit; i++) {
+        const auto &profile = sorted[i];
+        os << fmt::format("  {:#14x} {:>14} {:>6.2f}% {:>6}B  {}\n",
+                          profile.pc, profile.count,
+                          total ? 100.0 * profile.count / total : 0.0,
+                          profile.size, guest_symbol(profile.pc));
+    }
+}
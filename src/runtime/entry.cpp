@@ -3,10 +3,17 @@
 #include <arancini/runtime/exec/guest_support.h>
 #include <arancini/runtime/exec/x86/x86-cpu-state.h>
 #include <arancini/util/logger.h>
+#include <algorithm>
+#include <array>
 #include <cstdint>
 #include <cstring>
+#include <fstream>
 #include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
 
+#include <dlfcn.h>
 #include <mutex>
 #include <signal.h>
 #include <sys/mman.h>
@@ -51,6 +58,7 @@ static arancini::output::dynamic::riscv64::riscv64_dynamic_output_engine oe;
 #endif
 
 extern "C" int execute_internal_call(void *cpu_state, int call);
+extern "C" int MainLoop(void *);
 
 // HACK: for Debugging
 static x86_cpu_state *__current_state;
@@ -192,13 +200,94 @@ static uint64_t setup_guest_stack(int argc, char **argv, intptr_t stack_top,
     return (intptr_t)stack_top;
 }
 
+/*
+ * Parses a size given in the environment variable name, which may be suffixed
+ * with K, M or G. Returns def if the variable is not set.
+ */
+static unsigned long get_size_flag(const char *name, unsigned long def) {
+    const char *flag = getenv(name);
+    if (!flag)
+        return def;
+
+    char *end;
+    unsigned long size = std::strtoul(flag, &end, 0);
+    switch (*end) {
+    case 'G':
+    case 'g':
+        size <<= 10;
+        [[fallthrough]];
+    case 'M':
+    case 'm':
+        size <<= 10;
+        [[fallthrough]];
+    case 'K':
+    case 'k':
+        size <<= 10;
+        end++;
+        break;
+    default:
+        break;
+    }
+
+    if (end == flag || *end) {
+        throw std::runtime_error(std::string(name) +
+                                 " must be a size in bytes, optionally "
+                                 "suffixed with K, M or G");
+    }
+
+    return size;
+}
+
 extern "C" {
 lib_info *lib_info_list = nullptr;
 lib_info *lib_info_list_tail = nullptr;
 int lib_count = 0;
 }
 
-static std::unordered_map<unsigned long, void *> fn_addrs;
+// File the profile of dynamically translated blocks is written to
+static const char *profile_output;
+
+/*
+ * Writes the execution count of every dynamically translated block, for use
+ * with txlat --profile. Addresses in translated libraries are given relative
+ * to the library's guest base, so that they match the addresses in the guest
+ * ELF file.
+ */
+static void write_block_profile() {
+    std::ofstream out(profile_output);
+    if (!out) {
+        std::cerr << "arancini: unable to write profile to " << profile_output
+                  << '\n';
+        return;
+    }
+
+    out << "# object guest-address count\n";
+    for (const auto &[pc, profile] : ctx_->block_profiles()) {
+        std::string object = "?";
+        unsigned long address = pc;
+
+        Dl_info info;
+        if (dladdr(reinterpret_cast<void *>(pc), &info) && info.dli_fname) {
+            object = info.dli_fname;
+            object.erase(0, object.rfind('/') + 1);
+
+            for (lib_info *lib = lib_info_list; lib; lib = lib->next) {
+                Dl_info lib_dl;
+                if (dladdr(lib->base, &lib_dl) &&
+                    lib_dl.dli_fbase == info.dli_fbase) {
+                    address = pc - reinterpret_cast<unsigned long>(lib->base);
+                    break;
+                }
+            }
+        }
+
+        out << fmt::format("{} {:#x} {}\n", object, address, profile.count);
+    }
+}
+
+// Static functions of the translated libraries, sorted by guest address.
+// Functions of the main executable are resolved by MainLoop itself.
+static std::vector<std::pair<unsigned long, void *>> fn_addrs;
 
 /*
  * Initialises the dynamic runtime for the guest program that is about to be
@@ -277,15 +366,128 @@ extern "C" void *initialise_dynamic_runtime(unsigned long entry_point, int argc,
     // Capture interesting signals, such as SIGSEGV.
     init_signals();
 
+    // Layout of the guest address space
+    guest_memory_config memory_config;
+    memory_config.memory_size = get_size_flag("ARANCINI_GUEST_MEMORY_SIZE",
+                                              memory_config.memory_size);
+    unsigned long stack_size = get_size_flag("ARANCINI_GUEST_STACK_SIZE",
+                                             0x10000);
+    // Offset of the top of the stack in the guest address space
+    unsigned long stack_top =
+        get_size_flag("ARANCINI_GUEST_STACK_TOP", memory_config.memory_size);
+    if (stack_top > memory_config.memory_size || stack_size > stack_top) {
+        throw std::runtime_error(
+            "The guest stack must lie within the guest address space");
+    }
+
+    flag = getenv("ARANCINI_HUGE_PAGES");
+    if (flag) {
+        if (util::case_ignore_string_equal(flag, "none"))
+            memory_config.huge_pages = huge_page_mode::none;
+        else if (util::case_ignore_string_equal(flag, "thp"))
+            memory_config.huge_pages = huge_page_mode::thp;
+        else if (util::case_ignore_string_equal(flag, "hugetlb"))
+            memory_config.huge_pages = huge_page_mode::hugetlb;
+        else
+            throw std::runtime_error(
+                "ARANCINI_HUGE_PAGES must be set to one among: none, thp or "
+                "hugetlb (case-insensitive)");
+    }
+
+    flag = getenv("ARANCINI_CODE_MAPPING");
+    if (flag) {
+        using arancini::output::dynamic::code_mapping;
+        if (util::case_ignore_string_equal(flag, "rwx"))
+            memory_config.code_mapping = code_mapping::rwx;
+        else if (util::case_ignore_string_equal(flag, "dual"))
+            memory_config.code_mapping = code_mapping::dual;
+        else if (util::case_ignore_string_equal(flag, "auto"))
+            memory_config.code_mapping = code_mapping::automatic;
+        else
+            throw std::runtime_error(
+                "ARANCINI_CODE_MAPPING must be set to one among: rwx, dual or "
+                "auto (case-insensitive)");
+    }
+
+    flag = getenv("ARANCINI_MEMORY_MODEL");
+    if (flag) {
+#if defined(ARCH_AARCH64)
+        using arancini::output::dynamic::arm64::memory_ordering;
+        if (util::case_ignore_string_equal(flag, "relaxed"))
+            oe.set_memory_ordering(memory_ordering::relaxed);
+        else if (util::case_ignore_string_equal(flag, "acquire-release"))
+            oe.set_memory_ordering(memory_ordering::acquire_release);
+        else
+            throw std::runtime_error(
+                "ARANCINI_MEMORY_MODEL must be set to either relaxed or "
+                "acquire-release (case-insensitive)");
+#else
+        throw std::runtime_error(
+            "ARANCINI_MEMORY_MODEL is only supported by the AArch64 backend");
+#endif
+    }
+
     // Create an execution context for the given input (guest) and output (host)
     // architecture.
-    ctx_ = new execution_context(ia, oe, optimise);
+    ctx_ = new execution_context(ia, oe, optimise, memory_config);
+
+    flag = getenv("ARANCINI_MEMORY_STATS");
+    if (flag && util::case_ignore_string_equal(flag, "true")) {
+        // The guest exits through exit(), so report from an exit handler
+        std::atexit([] { ctx_->report_memory_stats(); });
+    }
+
+    flag = getenv("ARANCINI_PROFILE_OUTPUT");
+    if (flag) {
+        profile_output = flag;
+        ctx_->enable_block_profile();
+        std::atexit(write_block_profile);
+    }
+
+    flag = getenv("ARANCINI_BLOCK_PROFILE");
+    if (flag) {
+        // Number of the most frequently executed blocks to report
+        static unsigned long block_profile_limit;
+        char *end;
+        block_profile_limit = std::strtoul(flag, &end, 10);
+        if (end == flag || *end) {
+            throw std::runtime_error("ARANCINI_BLOCK_PROFILE must be the "
+                                     "number of blocks to report");
+        }
+
+        if (block_profile_limit) {
+            ctx_->enable_block_profile();
+            std::atexit(
+                [] { ctx_->report_block_profile(block_profile_limit); });
+        }
+    }
+
+    flag = getenv("ARANCINI_HOT_THRESHOLD");
+    if (flag) {
+        char *end;
+        auto threshold = std::strtoul(flag, &end, 10);
+        if (end == flag || *end) {
+            throw std::runtime_error("ARANCINI_HOT_THRESHOLD must be the "
+                                     "number of executions of a hot block");
+        }
+
+        ctx_->enable_hot_placement(threshold);
+    }
+
+    flag = getenv("ARANCINI_PERF_MAP");
+    if (flag) {
+        if (util::case_ignore_string_equal(flag, "map"))
+            ctx_->enable_perf_map(false);
+        else if (util::case_ignore_string_equal(flag, "jitdump"))
+            ctx_->enable_perf_map(true);
+        else
+            throw std::runtime_error("ARANCINI_PERF_MAP must be set to either "
+                                     "map or jitdump (case-insensitive)");
+    }
 
     // Create a memory area for the stack.
-    // FIXME hardcoded stack_size and memory size
-    unsigned long stack_size = 0x10000;
     auto stack_base =
-        ctx_->add_memory_region(0x10000000 - stack_size, stack_size, true);
+        ctx_->add_memory_region(stack_top - stack_size, stack_size, true);
 
     // Create the main execution thread.
     auto main_thread = ctx_->create_execution_thread();
@@ -349,7 +551,7 @@ extern "C" void *initialise_dynamic_runtime(unsigned long entry_point, int argc,
             cur_dso->base = lib->base;
 
             for (uint64_t *func_map = lib->func_map; *func_map; func_map += 2) {
-                fn_addrs.emplace(func_map[0], (void *)func_map[1]);
+                fn_addrs.emplace_back(func_map[0], (void *)func_map[1]);
             }
 
             if (lib->tls_len) {
@@ -374,6 +576,8 @@ extern "C" void *initialise_dynamic_runtime(unsigned long entry_point, int argc,
             dsos[i] = cur_dso;
         }
 
+        std::sort(fn_addrs.begin(), fn_addrs.end());
+
         dsos[lib_count] = app_dso;
         dsos[lib_count + 1] = nullptr;
 
@@ -446,18 +650,15 @@ extern "C" void *initialise_dynamic_runtime(unsigned long entry_point, int argc,
 }
 
 /**
- * Register a static function so it can be called from the main loop
- */
-extern "C" void register_static_fn_addr(unsigned long guest_addr,
-                                        void *fn_addr) {
-    fn_addrs.emplace(guest_addr, fn_addr);
-}
-
-/**
- * Look up a static function. Returns nullptr if the function was not found.
+ * Look up a static function of a translated library. Returns nullptr if the
+ * function was not found.
  */
 extern "C" void *lookup_static_fn_addr(unsigned long guest_addr) {
-    if (auto item = fn_addrs.find(guest_addr); item != fn_addrs.end()) {
+    auto item = std::lower_bound(fn_addrs.begin(), fn_addrs.end(), guest_addr,
+                                 [](const auto &entry, unsigned long addr) {
+                                     return entry.first < addr;
+                                 });
+    if (item != fn_addrs.end() && item->first == guest_addr) {
         return item->second;
     }
 
@@ -477,6 +678,108 @@ extern "C" int execute_internal_call(void *cpu_state, int call) {
     return ctx_->internal_call(cpu_state, call);
 }
 
+// Host entry points handed to native libraries in place of guest function
+// pointers (see nlib_guest_callback). A slot stays bound to its guest
+// function for the lifetime of the program, so that the same comparator
+// passed to many qsort() calls reuses one trampoline.
+static constexpr std::size_t nr_guest_callbacks = 64;
+static std::array<unsigned long, nr_guest_callbacks> guest_callbacks;
+static std::size_t nr_bound_callbacks = 0;
+static std::mutex guest_callbacks_lock;
+
+// CPU state of the guest thread that called into the native library. The
+// native library calls back on the same host thread.
+static thread_local x86_cpu_state *guest_callback_state;
+
+/*
+ * Runs the guest function bound to the given slot with integer arguments as
+ * per the SysV ABI and returns its RAX. The IDL only accepts callbacks with
+ * such signatures (see check_callback()).
+ */
+static unsigned long run_guest_callback(std::size_t slot, unsigned long a0,
+                                        unsigned long a1, unsigned long a2,
+                                        unsigned long a3, unsigned long a4,
+                                        unsigned long a5) {
+    // Called by native code, so exceptions cannot propagate from here
+    x86_cpu_state *state = guest_callback_state;
+    if (!state) {
+        util::global_logger.fatal(
+            "Guest callback {:#x} invoked from a thread without guest state\n",
+            guest_callbacks[slot]);
+        abort();
+    }
+
+    state->RDI = a0;
+    state->RSI = a1;
+    state->RDX = a2;
+    state->RCX = a3;
+    state->R8 = a4;
+    state->R9 = a5;
+
+    // Push a dummy return address. MainLoop returns once the guest function
+    // returns past it, and the stack pointer ends up where it started.
+    state->RSP -= 8;
+    *(unsigned long *)state->RSP = 0;
+    state->PC = guest_callbacks[slot];
+
+    MainLoop(state);
+
+    return state->RAX;
+}
+
+template <std::size_t Slot>
+static unsigned long guest_callback_entry(unsigned long a0, unsigned long a1,
+                                          unsigned long a2, unsigned long a3,
+                                          unsigned long a4, unsigned long a5) {
+    return run_guest_callback(Slot, a0, a1, a2, a3, a4, a5);
+}
+
+using guest_callback_fn = unsigned long (*)(unsigned long, unsigned long,
+                                            unsigned long, unsigned long,
+                                            unsigned long, unsigned long);
+
+template <std::size_t... Slots>
+static constexpr std::array<guest_callback_fn, sizeof...(Slots)>
+make_guest_callback_entries(std::index_sequence<Slots...>) {
+    return {&guest_callback_entry<Slots>...};
+}
+
+static constexpr auto guest_callback_entries = make_guest_callback_entries(
+    std::make_index_sequence<nr_guest_callbacks>{});
+
+/*
+ * Entry point from /static/ code before a guest function pointer is passed
+ * to a native library. Returns a host function that calls the guest function
+ * when invoked.
+ */
+extern "C" void *nlib_guest_callback(void *cpu_state,
+                                     unsigned long guest_addr) {
+    if (!guest_addr)
+        return nullptr;
+
+    guest_callback_state = (x86_cpu_state *)cpu_state;
+
+    std::lock_guard<std::mutex> lock(guest_callbacks_lock);
+    auto bound = guest_callbacks.begin() + nr_bound_callbacks;
+    auto slot = std::find(guest_callbacks.begin(), bound, guest_addr);
+    if (slot == bound) {
+        if (nr_bound_callbacks == nr_guest_callbacks) {
+            util::global_logger.fatal(
+                "Unable to pass guest function {:#x} to a native library: "
+                "all {} callback slots are bound\n",
+                guest_addr, nr_guest_callbacks);
+            abort();
+        }
+        *slot = guest_addr;
+        nr_bound_callbacks++;
+
+        util::global_logger.debug("Bound guest callback {:#x} to slot {}\n",
+                                  guest_addr, slot - guest_callbacks.begin());
+    }
+
+    return (void *)guest_callback_entries[slot - guest_callbacks.begin()];
+}
+
 extern "C" void poison(char *s) {
     std::cerr << "Unimplemened Instr: " << s << "\n";
     abort();
@@ -4,9 +4,12 @@
 #include <arancini/runtime/exec/native_syscall.h>
 #include <arancini/runtime/exec/x86/x86-cpu-state.h>
 #include <arancini/util/logger.h>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <fstream>
+#include <limits>
 #include <ostream>
 #include <pthread.h>
 #include <sched.h>
@@ -29,10 +32,18 @@
 #include <linux/futex.h>
 #include <stdexcept>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/uio.h>
 
 extern "C" int MainLoop(void *);
 
+// Set when the guest creates its first thread.  Until then, statically
+// translated code skips its fences (see FenceGuardPass) and the translation
+// engine is not locked.
+extern "C" {
+std::atomic<std::uint8_t> __arancini_guest_multithreaded{0};
+}
+
 using namespace arancini::runtime::exec;
 
 struct loop_args {
@@ -72,11 +83,16 @@ void *MainLoopWrapper(void *args) {
     return NULL;
 };
 
+// Size of the huge pages requested for guest memory (PMD size for 4K pages)
+static constexpr size_t huge_page_size = 2ull << 20;
+
 execution_context::execution_context(input::input_arch &ia,
                                      output::dynamic::dynamic_output_engine &oe,
-                                     bool optimise)
-    : memory_(nullptr), memory_size_(0x10000000ull), brk_{0},
-      brk_limit_{UINTPTR_MAX}, te_(*this, ia, oe, optimise) {
+                                     bool optimise,
+                                     const guest_memory_config &config)
+    : memory_(nullptr), memory_size_(config.memory_size),
+      huge_pages_(config.huge_pages), brk_{0}, brk_limit_{UINTPTR_MAX},
+      te_(*this, ia, oe, optimise, config.code_mapping) {
     allocate_guest_memory();
     brk_ = reinterpret_cast<uintptr_t>(memory_);
     pthread_mutex_init(&big_fat_lock, NULL);
@@ -121,6 +137,10 @@ void execution_context::allocate_guest_memory() {
                                  std::to_string(errno) + ")");
     }
 
+    // The heap and brk live inside the reservation, so they are backed by
+    // transparent huge pages as soon as they are made accessible
+    advise_huge_pages((uintptr_t)memory_, memory_size_);
+
 #if defined(ARCH_X86_64)
     // The GS register is used as the base address for the emulated guest
     // memory.  Static and dynamic code generate memory instructions based on
@@ -129,6 +149,59 @@ void execution_context::allocate_guest_memory() {
 #endif
 }
 
+void execution_context::advise_huge_pages(uintptr_t addr,
+                                          size_t length) const {
+    if (huge_pages_ == huge_page_mode::none || length < huge_page_size)
+        return;
+
+    if (madvise((void *)addr, length, MADV_HUGEPAGE)) {
+        util::global_logger.warn("Unable to use huge pages for {:#x}+{:#x} "
+                                 "({})\n",
+                                 addr, length, errno);
+    }
+}
+
+/*
+ * Prints page fault statistics and how much of the resident memory is backed
+ * by huge pages.
+ */
+void execution_context::report_memory_stats() const {
+    struct rusage usage {};
+    getrusage(RUSAGE_SELF, &usage);
+
+    // Sizes in kB, as reported by the kernel
+    unsigned long rss = 0, thp = 0, hugetlb = 0;
+    std::ifstream smaps("/proc/self/smaps_rollup");
+    std::string key;
+    unsigned long value;
+    while (smaps >> key) {
+        if (!(smaps >> value)) {
+            smaps.clear();
+            smaps.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            continue;
+        }
+        if (key == "Rss:")
+            rss = value;
+        else if (key == "AnonHugePages:")
+            thp = value;
+        else if (key == "Private_Hugetlb:" || key == "Shared_Hugetlb:")
+            hugetlb += value;
+        smaps.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    }
+
+    std::cerr << fmt::format(
+        "arancini: memory: guest-reservation={:#x} minor-faults={} "
+        "major-faults={} rss={}kB thp={}kB hugetlb={}kB "
+        "huge-page-coverage={:.1f}%\n",
+        memory_size_, usage.ru_minflt, usage.ru_majflt, rss + hugetlb, thp,
+        hugetlb,
+        rss + hugetlb ? 100.0 * (thp + hugetlb) / (rss + hugetlb) : 0.0);
+}
+
+void execution_context::report_block_profile(std::size_t limit) const {
+    te_.report_block_profile(std::cerr, limit);
+}
+
 std::shared_ptr<execution_thread> execution_context::create_execution_thread() {
     auto et =
         std::make_shared<execution_thread>(*this, sizeof(x86::x86_cpu_state));
@@ -137,6 +210,21 @@ std::shared_ptr<execution_thread> execution_context::create_execution_thread() {
     return et;
 }
 
+bool execution_context::is_multithreaded() const {
+    return __arancini_guest_multithreaded.load(std::memory_order_acquire);
+}
+
+void execution_context::enter_multithreaded() {
+    if (is_multithreaded())
+        return;
+
+    util::global_logger.info("Guest is now multi-threaded\n");
+
+    // Only this thread exists, so no translation can be in progress
+    te_.enter_multithreaded();
+    __arancini_guest_multithreaded.store(1, std::memory_order_release);
+}
+
 int execution_context::invoke(void *cpu_state) {
     if (!cpu_state)
         throw std::invalid_argument("invoke() received null CPU state");
@@ -157,23 +245,29 @@ int execution_context::invoke(void *cpu_state) {
     // auto* memptr = reinterpret_cast<uint64_t*>(get_memory_ptr(0)) +
     // x86_state->RSP; x86::print_stack(std::cerr, memptr, 20);
 
-    pthread_mutex_lock(&big_fat_lock);
-    auto txln = te_.get_translation(x86_state->PC);
+    // The flag is only set by this thread while the guest is single-threaded
+    bool locked = is_multithreaded();
+    if (locked)
+        pthread_mutex_lock(&big_fat_lock);
+    auto txln = te_.get_translation(x86_state->PC, et->chain_address_);
     if (txln == nullptr) {
         util::global_logger.error("Unable to translate\n");
-        pthread_mutex_unlock(&big_fat_lock);
+        if (locked)
+            pthread_mutex_unlock(&big_fat_lock);
         return 1;
     }
 
-    // Chain
+    if (locked)
+        pthread_mutex_unlock(&big_fat_lock);
+
+    // Chain. Sites are patched with a single atomic store, so this needs no
+    // lock
     if (et->chain_address_) {
         util::global_logger.info("Chaining previous block to {:#x}\n",
                                  util::copy(x86_state->PC));
 
         te_.chain(et->chain_address_, txln->get_code_ptr());
     }
-
-    pthread_mutex_unlock(&big_fat_lock);
     const dbt::native_call_result result = txln->invoke(cpu_state);
 
     et->chain_address_ = result.chain_address;
@@ -341,8 +435,27 @@ int execution_context::internal_call(void *cpu_state, int call) {
                 flags |= MAP_FIXED_NOREPLACE;
             }
 
-            uint64_t ptr = native_syscall(__NR_mmap, addr, length, prot, flags,
-                                          fd, offset);
+            uint64_t ptr = -ENOMEM;
+            bool large_anon = (flags & MAP_ANONYMOUS) && !(flags & MAP_FIXED) &&
+                              length >= huge_page_size;
+            if (large_anon && huge_pages_ == huge_page_mode::hugetlb) {
+                // Huge TLB mappings must be a multiple of the huge page size
+                size_t rounded =
+                    (length + huge_page_size - 1) & ~(huge_page_size - 1);
+                ptr = native_syscall(__NR_mmap, addr, rounded, prot,
+                                     flags | MAP_HUGETLB, fd, offset);
+                if (!(ptr & (1ull << 63))) {
+                    std::lock_guard<std::mutex> lock(hugetlb_lock_);
+                    hugetlb_maps_[ptr] = rounded;
+                }
+            }
+            if (ptr & (1ull << 63)) {
+                // Fall back to regular (possibly transparent huge) pages
+                ptr = native_syscall(__NR_mmap, addr, length, prot, flags, fd,
+                                     offset);
+                if (large_anon && !(ptr & (1ull << 63)))
+                    advise_huge_pages(ptr, length);
+            }
             if (!(ptr & (1ull << 63))) { // Positive return value (No error)
                 ptr -= (uintptr_t)get_memory_ptr(0); // Adjust to guest space
                 // TODO Negative pointer values possible (which might not be a
@@ -371,6 +484,16 @@ int execution_context::internal_call(void *cpu_state, int call) {
             auto addr = (uintptr_t)get_memory_ptr((int64_t)x86_state->RDI);
             uint64_t length = x86_state->RSI;
 
+            // Huge TLB mappings can only be unmapped in whole huge pages
+            if (huge_pages_ == huge_page_mode::hugetlb) {
+                std::lock_guard<std::mutex> lock(hugetlb_lock_);
+                auto hugetlb = hugetlb_maps_.find(addr);
+                if (hugetlb != hugetlb_maps_.end()) {
+                    length = std::max<uint64_t>(length, hugetlb->second);
+                    hugetlb_maps_.erase(hugetlb);
+                }
+            }
+
             // Don't allow arbitrary unmaps?
             x86_state->RAX = native_syscall(__NR_munmap, addr, length);
 
@@ -488,6 +611,9 @@ int execution_context::internal_call(void *cpu_state, int call) {
         {
             util::global_logger.debug("System call: clone()\n");
 
+            // Must happen before the thread is started
+            enter_multithreaded();
+
             auto et = create_execution_thread();
             auto new_x86_state = (x86::x86_cpu_state *)et->get_cpu_state();
             util::global_logger.debug("New CPU state: {:#x}\n",
@@ -98,6 +98,9 @@ static std::optional<po::variables_map> init_options(int argc,
         ("debug", "Enable debugging output")                               //
         ("verbose-link",
          "Enable verbose output of the linker (-Wl,--verbose)")            //
+        ("external-linker",
+         "Link with the linker of the C++ compiler, even if txlat was built "
+         "with LLD")                                                       //
         ("no-script", "Do not use a linker script. Also does not include any "
                       "data from the input binary. Mainly useful as a step to "
                       "generate a linker script.")                         //
@@ -107,10 +110,37 @@ static std::optional<po::variables_map> init_options(int argc,
         ("nlib", po::value<std::string>(),
          "Parse the file at the given path for native library method "
          "definitions to substitute when translating.")                    //
+        ("nlib-functions", po::value<std::string>(),
+         "Comma-separated list of the functions of the nlib file to "
+         "substitute (default: all)")                                      //
         ("disable-flag-opt",
          "Disable optimizations that eliminate uneeded flag computations") //
-        ("llvm-codegen-nofence", "Do not generate fences on memory accesses. "
-                                 "Only safe for single-threaded applications.");
+        ("llvm-codegen-nofence",
+         "Do not generate fences on memory accesses. "
+         "Only safe for single-threaded applications.")                    //
+        ("llvm-memory-model", po::value<std::string>(),
+         "How the ordering of guest memory accesses is enforced: fences "
+         "(default), acquire-release (LDAPR/STLR on AArch64) or none")     //
+        ("llvm-lazy-fences",
+         "Skip fences while the guest has a single thread. Every fence "
+         "checks a flag that the runtime sets on the first clone()")       //
+        ("llvm-partitions", po::value<unsigned>()->default_value(1),
+         "Split the generated LLVM module into this many partitions, which "
+         "are optimised and compiled in parallel")                         //
+        ("cache-dir", po::value<std::string>(),
+         "Reuse the optimised object code of functions that are unchanged "
+         "since a previous translation, using this directory as the cache") //
+        ("recover-cfg",
+         "Recover and translate functions that are not in the symbol table "
+         "(e.g. in stripped binaries) by disassembling from known entry "
+         "points")                                                         //
+        ("profile", po::value<std::string>(),
+         "Block profile written by the runtime (ARANCINI_PROFILE_OUTPUT); code "
+         "it saw running dynamically is translated statically, and its counts "
+         "guide branch weights and the placement of hot functions")        //
+        ("profile-object", po::value<std::string>(),
+         "Name of the translated binary in the profile (defaults to the file "
+         "name of the output)");
 
     po::variables_map vm;
     try {
@@ -1,4 +1,5 @@
 #include <arancini/elf/elf-reader.h>
+#include <arancini/elf/elf-writer.h>
 #include <arancini/input/x86/x86-input-arch.h>
 #include <arancini/ir/chunk.h>
 #include <arancini/ir/default-ir-builder.h>
@@ -13,13 +14,31 @@
 #include <arancini/util/tempfile.h>
 
 #include <chrono>
+#include <cstdio>
 #include <cstdlib>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <map>
 #include <optional>
 #include <ostream>
+#include <sstream>
 #include <string>
 
+#ifdef ARANCINI_IN_PROCESS_LINK
+#include <lld/Common/Driver.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/raw_ostream.h>
+
+// LLD is released with LLVM, so they share the version. The library interface
+// with registered drivers only exists since LLVM 17.
+#if LLVM_VERSION_MAJOR >= 17
+LLD_HAS_DRIVER(elf)
+#else
+#include <lld/Common/CommonLinkerContext.h>
+#endif
+#endif
+
 using namespace arancini::txlat;
 using namespace arancini::elf;
 using namespace arancini::ir;
@@ -50,6 +69,25 @@ static std::string_view architecture{DBT_ARCH_STR_LOWER};
 #error "Cannot determine architecture"
 #endif
 
+// Object file format of the host, used for the generated guest sections
+#if defined(ARCH_RISCV64)
+static constexpr uint16_t host_machine = EM_RISCV;
+static constexpr uint32_t host_elf_flags =
+    EF_RISCV_RVC | EF_RISCV_FLOAT_ABI_DOUBLE;
+static constexpr uint32_t host_reloc_abs64 = R_RISCV_64;
+static constexpr uint32_t host_reloc_pcrel32 = R_RISCV_32_PCREL;
+#elif defined(ARCH_AARCH64)
+static constexpr uint16_t host_machine = EM_AARCH64;
+static constexpr uint32_t host_elf_flags = 0;
+static constexpr uint32_t host_reloc_abs64 = R_AARCH64_ABS64;
+static constexpr uint32_t host_reloc_pcrel32 = R_AARCH64_PREL32;
+#elif defined(ARCH_X86_64)
+static constexpr uint16_t host_machine = EM_X86_64;
+static constexpr uint32_t host_elf_flags = 0;
+static constexpr uint32_t host_reloc_abs64 = R_X86_64_64;
+static constexpr uint32_t host_reloc_pcrel32 = R_X86_64_PC32;
+#endif
+
 void txlat_engine::process_options(
     arancini::output::o_static::static_output_engine &oe,
     const boost::program_options::variables_map &cmdline) {
@@ -62,6 +100,25 @@ void txlat_engine::process_options(
         if (cmdline.count("llvm-codegen-nofence")) {
             llvmoe->set_codegen_fence(false);
         }
+        if (cmdline.count("llvm-memory-model")) {
+            auto model = cmdline.at("llvm-memory-model").as<std::string>();
+            if (model == "fences")
+                llvmoe->set_memory_model(memory_model::fences);
+            else if (model == "acquire-release")
+                llvmoe->set_memory_model(memory_model::acquire_release);
+            else if (model == "none")
+                llvmoe->set_memory_model(memory_model::none);
+            else
+                throw std::runtime_error(
+                    "--llvm-memory-model must be one among: fences, "
+                    "acquire-release or none");
+        }
+        if (cmdline.count("llvm-lazy-fences")) {
+            llvmoe->set_lazy_fences(true);
+        }
+        if (cmdline.count("cache-dir")) {
+            llvmoe->set_cache_dir(cmdline.at("cache-dir").as<std::string>());
+        }
     }
 }
 
@@ -72,6 +129,189 @@ static void run_or_fail(const std::string &cmd) {
     }
 }
 
+#ifdef ARANCINI_IN_PROCESS_LINK
+/*
+  Splits the commands that a compiler driver prints for -### into their
+  arguments. Commands are indented by a space; arguments may be quoted.
+*/
+static std::vector<std::vector<std::string>>
+parse_driver_commands(const std::string &output) {
+    std::vector<std::vector<std::string>> commands;
+    std::istringstream lines(output);
+    std::string line;
+
+    while (std::getline(lines, line)) {
+        if (line.empty() || line[0] != ' ') {
+            continue;
+        }
+
+        std::vector<std::string> args;
+        for (size_t i = 0; i < line.size();) {
+            if (line[i] == ' ') {
+                i++;
+                continue;
+            }
+
+            std::string arg;
+            bool quoted = false;
+            for (; i < line.size() && (quoted || line[i] != ' '); i++) {
+                if (line[i] == '"') {
+                    quoted = !quoted;
+                } else if (quoted && line[i] == '\\' && i + 1 < line.size()) {
+                    arg += line[++i];
+                } else {
+                    arg += line[i];
+                }
+            }
+            args.push_back(std::move(arg));
+        }
+        commands.push_back(std::move(args));
+    }
+
+    return commands;
+}
+
+/*
+  Links in-process with LLD. The compiler driver is only asked for the linker
+  command line (with -###), so that the start files, default libraries and
+  search paths are the same as for an external link. Returns false if the
+  driver would do more than link (e.g. compile a source file).
+*/
+static bool link_in_process(const std::string &cmd) {
+    std::string output;
+    {
+        FILE *driver = popen((cmd + " -### 2>&1").c_str(), "r");
+        if (!driver) {
+            return false;
+        }
+
+        char buffer[4096];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), driver)) > 0) {
+            output.append(buffer, n);
+        }
+        if (pclose(driver) != 0) {
+            return false;
+        }
+    }
+
+    auto commands = parse_driver_commands(output);
+    if (commands.size() != 1) {
+        return false;
+    }
+
+    // GCC links through collect2, whose LTO plugin options are of no use here
+    std::vector<const char *> args{"ld.lld"};
+    const auto &link = commands[0];
+    for (size_t i = 1; i < link.size(); i++) {
+        if (link[i] == "-plugin") {
+            i++;
+        } else if (link[i].rfind("-plugin-opt", 0) != 0) {
+            args.push_back(link[i].c_str());
+        }
+    }
+
+    util::global_logger.info("Linking in-process: {}...\n", cmd);
+#if LLVM_VERSION_MAJOR >= 17
+    lld::Result result = lld::lldMain(args, llvm::outs(), llvm::errs(),
+                                      {{lld::Gnu, &lld::elf::link}});
+    bool linked = result.retCode == 0;
+#else
+    bool linked = lld::elf::link(args, llvm::outs(), llvm::errs(),
+                                 /* exitEarly */ false,
+                                 /* disableOutput */ false);
+    // lldMain() does this from LLVM 17 on
+    lld::CommonLinkerContext::destroy();
+#endif
+    if (!linked) {
+        throw std::runtime_error("error whilst linking");
+    }
+
+    return true;
+}
+#endif
+
+static void link_or_fail(const std::string &cmd, bool external_linker) {
+#ifdef ARANCINI_IN_PROCESS_LINK
+    if (!external_linker && link_in_process(cmd)) {
+        return;
+    }
+#endif
+    run_or_fail(cmd);
+}
+
+/*
+  Instantiates the linker script template `name` for this translation. The
+  rules for the guest sections replace its `INCLUDE "guest-sections.lds"`, so
+  that concurrent translations do not share any file. Like the linker, this
+  looks for the template in the current directory and then in `search_dir`.
+*/
+static std::shared_ptr<basefile>
+generate_linker_script(tempfile_manager &tf, const std::string &prefix,
+                       const std::string &name, const std::string &search_dir,
+                       const std::string &guest_sections) {
+    std::ifstream in(name);
+    if (!in) {
+        in.open(search_dir + "/" + name);
+    }
+    if (!in) {
+        throw std::runtime_error("unable to find linker script " + name);
+    }
+
+    std::stringstream script;
+    script << in.rdbuf();
+    std::string text = script.str();
+
+    static const std::string include = "INCLUDE \"guest-sections.lds\"";
+    auto pos = text.find(include);
+    if (pos == std::string::npos) {
+        throw std::runtime_error("linker script " + name +
+                                 " does not include the guest sections");
+    }
+    text.replace(pos, include.size(), guest_sections);
+
+    auto lds = tf.create_file(prefix, ".lds");
+    auto out = lds->open();
+    out << text;
+    return lds;
+}
+
+/*
+  Reads the block execution counts of the given object from a profile written
+  by the runtime (ARANCINI_PROFILE_OUTPUT).  Each line holds the object, the
+  guest address of a block and its execution count.
+*/
+static std::map<unsigned long, uint64_t>
+read_profile(const std::string &filename, const std::string &object) {
+    std::ifstream in(filename);
+    if (!in) {
+        throw std::runtime_error("unable to open profile '" + filename + "'");
+    }
+
+    std::map<unsigned long, uint64_t> counts;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        std::istringstream fields(line);
+        std::string name, address;
+        uint64_t count;
+        if (!(fields >> name >> address >> count)) {
+            throw std::runtime_error("malformed profile line '" + line + "'");
+        }
+
+        if (name == object) {
+            counts[std::stoul(address, nullptr, 0)] += count;
+        }
+    }
+
+    ::util::global_logger.info("Profile: {} blocks of {}\n", counts.size(),
+                               object);
+    return counts;
+}
+
 /*
   This function acts as the main driver for the binary translation.
   First it parses the ELF binary, lifting each section to the Arancini IR.
@@ -100,8 +340,36 @@ void txlat_engine::translate(
             nlibs = std::nullopt;
         }
     }
+
+    // Optional comma-separated list restricting which of the nlib functions
+    // are redirected to native code
+    std::optional<std::set<std::string>> nlib_enabled;
+    if (nlibs.has_value() && cmdline.count("nlib-functions")) {
+        nlib_enabled.emplace();
+        std::stringstream list(cmdline.at("nlib-functions").as<std::string>());
+        std::string name;
+        while (std::getline(list, name, ',')) {
+            if (name.empty())
+                continue;
+            if (!nlibs->native_functions().count(name)) {
+                ::util::global_logger.warn(
+                    "nlib function {} is not described in the nlib file\n",
+                    name);
+            }
+            nlib_enabled->insert(name);
+        }
+    }
+    auto is_redirected = [&](const std::string &name) {
+        return nlibs.has_value() && nlibs->native_functions().count(name) &&
+               (!nlib_enabled.has_value() || nlib_enabled->count(name));
+    };
 #endif
 
+    // Functions replaced by nlib wrappers, and the subset of those that are
+    // only defined in the static symbol table
+    std::set<std::string> nlib_wrapped;
+    std::set<std::string> nlib_wrapped_static;
+
     // Parse the input ELF file
     const auto &filename = cmdline.at("input").as<std::string>();
     elf_reader elf(filename);
@@ -126,8 +394,36 @@ void txlat_engine::translate(
         intermediate_file->name(), is_exec);
     process_options(*oe, cmdline);
 
+    // All objects produced by the output engine, to be passed to the linker
+    std::string objects = intermediate_file->name();
+    if (auto partitions = cmdline.at("llvm-partitions").as<unsigned>();
+        partitions > 1) {
+        std::vector<std::string> partition_files;
+        for (unsigned i = 1; i < partitions; i++) {
+            auto partition_file = tf.create_file(prefix, ".o");
+            partition_files.push_back(partition_file->name());
+            objects += " " + partition_file->name();
+        }
+        oe->set_partition_outputs(partition_files);
+    }
+
     oe->set_entrypoint(elf.get_entrypoint());
 
+    if (cmdline.count("profile")) {
+        std::string object;
+        if (cmdline.count("profile-object")) {
+            object = cmdline.at("profile-object").as<std::string>();
+        } else {
+            object = std::filesystem::path(
+                         cmdline.count("output")
+                             ? cmdline.at("output").as<std::string>()
+                             : cmdline.at("input").as<std::string>())
+                         .filename();
+        }
+        oe->set_block_counts(
+            read_profile(cmdline.at("profile").as<std::string>(), object));
+    }
+
     std::shared_ptr<symbol_table> dyn_sym;
     std::shared_ptr<symbol_table> sym_t;
     std::shared_ptr<plt_table> plt_tab;
@@ -153,7 +449,8 @@ void txlat_engine::translate(
                     if (sym.section_index() != SHN_UNDEF) {
                         // The current binary defines this symbol so the wrapper
                         // should go here
-                        if (nlibs->native_functions().count(sym.name())) {
+                        if (is_redirected(sym.name()) &&
+                            nlib_wrapped.insert(sym.name()).second) {
                             // We have an external symbol of the right name
                             const nlib_function &func =
                                 nlibs->native_functions().at(sym.name());
@@ -182,6 +479,18 @@ void txlat_engine::translate(
                         sym->value());
                     if (!sym->value())
                         continue;
+#ifdef NLIB
+                    // Statically linked binaries have no dynamic symbols, so
+                    // also redirect functions found in the symbol table
+                    if (is_redirected(sym->name()) &&
+                        nlib_wrapped.insert(sym->name()).second) {
+                        const nlib_function &func =
+                            nlibs->native_functions().at(sym->name());
+                        needed_nlibs.insert(func.libname);
+                        oe->add_chunk(generate_wrapper(*ia, func));
+                        nlib_wrapped_static.insert(sym->name());
+                    }
+#endif
                     if (!sym->size()) {
                         // get the section the symbol is in
 
@@ -194,12 +503,21 @@ void txlat_engine::translate(
                     }
                     unique_translated.insert(*sym);
                     oe->add_chunk(translate_symbol(*ia, elf, *sym));
+                    recover_jump_tables(*ia, elf, *oe, *sym);
                 }
             }
             sym_t = std::move(st);
         }
     }
 
+    // Exported functions already get a guest symbol from the dynamic table
+    if (dyn_sym) {
+        for (const auto &sym : dyn_sym->symbols()) {
+            if (sym.section_index() != SHN_UNDEF)
+                nlib_wrapped_static.erase(sym.name());
+        }
+    }
+
     // PASS2
     for (const auto &p : zero_size) {
         ::util::global_logger.debug("PASS2: doing (0 size), symbol {}\n",
@@ -216,6 +534,19 @@ void txlat_engine::translate(
                                 p.first.section_index(), p.first.info(), 0);
 
         oe->add_chunk(translate_symbol(*ia, elf, fixed_sym));
+        recover_jump_tables(*ia, elf, *oe, fixed_sym);
+    }
+
+    // Recover functions that are not described by the symbol table, as well
+    // as code that ran in the dynamic translator according to the profile
+    std::set<off_t> profiled;
+    for (const auto &[addr, count] : oe->block_counts()) {
+        profiled.insert(addr);
+    }
+    bool recover_cfg = cmdline.count("recover-cfg");
+    if ((recover_cfg || !profiled.empty()) && !cmdline.count("no-static")) {
+        recover_functions(*ia, elf, *oe, unique_translated, plt_tab,
+                          relocations, relocations_r, profiled, recover_cfg);
     }
 
     // Generate decls for external functions found in the relocation table
@@ -270,6 +601,9 @@ void txlat_engine::translate(
 
     // Invoke the output engine, and tell it to write to a temporary file.
     oe->generate();
+    for (const auto &object : oe->additional_objects()) {
+        objects += " " + object;
+    }
 
     // --------------- //
 
@@ -293,20 +627,25 @@ void txlat_engine::translate(
     std::string verbose_link =
         cmdline.count("verbose-link") ? " -Wl,--verbose" : "";
 
+    bool external_linker = cmdline.count("external-linker");
+
     if (cmdline.count("no-script")) {
         if (elf.type() == elf_type::exec) {
-            run_or_fail(cxx_compiler + " -o " +
-                        cmdline.at("output").as<std::string>() +
-                        " -no-pie -latomic " + intermediate_file->name() +
-                        " -l arancini-runtime -L " + arancini_runtime_lib_dir +
-                        " -Wl,-rpath=" + arancini_runtime_lib_dir + debug_info +
-                        verbose_link);
+            link_or_fail(cxx_compiler + " -o " +
+                             cmdline.at("output").as<std::string>() +
+                             " -no-pie -latomic " + objects +
+                             " -l arancini-runtime -L " +
+                             arancini_runtime_lib_dir + " -Wl,-rpath=" +
+                             arancini_runtime_lib_dir + debug_info +
+                             verbose_link,
+                         external_linker);
         } else if (elf.type() == elf::elf_type::dyn) {
-            run_or_fail(
+            link_or_fail(
                 cxx_compiler + " -o " + cmdline.at("output").as<std::string>() +
-                " -shared " + intermediate_file->name() + " -L " +
-                arancini_runtime_lib_dir + " -l arancini-runtime -Wl,-rpath=" +
-                arancini_runtime_lib_dir + debug_info + verbose_link);
+                    " -shared " + objects + " -L " + arancini_runtime_lib_dir +
+                    " -l arancini-runtime -Wl,-rpath=" +
+                    arancini_runtime_lib_dir + debug_info + verbose_link,
+                external_linker);
         }
         return;
     }
@@ -326,15 +665,19 @@ void txlat_engine::translate(
         }
     }
 
-    // Now, we need to create an assembly file that includes the binary data for
+    // Now, we need to create an object file that includes the binary data for
     // each program header, defines all dynsyms of the input binary with
     // `__guest__` prefix, verbatim copies all relocations of the input binary
     // and some metadata
-    auto phobjsrc = tf.create_file(prefix, ".S");
+    auto phobj = tf.create_file(prefix, ".o");
 
-    std::map<uint64_t, std::string> ifuncs =
-        generate_guest_sections(phobjsrc, elf, load_phdrs, filename, dyn_sym,
-                                relocations, relocations_r, sym_t, tls);
+    // The linker script rules that place the guest sections, to be inserted
+    // into the linker script of this translation
+    std::stringstream guest_sections;
+
+    std::map<uint64_t, std::string> ifuncs = generate_guest_sections(
+        phobj, guest_sections, elf, load_phdrs, dyn_sym, relocations,
+        relocations_r, sym_t, tls, nlib_wrapped_static);
 
     if (!cmdline.count("static-binary")) {
         std::string libs;
@@ -374,15 +717,21 @@ void txlat_engine::translate(
         }
 
         if (elf.type() == elf::elf_type::exec) {
+            auto lds = generate_linker_script(
+                tf, prefix, fmt::format("{}.exec.lds", architecture),
+                arancini_runtime_lib_dir, guest_sections.str());
+
             // Generate the final output binary by compiling everything
             // together.
-            run_or_fail(fmt::format(
-                "{} -o {} -no-pie -latomic {} {} {} -larancini-runtime -L {} "
-                "-Wl,-T,{}.exec.lds,-rpath={} {} {}",
-                cxx_compiler, cmdline.at("output").as<std::string>(),
-                intermediate_file->name(), libs, phobjsrc->name(),
-                arancini_runtime_lib_dir, architecture,
-                arancini_runtime_lib_dir, debug_info, verbose_link));
+            link_or_fail(
+                fmt::format(
+                    "{} -o {} -no-pie -latomic {} {} {} -larancini-runtime "
+                    "-L {} -Wl,-T,{},-rpath={} {} {}",
+                    cxx_compiler, cmdline.at("output").as<std::string>(),
+                    objects, libs, phobj->name(), arancini_runtime_lib_dir,
+                    lds->name(), arancini_runtime_lib_dir, debug_info,
+                    verbose_link),
+                external_linker);
         } else if (elf.type() == elf::elf_type::dyn) {
             // Generate the final output library by compiling everything
             // together.
@@ -393,13 +742,20 @@ void txlat_engine::translate(
                           " -DTLS_SIZE=" + std::to_string(tls[0]->mem_size()) +
                           " -DTLS_ALIGN=" + std::to_string(tls[0]->align());
 
-            run_or_fail(
+            auto lds = generate_linker_script(
+                tf, prefix, fmt::format("lib.{}.lds", architecture),
+                arancini_runtime_lib_dir, guest_sections.str());
+
+            // init_lib.c has to be compiled as well, so this falls back to the
+            // external linker
+            link_or_fail(
                 cxx_compiler + " -o " + cmdline.at("output").as<std::string>() +
-                " -fPIC -shared " + intermediate_file->name() + " " +
-                phobjsrc->name() + tls_defines + " init_lib.c -L " +
-                arancini_runtime_lib_dir + " -l arancini-runtime " + libs +
-                fmt::format(" -Wl,-T,lib.{}.lds,-rpath={} {}", architecture,
-                            arancini_runtime_lib_dir, debug_info));
+                    " -fPIC -shared " + objects + " " + phobj->name() +
+                    tls_defines + " init_lib.c -L " + arancini_runtime_lib_dir +
+                    " -l arancini-runtime " + libs +
+                    fmt::format(" -Wl,-T,{},-rpath={} {}", lds->name(),
+                                arancini_runtime_lib_dir, debug_info),
+                external_linker);
         } else {
             throw std::runtime_error("Input elf type must be either an "
                                      "executable or shared object.");
@@ -414,16 +770,23 @@ void txlat_engine::translate(
                 "Can't generate a static binary from a shared object.");
         }
 
+        auto lds = generate_linker_script(
+            tf, prefix, fmt::format("{}.exec.lds", architecture),
+            arancini_runtime_lib_dir, guest_sections.str());
+
         // Generate the final output binary by compiling everything together.
-        run_or_fail(fmt::format(
-            "{} -o {} -no-pie -latomic -static-libgcc -static-libstdc++ {} {} "
-            "-L {} -larancini-runtime-static -larancini-input-x86-static "
-            "-larancini-output-riscv64-static -larancini-ir-static -L {}"
-            "/../../obj -l xed {} -Wl,-T,{}.exec.lds,-rpath={}",
-            cxx_compiler, cmdline.at("output").as<std::string>(),
-            intermediate_file->name(), phobjsrc->name(),
-            arancini_runtime_lib_dir, arancini_runtime_lib_dir, debug_info,
-            architecture, arancini_runtime_lib_dir));
+        link_or_fail(
+            fmt::format(
+                "{} -o {} -no-pie -latomic -static-libgcc -static-libstdc++ "
+                "{} {} -L {} -larancini-runtime-static "
+                "-larancini-input-x86-static -larancini-output-riscv64-static "
+                "-larancini-ir-static -L {}/../../obj -l xed {} "
+                "-Wl,-T,{},-rpath={}",
+                cxx_compiler, cmdline.at("output").as<std::string>(), objects,
+                phobj->name(), arancini_runtime_lib_dir,
+                arancini_runtime_lib_dir, debug_info, lds->name(),
+                arancini_runtime_lib_dir),
+            external_linker);
     }
 
     // Patch relocations in result binary
@@ -511,90 +874,107 @@ void txlat_engine::translate(
 
 void txlat_engine::add_symbol_to_output(
     const std::vector<std::shared_ptr<program_header>> &phbins,
-    const std::map<off_t, unsigned int> &end_addresses, const symbol &sym,
-    std::ofstream &s, std::map<uint64_t, std::string> &ifuncs,
-    bool force_global, bool omit_prefix) {
-    auto type = sym.type();
+    const std::map<off_t, unsigned int> &end_addresses,
+    const std::vector<unsigned int> &segment_sections, const symbol &sym,
+    elf_writer &w, std::map<uint64_t, std::string> &ifuncs, bool force_global,
+    bool omit_prefix) {
+    unsigned char type = ELF64_ST_TYPE(sym.info());
+    if (type == STT_FILE) {
+        type = STT_NOTYPE;
+    }
 
     unsigned int i = end_addresses.upper_bound(sym.value())->second;
     const std::shared_ptr<program_header> &phdr = phbins[i / 2];
+    uint64_t offset =
+        sym.value() - phdr->address() - (i % 2) * (phdr->data_size());
 
     auto name = omit_prefix ? sym.name() : "__guest__" + sym.name();
-    if (strcmp(type, "STT_GNU_IFUNC") == 0) {
-
+    if (type == STT_GNU_IFUNC) {
+        auto &resolver = w.get_symbol(name + "__ifunc");
         if (sym.section_index() != SHN_UNDEF) {
-            s << ".set \"" << name << "__ifunc\", __PH_" << std::dec << i / 2
-              << "_DATA_" << i % 2 << " + "
-              << sym.value() - phdr->address() - (i % 2) * (phdr->data_size())
-              << '\n';
-        }
-
-        s << ".type \"" << name << "__ifunc\", "
-          << "STT_FUNC" << '\n'
-          << ".hidden \"" << name
-          << "__ifunc\"\n"
-
-          // Generate a stub that mimics a resolver with the following assembly
-          // code
-          /*						  name:
-           *  ff 25 00 00 00 00       jmp    QWORD PTR [rip+name_resolve]
-           *  57                      push   rdi
-           *  56                      push   rsi
-           *  52                      push   rdx
-           *  51                      push   rcx
-           *  41 50                   push   r8
-           *  51                      push   rcx
-           *  51                      push   rcx
-           *  e8 00 00 00 00          call   name_ifunc
-           *  41 59                   pop    r9
-           *  41 58                   pop    r8
-           *  59                      pop    rcx
-           *  5a                      pop    rdx
-           *  5e                      pop    rsi
-           *  5f                      pop    rdi
-           *  48 89 05 00 00 00 00    mov    QWORD PTR [rip+name_resolve],rax
-           *  ff e0                   jmp    rax
-           */
-
-          << ".section .data.resolve\n"
-          << '\"' << name << "__resolve\": .quad 1f\n"
-          << ".section .data.ifunc\n"
-          << '\"' << name << "\":\n"
-          << ".byte 0xff, 0x25\n"
-          << "0: .zero 4\n"
-          << "1: .byte 0x57, 0x56, 0x52, 0x51, 0x41, 0x50, 0x41, 0x51, 0xe8\n"
-          << "2: .zero 4\n"
-          << ".byte 0x41, 0x59, 0x41, 0x58, 0x59, 0x5a, 0x5e, 0x5f, 0x48, "
-             "0x89, 0x05\n"
-          << "3: .zero 4\n"
-          << ".byte 0xff, 0xe0\n"
-          << ".reloc 0b, R_RISCV_32_PCREL, \"" << name << "__resolve\" - 4\n"
-          << ".reloc 2b, R_RISCV_32_PCREL, \"" << name << "__ifunc\" - 4\n"
-          << ".reloc 3b, R_RISCV_32_PCREL, \"" << name << "__resolve\" - 4\n";
-
-        type = "STT_FUNC";
+            resolver.section = segment_sections[i];
+            resolver.value = offset;
+        }
+        resolver.type = STT_FUNC;
+        resolver.visibility = STV_HIDDEN;
+
+        // Generate a stub that mimics a resolver with the following assembly
+        // code
+        /*						  name:
+         *  ff 25 00 00 00 00       jmp    QWORD PTR [rip+name_resolve]
+         *  57                      push   rdi
+         *  56                      push   rsi
+         *  52                      push   rdx
+         *  51                      push   rcx
+         *  41 50                   push   r8
+         *  51                      push   rcx
+         *  51                      push   rcx
+         *  e8 00 00 00 00          call   name_ifunc
+         *  41 59                   pop    r9
+         *  41 58                   pop    r8
+         *  59                      pop    rcx
+         *  5a                      pop    rdx
+         *  5e                      pop    rsi
+         *  5f                      pop    rdi
+         *  48 89 05 00 00 00 00    mov    QWORD PTR [rip+name_resolve],rax
+         *  ff e0                   jmp    rax
+         */
+        static const unsigned char stub[] = {
+            0xff, 0x25, 0x00, 0x00, 0x00, 0x00, 0x57, 0x56, 0x52,
+            0x51, 0x41, 0x50, 0x41, 0x51, 0xe8, 0x00, 0x00, 0x00,
+            0x00, 0x41, 0x59, 0x41, 0x58, 0x59, 0x5a, 0x5e, 0x5f,
+            0x48, 0x89, 0x05, 0x00, 0x00, 0x00, 0x00, 0xff, 0xe0};
+
+        auto resolve_section = w.get_section(
+            ".data.resolve", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, 8);
+        auto ifunc_section = w.get_section(".data.ifunc", SHT_PROGBITS,
+                                           SHF_ALLOC | SHF_WRITE);
+        uint64_t resolve = w.size(resolve_section);
+        uint64_t start = w.size(ifunc_section);
+
+        // Initially, the stub jumps to its own resolving code
+        auto &resolve_sym = w.get_symbol(name + "__resolve");
+        resolve_sym.section = resolve_section;
+        resolve_sym.value = resolve;
+        w.append_u64(resolve_section, 0);
+        w.add_section_relocation(resolve_section, resolve, host_reloc_abs64,
+                                 ifunc_section, start + 6);
+
+        auto &stub_sym = w.get_symbol(name);
+        stub_sym.section = ifunc_section;
+        stub_sym.value = start;
+        w.append(ifunc_section, stub, sizeof(stub));
+        w.add_relocation(ifunc_section, start + 2, host_reloc_pcrel32,
+                         name + "__resolve", -4);
+        w.add_relocation(ifunc_section, start + 15, host_reloc_pcrel32,
+                         name + "__ifunc", -4);
+        w.add_relocation(ifunc_section, start + 30, host_reloc_pcrel32,
+                         name + "__resolve", -4);
+
+        type = STT_FUNC;
         ifuncs[sym.value()] = name;
 
     } else if (sym.section_index() != SHN_UNDEF) {
-        s << ".set \"" << name << "\", __PH_" << std::dec << i / 2 << "_DATA_"
-          << i % 2 << " + "
-          << sym.value() - phdr->address() - (i % 2) * (phdr->data_size())
-          << '\n'
-          << ".size \"" << name << "\", " << std::dec << sym.size() << '\n';
+        auto &out = w.get_symbol(name);
+        out.section = segment_sections[i];
+        out.value = offset;
+        out.size = sym.size();
     }
+
+    auto &out = w.get_symbol(name);
     if (force_global || sym.is_global()) {
-        s << ".globl \"" << name << "\"\n";
+        out.binding = STB_GLOBAL;
     } else if (sym.is_weak()) {
-        s << ".weak \"" << name << "\"\n";
+        out.binding = STB_WEAK;
     }
 
-    s << ".type \"" << name << "\", " << type << '\n';
+    out.type = type;
     if (sym.is_hidden() & !force_global) {
-        s << ".hidden \"" << name << "\"\n";
+        out.visibility = STV_HIDDEN;
     } else if (sym.is_internal()) {
-        s << ".internal \"" << name << "\"\n";
+        out.visibility = STV_INTERNAL;
     } else if (sym.is_protected() & !force_global) {
-        s << ".protected \"" << name << "\"\n";
+        out.visibility = STV_PROTECTED;
     }
 }
 
@@ -644,6 +1024,159 @@ txlat_engine::translate_symbol(arancini::input::input_arch &ia,
     return irb.get_chunk();
 }
 
+/*
+  This function looks for jump tables used by the indirect jumps of a translated
+  symbol, so that the output engine can dispatch to the recovered targets
+  directly.
+*/
+void txlat_engine::recover_jump_tables(
+    arancini::input::input_arch &ia, elf_reader &elf,
+    arancini::output::o_static::static_output_engine &oe, const symbol &sym) {
+    auto section = elf.get_section(sym.section_index());
+    if (!section) {
+        return;
+    }
+
+    code_region function{(off_t)sym.value(),
+                         (const void *)((uintptr_t)section->data() +
+                                        sym.value() - section->address()),
+                         sym.size()};
+
+    std::vector<code_region> data;
+    for (const auto &p : elf.program_headers()) {
+        if (p->type() == program_header_type::loadable) {
+            data.push_back({p->address(), p->data(), p->data_size()});
+        }
+    }
+
+    for (const auto &[jump, targets] :
+         ia.recover_jump_tables(function, data)) {
+        oe.add_branch_targets(jump, targets);
+    }
+}
+
+/*
+  This function discovers functions by recursive-descent disassembly of the
+  executable segments and translates those that are not already covered by the
+  symbol table.  Disassembly starts from the entry point, .init_array and
+  .fini_array entries, targets of relative relocations (e.g. function pointers
+  in data) and the functions from the symbol table.  Unless discover is set,
+  only the functions containing a block of the given runtime profile are kept.
+  Profiled blocks are not used as entries themselves: most are not function
+  starts, and a function would be cut short at each of them.
+*/
+void txlat_engine::recover_functions(
+    arancini::input::input_arch &ia, elf_reader &elf,
+    arancini::output::o_static::static_output_engine &oe,
+    const std::set<symbol> &translated,
+    const std::shared_ptr<plt_table> &plt_tab,
+    const std::vector<std::shared_ptr<rela_table>> &relocations,
+    const std::vector<std::shared_ptr<relr_array>> &relocations_r,
+    const std::set<off_t> &profiled, bool discover) {
+    std::vector<code_region> regions;
+    for (const auto &p : elf.program_headers()) {
+        if (p->type() == program_header_type::loadable &&
+            (p->flags() & PF_X)) {
+            regions.push_back({p->address(), p->data(), p->data_size()});
+        }
+    }
+
+    std::set<off_t> discovered{elf.get_entrypoint()};
+    for (const auto &sym : translated) {
+        discovered.insert(sym.value());
+    }
+
+    for (const auto &s : elf.sections()) {
+        if (s->name() == ".init_array" || s->name() == ".fini_array") {
+            const auto *fns = (const uint64_t *)s->data();
+            for (size_t i = 0; i < s->data_size() / sizeof(uint64_t); i++) {
+                discovered.insert(fns[i]);
+            }
+        }
+    }
+
+    for (const auto &rs : relocations) {
+        for (const auto &r : rs->relocations()) {
+            if (r.type() == R_X86_64_RELATIVE) {
+                discovered.insert(r.addend());
+            }
+        }
+    }
+
+    for (const auto &rs : relocations_r) {
+        for (auto reloc : rs->relocations()) {
+            for (const auto &p : elf.program_headers()) {
+                if (p->type() == program_header_type::loadable &&
+                    reloc >= (uint64_t)p->address() &&
+                    reloc + sizeof(uint64_t) <=
+                        (uint64_t)p->address() + p->data_size()) {
+                    discovered.insert(elf.read_relr_addend(p->offset() -
+                                                        p->address() + reloc));
+                    break;
+                }
+            }
+        }
+    }
+
+    // PLT stubs are handled by function declarations
+    std::set<off_t> external;
+    if (plt_tab) {
+        for (const auto &st : plt_tab->stubs()) {
+            external.insert(st.first);
+        }
+    }
+
+    std::map<off_t, off_t> translated_ranges;
+    for (const auto &sym : translated) {
+        translated_ranges[sym.value()] = sym.value() + sym.size();
+    }
+
+    for (const auto &[addr, size] :
+         ia.recover_functions(regions, discovered, external)) {
+        // Skip anything inside a function we already have
+        auto covering = translated_ranges.upper_bound(addr);
+        if (covering != translated_ranges.begin() &&
+            addr < std::prev(covering)->second) {
+            continue;
+        }
+        if (translated_ranges.count(addr) || !size) {
+            continue;
+        }
+        auto block = profiled.lower_bound(addr);
+        if (!discover &&
+            (block == profiled.end() || *block >= addr + (off_t)size)) {
+            continue;
+        }
+
+        int section_index = -1;
+        const auto &sections = elf.sections();
+        for (size_t i = 0; i < sections.size(); i++) {
+            const auto &s = sections[i];
+            if (addr >= s->address() &&
+                addr < s->address() + (off_t)s->data_size()) {
+                section_index = i;
+                break;
+            }
+        }
+        if (section_index < 0 ||
+            sections[section_index]->name().rfind(".plt", 0) == 0) {
+            continue;
+        }
+
+        auto sym = symbol(fmt::format("sub_{:x}", addr), addr, size,
+                          section_index, ELF64_ST_INFO(STB_LOCAL, STT_FUNC), 0);
+        try {
+            oe.add_chunk(translate_symbol(ia, elf, sym));
+            recover_jump_tables(ia, elf, oe, sym);
+        } catch (const std::exception &e) {
+            // Left to the dynamic translator
+            ::util::global_logger.warn(
+                "Unable to translate recovered function {}: {}\n", sym.name(),
+                e.what());
+        }
+    }
+}
+
 void txlat_engine::generate_dot_graph(
     arancini::output::o_static::static_output_engine &oe,
     std::string filename) {
@@ -685,21 +1218,19 @@ void txlat_engine::optimise(
 }
 
 std::map<uint64_t, std::string> txlat_engine::generate_guest_sections(
-    const std::shared_ptr<util::basefile> &phobjsrc, elf::elf_reader &elf,
+    const std::shared_ptr<util::basefile> &phobj, std::ostream &l,
+    elf::elf_reader &elf,
     const std::vector<std::shared_ptr<elf::program_header>> &load_phdrs,
-    const std::basic_string<char> &filename,
     const std::shared_ptr<symbol_table> &dyn_sym,
     const std::vector<std::shared_ptr<elf::rela_table>> &relocations,
     const std::vector<std::shared_ptr<elf::relr_array>> &relocations_r,
     const std::shared_ptr<symbol_table> &sym_t,
-    const std::vector<std::shared_ptr<elf::program_header>> &tls) {
+    const std::vector<std::shared_ptr<elf::program_header>> &tls,
+    const std::set<std::string> &wrapped) {
     std::map<uint64_t, std::string> ifuncs;
     std::map<off_t, unsigned int> end_addresses;
-    auto s = phobjsrc->open();
-
-    // FIXME Currently hardcoded to current directory. Not sure what else to do
-    // since the linker script needs to have this path in it.
-    auto l = std::ofstream("guest-sections.lds");
+    std::vector<unsigned int> segment_sections(2 * load_phdrs.size());
+    elf_writer w(host_machine, host_elf_flags);
 
     if (tls.size() == 1) {
         if (elf.type() == elf::elf_type::exec) {
@@ -707,17 +1238,28 @@ std::map<uint64_t, std::string> txlat_engine::generate_guest_sections(
                             (tls[0]->align() -
                              1); // Assume maximum misalignment penalty.
                                  // Probably actually less. Correct at runtime.
-            s << ".section .data\nguest_exec_tls:\n"
-              << ".quad 0\n"     // next = NULL
-              << ".quad guest_tls\n" // image = guest_tls
-              << ".quad " << std::dec << tls[0]->data_size() << '\n' // len
-              << ".quad " << tls[0]->mem_size() << '\n'              // size
-              << ".quad " << tls[0]->align() << '\n'                 // align
-              << ".quad " << offset << '\n'                          // offset
-              << ".globl guest_exec_tls\n"
-              << "tls_offset:\n"
-              << ".quad " << offset << '\n'
-              << ".globl tls_offset\n";
+            auto data =
+                w.get_section(".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, 8);
+
+            auto &exec_tls = w.get_symbol("guest_exec_tls");
+            exec_tls.section = data;
+            exec_tls.value = w.size(data);
+            exec_tls.binding = STB_GLOBAL;
+
+            w.append_u64(data, 0); // next = NULL
+            w.add_relocation(data, w.size(data), host_reloc_abs64, "guest_tls",
+                             0);
+            w.append_u64(data, 0);                   // image = guest_tls
+            w.append_u64(data, tls[0]->data_size()); // len
+            w.append_u64(data, tls[0]->mem_size());  // size
+            w.append_u64(data, tls[0]->align());     // align
+            w.append_u64(data, offset);              // offset
+
+            auto &tls_offset = w.get_symbol("tls_offset");
+            tls_offset.section = data;
+            tls_offset.value = w.size(data);
+            tls_offset.binding = STB_GLOBAL;
+            w.append_u64(data, offset);
         }
     } else if (tls.size() > 1) {
         throw std::runtime_error("More than 1 TLS PHDR unsupported");
@@ -740,14 +1282,19 @@ std::map<uint64_t, std::string> txlat_engine::generate_guest_sections(
           << ".gph.load" << std::dec << i << ".2) } :gphdr" << std::dec << i
           << '\n';
 
-        s << ".section .gph.load" << std::dec << i << ".1, \"a";
+        uint64_t flags = SHF_ALLOC;
         if (phdr->flags() & PF_W) {
-            s << 'w';
+            flags |= SHF_WRITE;
         }
-        //			if (phdr->flags() & PF_X) {
-        //				s << 'x';
-        //			}
-        s << "\"\n";
+
+        // The segment contents are copied straight from the mapped input
+        auto data = w.get_section(fmt::format(".gph.load{}.1", i),
+                                  SHT_PROGBITS, flags);
+        w.set_contents(data, phdr->data(), phdr->data_size());
+        segment_sections[2 * i] = data;
+
+        auto &ph_data = w.get_symbol(fmt::format("__PH_{}_DATA_0", i));
+        ph_data.section = data;
 
         if (tls.size() == 1) {
             // Other cases handled below
@@ -756,65 +1303,80 @@ std::map<uint64_t, std::string> txlat_engine::generate_guest_sections(
             // (typically at the start), add a symbol so we can initialize it at
             // runtime.
             if (phdr->offset() == tls[0]->offset()) {
-                s << "guest_tls:\n";
+                w.get_symbol("guest_tls").section = data;
             }
         }
 
-        s << ".ifndef guest_base\nguest_base:\n.globl guest_base\n.hidden "
-             "guest_base\n";
-        if (elf.type() == elf::elf_type::exec) {
-            s << "guest_exec_base:\n.globl guest_exec_base\n";
+        if (!w.has_symbol("guest_base")) {
+            auto &guest_base = w.get_symbol("guest_base");
+            guest_base.section = data;
+            guest_base.binding = STB_GLOBAL;
+            guest_base.visibility = STV_HIDDEN;
+            if (elf.type() == elf::elf_type::exec) {
+                auto &exec_base = w.get_symbol("guest_exec_base");
+                exec_base.section = data;
+                exec_base.binding = STB_GLOBAL;
+            }
         }
-        s << ".endif\n";
 
-        s << "__PH_" << std::dec << i << "_DATA_0: .incbin \"" << filename
-          << "\", " << phdr->offset() << ", " << phdr->data_size() << std::endl;
         if (phdr->mem_size() - phdr->data_size()) {
             end_addresses[phdr->address() + phdr->mem_size()] = 2 * i + 1;
-            s << ".section .gph.load" << std::dec << i << ".2, \"a";
-            if (phdr->flags() & PF_W) {
-                s << 'w';
-            }
-            //				if (phdr->flags() & PF_X) {
-            //					s << 'x';
-            //				}
-            s << "\", @nobits\n";
-            // Using .zero n does not work with symbols
-            s << "__PH_" << std::dec << i << "_DATA_1: .rept " << std::dec
-              << phdr->mem_size() - phdr->data_size() << "\n.byte 0\n.endr\n";
+
+            // Only the size of the zero-initialised tail is recorded
+            auto bss = w.get_section(fmt::format(".gph.load{}.2", i),
+                                     SHT_NOBITS, flags);
+            w.reserve(bss, phdr->mem_size() - phdr->data_size());
+            segment_sections[2 * i + 1] = bss;
+
+            w.get_symbol(fmt::format("__PH_{}_DATA_1", i)).section = bss;
         }
     }
 
     if (dyn_sym) {
         for (const auto &sym : dyn_sym->symbols()) {
-            add_symbol_to_output(load_phdrs, end_addresses, sym, s, ifuncs);
+            add_symbol_to_output(load_phdrs, end_addresses, segment_sections,
+                                 sym, w, ifuncs);
         }
     }
 
+    auto pending_wrapped = wrapped;
     for (const auto &sym : sym_t->symbols()) {
         if (sym.name() == "_DYNAMIC" && sym.section_index() != SHN_UNDEF) {
 
-            add_symbol_to_output(load_phdrs, end_addresses, sym, s, ifuncs,
-                                 true);
-            s << ".hidden __guest___DYNAMIC\n";
+            add_symbol_to_output(load_phdrs, end_addresses, segment_sections,
+                                 sym, w, ifuncs, true);
+            w.get_symbol("__guest___DYNAMIC").visibility = STV_HIDDEN;
             if (elf.type() == elf::elf_type::exec) {
                 symbol sy{"guest_exec_DYNAMIC", sym.value(), sym.size(),
                           sym.section_index(),  sym.info(),  0};
-                add_symbol_to_output(load_phdrs, end_addresses, sy, s, ifuncs,
-                                     true, true);
+                add_symbol_to_output(load_phdrs, end_addresses,
+                                     segment_sections, sy, w, ifuncs, true,
+                                     true);
             }
         }
+        // The output engine registers wrapped functions under their guest
+        // address, so they need a guest symbol even if they are not exported
+        if (sym.is_func() && sym.section_index() != SHN_UNDEF &&
+            pending_wrapped.erase(sym.name())) {
+            add_symbol_to_output(load_phdrs, end_addresses, segment_sections,
+                                 sym, w, ifuncs, true);
+            w.get_symbol("__guest__" + sym.name()).visibility = STV_HIDDEN;
+        }
         static const std::set<std::string> symbols_to_copy_global{
             "main_ctor_queue",    "__malloc_replaced", "__libc",
             "__thread_list_lock", "__sysinfo",         "__environ"};
         if (symbols_to_copy_global.count(sym.name())) {
-            add_symbol_to_output(load_phdrs, end_addresses, sym, s, ifuncs,
-                                 true);
+            add_symbol_to_output(load_phdrs, end_addresses, segment_sections,
+                                 sym, w, ifuncs, true);
         }
     }
 
     // Manually emit relocations into the .grela section
-    s << ".section .grela, \"a\"\n";
+    auto grela = w.get_section(".grela", SHT_PROGBITS, SHF_ALLOC, 8);
+    auto tp_reloc = w.get_section(".data.tp_reloc", SHT_PROGBITS,
+                                  SHF_ALLOC | SHF_WRITE, 8);
+    auto dtpmod_reloc = w.get_section(".data.dtpmod_reloc", SHT_PROGBITS,
+                                      SHF_ALLOC | SHF_WRITE, 8);
 
     for (const auto &relocs : relocations_r) {
         for (const auto &reloc : relocs->relocations()) {
@@ -827,8 +1389,9 @@ std::map<uint64_t, std::string> txlat_engine::generate_guest_sections(
                 elf.read_relr_addend(phdr->offset() - phdr->address() + reloc);
 
             // FIXME hardcoded 3 as RELATIVE reloc type
-            s << ".quad 0x" << std::hex << reloc << "\n.quad 3\n.quad 0x"
-              << addend << '\n';
+            w.append_u64(grela, reloc);
+            w.append_u64(grela, 3);
+            w.append_u64(grela, addend);
         }
     }
 
@@ -841,9 +1404,9 @@ std::map<uint64_t, std::string> txlat_engine::generate_guest_sections(
                 // Use a relative reloc to the stub function instead. Identify
                 // the needed function by the original addend.
                 if (ifuncs.count(reloc.addend())) {
-                    s << ".quad 0x" << std::hex << reloc.offset()
-                      << "\n.quad 0x20000003\n.quad 0x" << reloc.addend()
-                      << '\n';
+                    w.append_u64(grela, reloc.offset());
+                    w.append_u64(grela, 0x20000003);
+                    w.append_u64(grela, reloc.addend());
                 }
             } else if (reloc.is_tpoff()) {
                 // For TP relative relocations, we only know the offset after
@@ -856,13 +1419,10 @@ std::map<uint64_t, std::string> txlat_engine::generate_guest_sections(
                         "TP relative reloc in binary not supported.");
                 }
 
-                s << ".section .data.tp_reloc\n.ifndef "
-                     "__TPREL_INIT\n__TPREL_INIT:\n.endif\n"
-                  << "0: .quad 0x" << std::hex << reloc.offset() << ", 0x"
-                  << reloc.addend() << '\n'
-                  << ".reloc 0b, R_RISCV_64, 0x" << std::hex << reloc.offset()
-                  << '\n'
-                  << ".section .grela\n";
+                w.add_relocation(tp_reloc, w.size(tp_reloc), host_reloc_abs64,
+                                 "", reloc.offset());
+                w.append_u64(tp_reloc, reloc.offset());
+                w.append_u64(tp_reloc, reloc.addend());
             } else if (reloc.is_dtpmod()) {
 
                 if (elf.type() == elf_type::exec) {
@@ -875,43 +1435,69 @@ std::map<uint64_t, std::string> txlat_engine::generate_guest_sections(
                         "DTPMOD reloc with non-0 symbol/addend unsupported.");
                 }
 
-                s << ".section .data.dtpmod_reloc\n.ifndef "
-                     "__DTPMOD_INIT\n__DTPMOD_INIT:\n.endif\n"
-                  << "0: .quad 0x" << std::hex << reloc.offset() << '\n'
-                  << ".reloc 0b, R_RISCV_64, 0x" << std::hex << reloc.offset()
-                  << '\n'
-                  << ".section .grela\n";
+                w.add_relocation(dtpmod_reloc, w.size(dtpmod_reloc),
+                                 host_reloc_abs64, "", reloc.offset());
+                w.append_u64(dtpmod_reloc, reloc.offset());
 
             } else if (reloc.is_relative()) {
-                s << ".quad 0x" << std::hex << reloc.offset() << "\n.int 0x"
-                  << reloc.type_on_host() << "\n.int 0x" << reloc.symbol()
-                  << "\n.quad 0x" << reloc.addend() << '\n';
+                w.append_u64(grela, reloc.offset());
+                w.append_u32(grela, reloc.type_on_host());
+                w.append_u32(grela, reloc.symbol());
+                w.append_u64(grela, reloc.addend());
             } else {
                 // Mark this relocation as needing adjustment on the symbol
                 // index (it needs to match the index of the symbol in the
                 // generated binary). Set the 4th highest bit of the type to
                 // indicate this.
-                s << ".quad 0x" << std::hex << reloc.offset() << "\n.int 0x"
-                  << (0x10000000 | reloc.type_on_host()) << "\n.int 0x"
-                  << reloc.symbol() << "\n.quad 0x" << reloc.addend() << '\n';
+                w.append_u64(grela, reloc.offset());
+                w.append_u32(grela, 0x10000000 | reloc.type_on_host());
+                w.append_u32(grela, reloc.symbol());
+                w.append_u64(grela, reloc.addend());
             }
         }
     }
 
-    s << ".section .data.tp_reloc\n.ifndef "
-         "__TPREL_INIT\n__TPREL_INIT:\n.endif\n.quad 0x0, 0x0\n"
-      << ".globl __TPREL_INIT\n.type __TPREL_INIT, STT_OBJECT\n.size "
-         "__TPREL_INIT, . - __TPREL_INIT \n.hidden __TPREL_INIT\n"
-      << ".section .data.dtpmod_reloc\n.ifndef "
-         "__DTPMOD_INIT\n__DTPMOD_INIT:\n.endif\n.quad 0x0\n"
-      << ".globl __DTPMOD_INIT\n.type __DTPMOD_INIT, STT_OBJECT\n.size "
-         "__DTPMOD_INIT, . - __DTPMOD_INIT \n.hidden __DTPMOD_INIT\n"
-      << ".ifndef guest_tls\n.set guest_tls, 0\n.endif\n.globl "
-         "guest_tls\n.hidden guest_tls\n";
-    if (elf.type() == elf_type::exec) {
-        s << ".ifndef tls_offset\ntls_offset:\n.quad 0\n.globl "
-             "tls_offset\n.endif\n";
+    // Both arrays are terminated by a zero entry
+    w.append_u64(tp_reloc, 0);
+    w.append_u64(tp_reloc, 0);
+    w.append_u64(dtpmod_reloc, 0);
+
+    auto &tprel_init = w.get_symbol("__TPREL_INIT");
+    tprel_init.section = tp_reloc;
+    tprel_init.size = w.size(tp_reloc);
+    tprel_init.binding = STB_GLOBAL;
+    tprel_init.type = STT_OBJECT;
+    tprel_init.visibility = STV_HIDDEN;
+
+    auto &dtpmod_init = w.get_symbol("__DTPMOD_INIT");
+    dtpmod_init.section = dtpmod_reloc;
+    dtpmod_init.size = w.size(dtpmod_reloc);
+    dtpmod_init.binding = STB_GLOBAL;
+    dtpmod_init.type = STT_OBJECT;
+    dtpmod_init.visibility = STV_HIDDEN;
+
+    auto &guest_tls = w.get_symbol("guest_tls");
+    if (guest_tls.section == SHN_UNDEF) {
+        guest_tls.section = SHN_ABS;
+    }
+    guest_tls.binding = STB_GLOBAL;
+    guest_tls.visibility = STV_HIDDEN;
+
+    if (elf.type() == elf_type::exec && !w.has_symbol("tls_offset")) {
+        auto data =
+            w.get_section(".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, 8);
+        auto &tls_offset = w.get_symbol("tls_offset");
+        tls_offset.section = data;
+        tls_offset.value = w.size(data);
+        tls_offset.binding = STB_GLOBAL;
+        w.append_u64(data, 0);
     }
 
+    // Non-allocated marker section; the guest sections never need an
+    // executable stack
+    w.get_section(".note.GNU-stack", SHT_PROGBITS, 0);
+
+    w.write(phobj->name());
+
     return ifuncs;
 }
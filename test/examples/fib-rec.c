@@ -0,0 +1,21 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+// Deliberately naive, to stress guest calls and returns
+static unsigned fib(unsigned n) {
+    if (n < 2)
+        return n;
+
+    return fib(n - 1) + fib(n - 2);
+}
+
+int main(int argc, char *argv[]) {
+
+    if (argc < 2)
+        return -1;
+
+    unsigned n = atoi(argv[1]);
+
+    printf("Result: %u\n", fib(n));
+    return 0;
+}
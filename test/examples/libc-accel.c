@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Exercises the libc routines described in src/native_lib/libc.nlib. The
+// output must be identical whether the binary is translated with or without
+// --nlib, and matches native execution.
+
+#define BUF_SIZE 4096
+
+static unsigned long checksum(const unsigned char *buf, size_t n) {
+    unsigned long sum = 0;
+    for (size_t i = 0; i < n; i++)
+        sum = sum * 31 + buf[i];
+    return sum;
+}
+
+// The C library's rand() differs between C libraries, so the expected output
+// would depend on the one the binary was linked with
+static unsigned long next_random(void) {
+    static unsigned long state = 88172645463325252ul;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static int cmpint(const void *a, const void *b) {
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+
+    unsigned rounds = argc > 1 ? atoi(argv[1]) : 1;
+
+    static unsigned char src[BUF_SIZE + 64];
+    static unsigned char dst[BUF_SIZE + 64];
+    static char str[BUF_SIZE + 1];
+    static int nums[BUF_SIZE];
+
+    for (unsigned i = 0; i < sizeof(src); i++)
+        src[i] = next_random();
+
+    unsigned long copy = 0, set = 0, cmp = 0, len = 0, chr = 0;
+    for (unsigned r = 0; r < rounds; r++) {
+        // Sizes and alignments around typical vector widths
+        for (size_t n = 0; n <= BUF_SIZE; n = n ? n * 2 + 1 : 1) {
+            for (size_t off = 0; off < 17; off += 3) {
+                memcpy(dst + off, src + (off ^ 5), n);
+                copy += checksum(dst + off, n);
+
+                memmove(dst + 1, dst, n);
+                copy += checksum(dst, n + 1);
+
+                memset(dst + off, (int)(n + off), n);
+                set += checksum(dst + off, n);
+
+                memcpy(dst, src, n);
+                if (n)
+                    dst[n / 2] ^= 1;
+                int c = memcmp(dst, src, n);
+                cmp += (c > 0) - (c < 0) + 1;
+            }
+        }
+
+        for (size_t n = 0; n < BUF_SIZE; n = n * 3 + 1) {
+            for (size_t i = 0; i < n; i++)
+                str[i] = 'a' + (src[i] % 26);
+            str[n] = '\0';
+
+            len += strlen(str);
+
+            const char *p = strchr(str, 'q');
+            chr += p ? (unsigned long)(p - str) : n;
+            chr += strchr(str, '\0') == str + n;
+        }
+    }
+
+    for (unsigned i = 0; i < BUF_SIZE; i++)
+        nums[i] = next_random() % 1000;
+    qsort(nums, BUF_SIZE, sizeof(int), cmpint);
+
+    int sorted = 1;
+    for (unsigned i = 1; i < BUF_SIZE; i++)
+        sorted &= nums[i - 1] <= nums[i];
+    unsigned long order = checksum((const unsigned char *)nums, sizeof(nums));
+
+    printf("memcpy/memmove: %lx\n", copy);
+    printf("memset: %lx\n", set);
+    printf("memcmp: %lu\n", cmp);
+    printf("strlen: %lu\n", len);
+    printf("strchr: %lu\n", chr);
+    printf("qsort: %s %lx\n", sorted ? "sorted" : "unsorted", order);
+    return 0;
+}
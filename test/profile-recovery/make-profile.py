@@ -0,0 +1,27 @@
+#! /bin/python3
+
+# Writes a block profile (see docs/profiling.md) that holds every instruction
+# of a function as a block, as if it had run in the dynamic translator
+
+import re
+import sys
+import argparse
+import subprocess
+
+parser = argparse.ArgumentParser()
+parser.add_argument('binary', help='Unstripped binary containing the function')
+parser.add_argument('function', help='Name of the function to profile')
+parser.add_argument('object', help='Object name to write to the profile')
+parser.add_argument('output', help='Profile to write')
+args = parser.parse_args()
+
+disasm = subprocess.run(["objdump", "-d", f"--disassemble={args.function}", args.binary],
+                        capture_output=True, text=True, check=True).stdout
+
+addresses = [int(m.group(1), 16) for m in re.finditer(r"^\s+([0-9a-f]+):\t", disasm, re.M)]
+if len(addresses) < 2:
+    sys.exit(f"function {args.function} not found in {args.binary}")
+
+with open(args.output, 'w') as f:
+    for address in addresses:
+        f.write(f"{args.object} {address:#x} 1\n")
@@ -0,0 +1,41 @@
+// Built without libc and stripped, so that work() is only found by function
+// recovery, from the call in _start
+
+static void write_stdout(const char *s, unsigned long len) {
+    __asm__ volatile("syscall"
+                     :
+                     : "a"(1), "D"(1), "S"(s), "d"(len)
+                     : "rcx", "r11", "memory");
+}
+
+// Several blocks, all of which end up in the profile
+__attribute__((noipa)) unsigned long work(unsigned long n) {
+    unsigned long sum = 0;
+
+    for (unsigned long i = 0; i < n; i++) {
+        if (i % 3 == 0)
+            sum += i * 2;
+        else if (i % 5 == 0)
+            sum ^= i;
+        else
+            sum += 1;
+    }
+
+    return sum;
+}
+
+void _start(void) {
+    char buf[32];
+    char *p = buf + sizeof(buf);
+    unsigned long sum = work(1000);
+
+    *--p = '\n';
+    do {
+        *--p = '0' + sum % 10;
+        sum /= 10;
+    } while (sum);
+    write_stdout(p, buf + sizeof(buf) - p);
+
+    __asm__ volatile("syscall" : : "a"(60), "D"(0));
+    __builtin_unreachable();
+}
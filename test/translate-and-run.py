@@ -59,6 +59,7 @@ class Tester:
 
         self.config = {
             'compile_flags': [],
+            'libraries': [], # guest libraries to translate and link against
             'compile_environment': env, # default environment same as tester's
             'compile_artifacts': [],
             'compile_artifact_reference': {},
@@ -88,9 +89,20 @@ class Tester:
 
 
     def run(self):
+        library_flags = []
+        for library in self.config["libraries"]:
+            # Relative to the input binary, as they are built together
+            library = os.path.join(os.path.dirname(self.input_bin), library)
+            logger.info(f"Translating library: {library}")
+
+            translated = self.compile(library, self.config["compile_flags"])
+            self.config["produced_artifacts"].append(translated)
+            library_flags += ["--library", translated]
+
         logger.info("Translating input binary")
 
-        translated = self.compile()
+        translated = self.compile(self.input_bin,
+                                  [*self.config["compile_flags"], *library_flags])
         self.config["produced_artifacts"].append(translated)
 
         # TODO: generalize this to check artifacts for runtime execution too
@@ -127,10 +139,10 @@ class Tester:
             if os.path.exists(output_file):
                 os.remove(output_file)
 
-    def compile(self):
-        output_file = self.input_bin + ".out"
-        compile_command = [self.txlat_path, "--input", self.input_bin, "--output", output_file,
-                           *self.config["compile_flags"]]
+    def compile(self, input_bin, flags):
+        output_file = input_bin + ".out"
+        compile_command = [self.txlat_path, "--input", input_bin, "--output", output_file,
+                           *flags]
         proc = subprocess.run(compile_command, env=self.config['compile_environment'],
                               capture_output=True, text=True, errors="ignore")
         if proc.returncode != 0:
@@ -0,0 +1,25 @@
+// Built without libc, so that only this library has to be translated along
+// with the executable
+
+static long write_stdout(const char *s, unsigned long len) {
+    long ret;
+    __asm__ volatile("syscall"
+                     : "=a"(ret)
+                     : "a"(1), "D"(1), "S"(s), "d"(len)
+                     : "rcx", "r11", "memory");
+    return ret;
+}
+
+unsigned long greet(const char *name) {
+    static const char hello[] = "Hello ";
+    unsigned long len = 0;
+
+    while (name[len])
+        len++;
+
+    write_stdout(hello, sizeof(hello) - 1);
+    write_stdout(name, len);
+    write_stdout("!\n", 2);
+
+    return len;
+}
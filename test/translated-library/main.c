@@ -0,0 +1,10 @@
+// Calls into a translated library through the PLT
+
+unsigned long greet(const char *name);
+
+void _start(void) {
+    long status = greet("translated library") == 18 ? 0 : 1;
+
+    __asm__ volatile("syscall" : : "a"(60), "D"(status));
+    __builtin_unreachable();
+}